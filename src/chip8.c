@@ -1,11 +1,23 @@
+#define _DEFAULT_SOURCE     // glibc hides shm_open/mmap and M_PI under -std=c17
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "SDL.h"
+#include "chip8.h"
 
 // Emulator states
 typedef enum {
@@ -14,6 +26,14 @@ typedef enum {
     PAUSED,
 } emul_state_t;
 
+// Upscaling filters applied to the faded framebuffer before it is uploaded
+typedef enum {
+    SCALE_NEAREST,  // Blocky pixels, optionally outlined
+    SCALE_2X,       // Scale2x/AdvMAME2x edge smoothing
+    SCALE_3X,       // Scale3x/AdvMAME3x
+    SCALE_4X,       // Scale2x applied twice
+} upscale_filter_t;
+
 // CHIP-8 extensions/quirks support
 typedef enum {
     CHIP8,      // Original CHIP-8 behavior
@@ -21,12 +41,12 @@ typedef enum {
     XOCHIP,     // XO-CHIP extensions
 } extension_t;
 
-typedef struct {
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-    SDL_AudioSpec want, have;
-    SDL_AudioDeviceID dev;
-} sdl_t;
+// Fast engines the --diff mode can check against the reference interpreter
+typedef enum {
+    DIFF_OFF,
+    DIFF_FUSED,                     // Superinstructions (emulate_frame with fusion on)
+    DIFF_BATCH,                     // Lane 0 of the batched structure-of-arrays engine
+} diff_engine_t;
 
 typedef struct {
     uint32_t window_width;  // SDL Window Dimensions
@@ -43,8 +63,179 @@ typedef struct {
     float color_lerp_rate;          // Rate of interpolation between 0.0 and 1.0, inclusive
     bool use_sine_wave;             // Flag to choose between square and sine wave
     extension_t current_extension;  // Current quirks/extension support
+    upscale_filter_t upscale_filter;    // Filter used to build the screen texture
+    uint32_t grid_count;            // Number of instances hosted in grid mode (0 = single instance)
+    uint32_t grid_threads;          // Worker threads used to emulate grid instances
+    const char *shm_name;           // POSIX shared-memory segment to publish frames into (NULL = off)
+    uint16_t netplay_port;          // Local UDP port for rollback netplay (0 = off)
+    const char *netplay_peer;       // Remote peer as host:port
+    uint8_t netplay_player;         // 1 owns the left half of the keypad, 2 the right half
+    uint32_t rollback_frames;       // Max frames simulated ahead of confirmed remote input
+    uint32_t batch_lanes;           // Run a headless batched benchmark with this many lanes (0 = off)
+    uint32_t batch_frames;          // Frames the batched benchmark runs for
+    bool fusion;                    // Run known opcode sequences as superinstructions
+    const char *fusion_profile;     // Opcode profile the fused sequences are picked from (NULL = built-in)
+    const struct fusion_set *fusion_set;    // Fused sequences, picked at startup (NULL = loop idioms only)
+    bool profile_opcodes;           // Count adjacent opcode pairs/triples and report them at exit
+    const char *profile_out;        // Profile file this run's counts are added to at exit (NULL = off)
+    struct profile *profile;        // Counts while profiling, NULL otherwise
+    const char *metrics_path;       // File the metrics are periodically written to (NULL = off)
+    uint32_t metrics_interval;      // Milliseconds between metrics dumps
+    struct metrics *metrics;        // Live metrics while exporting, NULL otherwise
+    struct trace *trace;            // Last instructions run one by one, NULL when not tracing
+    bool log_traps;                 // Log the first invalid opcode each machine runs into
+    diff_engine_t diff_engine;      // Engine checked in lockstep against the reference (DIFF_OFF = off)
+    uint32_t diff_frames;           // Frames each differential run lasts
+    uint32_t diff_fuzz;             // Random opcode ROMs to check instead of the given ROM (0 = use the ROM)
+    uint32_t diff_seed;             // Seed of the keys and fuzz ROMs, 0 = pick from the clock
+    const char *rom_dir;            // Directory preloaded as the ROM library (NULL = off)
+    struct rom_library *library;    // Loaded ROM library, switched with PAGEUP/PAGEDOWN
+    const char *pack_path;          // ROM pack the ROM is loaded from (NULL = load ROM files)
+    const char *pack_out;           // Pack the ROM directory given as the ROM into this file (NULL = off)
+    struct rom_pack *pack;          // Mapped ROM pack, NULL when loading ROM files
+    const char *record_path;        // Recording base name, writes <path>.c8v and <path>.wav (NULL = off)
+    const char *convert_path;       // Convert the .c8v given as the ROM into this Y4M file (NULL = off)
+    bool latency_probe;             // Print the time from each key press to the frame showing it
+    struct input_queue *input;      // Timestamped key changes for the next frame, NULL = apply at once
+    uint32_t audio_buffer;          // Audio device buffer size in samples
+    uint8_t search_value;           // Value the RAM search keeps addresses equal to (F6)
+    struct ram_search *search;      // RAM search driven by F1-F7, NULL = off
+    uint64_t fuzz_execs;            // Coverage-guided fuzzing executions to run on the ROM (0 = off)
+    uint32_t fuzz_frames;           // Frames each fuzzing execution lasts
+    bool fuzz_rom;                  // Mutate ROM bytes as well as the key presses
+    uint32_t fuzz_seed;             // Seed of the mutator and the machine's RNG, 0 = pick from the clock
+    const char *fuzz_replay;        // Replay these recorded key presses on the ROM (NULL = off)
+    struct coverage *coverage;      // PC-edge hit counts while fuzzing, NULL otherwise
+    struct hud *hud;                // Performance overlay toggled with H, NULL = not available
+    bool vip_timing;                // Charge COSMAC VIP cycle costs against a per-frame cycle budget
+    struct sound_queue *sound;      // Timestamped sound on/off events for the callback, NULL = pause the device
 } config_t;
 
+// Runtime metrics, written out in Prometheus text format by a background thread. Each counter
+// except instructions has a single writer thread, so recording is a plain relaxed load and
+// store (no locked instruction) and readers still never see a torn value.
+#define METRICS_BUCKETS 496         // Frame time histogram, 8 linear sub-buckets per power of two ns
+#define METRICS_EXPORT_FIRST 144    // Buckets written out, a fixed set from 2^20 ns (about 1ms)
+#define METRICS_EXPORT_LAST 224     // up to 2^30 ns (about 1s)
+typedef struct metrics {
+    _Atomic uint64_t instructions;
+    _Atomic uint64_t frame_time_ns;                 // Sum of all recorded frame times
+    _Atomic uint64_t frame_time[METRICS_BUCKETS];   // Frame count per bucket, their total is the frame count
+    _Atomic uint64_t audio_callbacks;
+    _Atomic uint64_t audio_samples;
+    _Atomic uint64_t audio_underruns;
+    _Atomic bool audio_paused;      // Device was paused since the last callback, its gap is no underrun
+    uint64_t audio_last;            // Audio thread only: counter at the previous callback
+    double ns_per_tick;             // Performance counter tick length
+    uint32_t target_ips;            // Configured instructions per second of one machine
+    const char *path;
+    uint32_t interval;              // Milliseconds between dumps
+    SDL_Thread *thread;
+    _Atomic bool quit;
+} metrics_t;
+
+// A/V recording. The main loop and the audio callback only copy into bounded single-producer
+// rings, a background thread encodes and writes them.
+#define RECORD_FRAMES 64                // Video queue, about a second of frames
+#define RECORD_SAMPLES 65536            // Audio queue, must be a power of two
+#define C8V_MAGIC "C8V1"
+
+typedef struct {
+    uint64_t display[32];
+    bool sound;                     // Audio device was playing when the frame ended
+} record_frame_t;
+
+typedef struct recorder {
+    record_frame_t frames[RECORD_FRAMES];
+    _Atomic uint32_t frame_head;    // Frames pushed by the main loop
+    _Atomic uint32_t frame_tail;    // Frames taken by the writer
+    int16_t samples[RECORD_SAMPLES];
+    _Atomic uint32_t sample_head;   // Samples pushed by the audio callback
+    _Atomic uint32_t sample_tail;   // Samples taken by the writer
+    _Atomic uint64_t dropped_frames;    // Pushed while the queue was full
+    _Atomic uint64_t dropped_samples;
+    _Atomic bool paused;            // Emulation is paused, the callback's silence is not recorded
+    FILE *video, *audio;
+    uint64_t last[32];              // Writer only: previous frame, video frames are stored as deltas
+    uint32_t video_frames;
+    uint64_t audio_bytes;
+    uint32_t sample_rate;
+    uint32_t slack;                 // Audio queued ahead of the video beyond this is dropped
+    SDL_Thread *thread;
+    _Atomic bool quit;
+} recorder_t;
+
+// Sound on/off changes from the main loop to the audio callback, single producer and single
+// consumer. Times are samples of the emulated clock, which the callback maps onto its own
+// sample count so that every beep starts and stops on the exact sample.
+#define SOUND_EVENTS 256            // Must be a power of two
+typedef struct {
+    uint64_t time;                  // Emulated time in samples
+    bool on;
+    bool now;                       // Apply at the start of the next buffer, time is ignored
+} sound_event_t;
+
+typedef struct sound_queue {
+    sound_event_t events[SOUND_EVENTS];
+    _Atomic uint32_t head;          // Events pushed by the main loop
+    _Atomic uint32_t tail;          // Events taken by the audio callback
+    bool on;                        // Main loop only: state of the last pushed event
+} sound_queue_t;
+
+// Audio callback state, the waveform is produced with integer math only
+#define BLEP_TAPS 16                // Length of the band-limited step residual, in samples
+#define BLEP_PHASES 32              // Sub-sample positions the residual is tabulated for
+#define BLEP_RING 32                // Output delay line, must be >= BLEP_TAPS
+typedef struct {
+    config_t *config;
+    uint8_t pattern[16];            // XO-CHIP 1-bit pattern, MSB of byte 0 plays first
+    bool use_pattern;               // Play the pattern instead of the plain tone
+    uint8_t pitch;                  // XO-CHIP pitch register
+    uint32_t pitch_step[256];       // Pattern phase increment per output sample for each pitch
+    int16_t sine[256];              // One sine period, Q15
+    int16_t blep[BLEP_PHASES][BLEP_TAPS];   // Band-limited step minus ideal step, Q15
+    uint32_t phase;                 // Phase accumulator, wraps once per tone period / pattern
+    int32_t level;                  // Current level of the 1-bit waveform
+    int32_t ring[BLEP_RING];        // Pending output samples
+    uint32_t ring_pos;
+    metrics_t *metrics;             // NULL when metrics are off
+    recorder_t *recorder;           // NULL when not recording
+    sound_queue_t sound;
+    bool gate;                      // Tone is audible, always true when the device is paused instead
+    uint64_t played;                // Samples produced so far
+    uint64_t sound_offset;          // Added to an event time to get its sample in played terms
+    bool synced;                    // sound_offset has been set from an event
+    uint32_t checked;               // Queue position after the last event checked against the window
+    uint32_t latency;               // Samples between the current buffer and a fresh event
+} audio_t;
+
+// Performance overlay drawn into the screen texture. The main loop records where each frame's
+// time went, emulate_frame counts the instructions actually run.
+#define HUD_HISTORY 64              // Frames shown in the frame time graph
+#define HUD_SCALE 4                 // Minimum texture pixels per CHIP-8 pixel while the HUD is shown
+typedef struct hud {
+    bool visible;
+    uint64_t frame[HUD_HISTORY];    // Wall time of each frame, performance counter ticks
+    uint64_t emulate[HUD_HISTORY];  // Part of it spent emulating
+    uint64_t render[HUD_HISTORY];   // Part of it spent fading, upscaling and presenting
+    uint32_t pos;                   // Next history slot
+    uint64_t instructions;          // Run since window_start
+    uint64_t window_start;          // Start of the current one second IPS window
+    uint32_t ips;                   // Instructions per second over the last window
+} hud_t;
+
+typedef struct {
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_AudioSpec want, have;
+    SDL_AudioDeviceID dev;
+    audio_t *audio;
+    SDL_Texture *screen;            // Streaming texture holding the upscaled framebuffer
+    uint32_t screen_scale;          // Texture pixels per CHIP-8 pixel
+    uint64_t screen_hash;           // Hash of the frame currently in the texture
+    bool hud_drawn;                 // The texture holds the HUD on top of the frame
+} sdl_t;
+
 //chip 8 instruction format
 typedef struct {
     uint16_t opcode;    // every opcode is 2 bytes in length
@@ -55,25 +246,312 @@ typedef struct {
     uint8_t y;          //4 bit register identifiers
 }instruction_t;
 
+// RAM is split into pages so machines can share the font and ROM until they write to them
+#define RAM_PAGE_SIZE 256
+#define RAM_PAGES (4096 / RAM_PAGE_SIZE)
+
+// Superinstructions: loop idioms with hand-written handlers, and the straight-line sequences of
+// the fusion set, which run their opcodes' handlers back to back
+typedef enum {
+    FUSE_NONE,
+    FUSE_WAIT_LOOP,                 // FX07 3X00 1NNN, jumping back to the FX07: wait for the delay timer
+    FUSE_COUNT_LOOP,                // 7XNN 3XKK 1NNN, jumping back to the 7XNN: count VX up to KK
+    FUSE_SEQUENCE,                  // FUSE_SEQUENCE + i: sequence i of the fusion set
+} fusion_t;
+
+// Power-on memory image (font + ROM), loaded once and shared read-only by every machine reset from it
+typedef struct {
+    uint8_t ram[4096];
+    uint8_t fusion[4096];           // fusion_t of the sequence starting at each address of ram
+    const char *rom_name;
+    uint32_t rom_size;              //bytes loaded at 0x200
+    uint32_t refs;                  //machines still pointing at this image
+} rom_image_t;
+
+// ROM library: a directory of ROMs kept in memory, switched at runtime
+typedef struct rom_library {
+    char **paths;                   // Sorted by name
+    rom_image_t **images;           // NULL until first switched to when the library is a ROM pack
+    const struct rom_pack *pack;    // Images are loaded from this pack on demand, NULL = all preloaded
+    uint32_t count;
+    uint32_t current;               // Entry the single-instance machine was last switched to
+} rom_library_t;
+
+// Opcode classes counted by --profile, the first entry whose mask/match fits an opcode wins
+typedef struct {
+    uint16_t mask;
+    uint16_t match;
+    const char *name;
+} opcode_class_t;
+
+#define OPCODE_CLASSES 38
+const opcode_class_t opcode_classes[OPCODE_CLASSES] = {
+    {0xFFFF, 0x00E0, "00E0"}, {0xFFFF, 0x00EE, "00EE"}, {0xF000, 0x0000, "0NNN"},
+    {0xF000, 0x1000, "1NNN"}, {0xF000, 0x2000, "2NNN"}, {0xF000, 0x3000, "3XNN"},
+    {0xF000, 0x4000, "4XNN"}, {0xF00F, 0x5000, "5XY0"}, {0xF000, 0x6000, "6XNN"},
+    {0xF000, 0x7000, "7XNN"}, {0xF00F, 0x8000, "8XY0"}, {0xF00F, 0x8001, "8XY1"},
+    {0xF00F, 0x8002, "8XY2"}, {0xF00F, 0x8003, "8XY3"}, {0xF00F, 0x8004, "8XY4"},
+    {0xF00F, 0x8005, "8XY5"}, {0xF00F, 0x8006, "8XY6"}, {0xF00F, 0x8007, "8XY7"},
+    {0xF00F, 0x800E, "8XYE"}, {0xF00F, 0x9000, "9XY0"}, {0xF000, 0xA000, "ANNN"},
+    {0xF000, 0xB000, "BNNN"}, {0xF000, 0xC000, "CXNN"}, {0xF000, 0xD000, "DXYN"},
+    {0xF0FF, 0xE09E, "EX9E"}, {0xF0FF, 0xE0A1, "EXA1"}, {0xFFFF, 0xF002, "F002"},
+    {0xF0FF, 0xF007, "FX07"}, {0xF0FF, 0xF00A, "FX0A"}, {0xF0FF, 0xF015, "FX15"},
+    {0xF0FF, 0xF018, "FX18"}, {0xF0FF, 0xF01E, "FX1E"}, {0xF0FF, 0xF029, "FX29"},
+    {0xF0FF, 0xF033, "FX33"}, {0xF0FF, 0xF03A, "FX3A"}, {0xF0FF, 0xF055, "FX55"},
+    {0xF0FF, 0xF065, "FX65"}, {0x0000, 0x0000, "????"},
+};
+
+uint8_t opcode_class(const uint16_t opcode) {
+    uint8_t c = 0;
+    while ((opcode & opcode_classes[c].mask) != opcode_classes[c].match) c++;
+    return c;
+}
+
+// Counts of opcode class sequences that ran back to back from adjacent addresses, the only
+// sequences a superinstruction can replace
+typedef struct profile {
+    uint64_t pairs[OPCODE_CLASSES][OPCODE_CLASSES];
+    uint64_t triples[OPCODE_CLASSES][OPCODE_CLASSES][OPCODE_CLASSES];
+    uint64_t executed;
+    uint8_t prev[2];                // Classes of the last two instructions, most recent first
+    uint32_t prev_addr[2];          // and their addresses
+} profile_t;
+
+// Straight-line sequences to fuse, the ones that save the most dispatches in an opcode profile
+#define FUSION_SEQUENCES 16
+typedef struct {
+    uint64_t count;                 // Times the sequence ran in the profile
+    uint8_t length;                 // 2 or 3 opcodes
+    uint8_t classes[3];             // opcode_classes index of each opcode
+    uint8_t ops[3];                 // and the op_t handler that runs it
+} fusion_sequence_t;
+
+typedef struct fusion_set {
+    fusion_sequence_t sequences[FUSION_SEQUENCES];  // Most dispatches saved first
+    uint32_t count;
+} fusion_set_t;
+
+// Ring of the last instructions run one by one, dumped when --diff finds a divergence
+#define TRACE_LENGTH 32
+typedef struct {
+    uint32_t frame;
+    uint16_t addr;
+    uint16_t opcode;
+} trace_entry_t;
+
+typedef struct trace {
+    trace_entry_t entries[TRACE_LENGTH];
+    uint32_t count;                 // Instructions recorded so far, the newest is count - 1
+    uint32_t frame;                 // Frame the next instructions belong to
+} trace_t;
+
+// PC-edge coverage for --fuzz: each executed edge between two instruction addresses bumps a
+// hit counter, the same scheme AFL uses for basic blocks
+#define COVERAGE_SIZE 16384         // Must be a power of two
+typedef struct coverage {
+    uint8_t map[COVERAGE_SIZE];
+    uint16_t prev;                  // Hashed previous address, shifted so A->B and B->A differ
+} coverage_t;
+
+// COSMAC VIP timing (--vip-timing): slots are machine cycles of the VIP's 1802 (8 clocks at
+// 1.76 MHz), and every instruction uses up as many as the VIP interpreter takes to run it
+#define VIP_FRAME_CYCLES 3668       // Machine cycles per 60hz frame
+#define VIP_INTERRUPT_CYCLES 1068   // Taken each frame by the display DMA (128 scanlines x 8 bytes) and interrupt
+
+// Paces the host loop against absolute frame deadlines, so time spent rendering or oversleeping
+// in one frame is taken out of the next instead of adding up
+#define IDLE_WAIT_MS 250            // Longest block while paused or waiting on FX0A
+typedef struct {
+    uint64_t period;                // Performance counter ticks per 60hz frame
+    uint64_t deadline;              // Counter value the current frame ends at, 0 = start now
+    uint64_t oversleep;             // How late SDL_Delay has been waking up recently, in ticks
+} frame_timer_t;
+
+// Key changes queued with their SDL timestamps. Each frame covers the time since the previous
+// one, so a change is applied before the instruction at the same point of the frame instead of
+// all of them landing on the frame boundary.
+#define INPUT_QUEUE 64
+typedef struct {
+    uint32_t time;                  // SDL event timestamp, ms
+    uint32_t instr;                 // Instruction of the frame it is applied before
+    uint8_t key;
+    bool down;
+} input_event_t;
+
+typedef struct input_queue {
+    input_event_t events[INPUT_QUEUE];
+    uint32_t count;                 // Events queued for the next frame
+    uint32_t applied;               // Events already applied during the current frame
+    uint32_t window_start;          // SDL ticks when the previous frame was scheduled
+    // Latency probe: time from a key press to the first frame on screen that differs
+    bool probe;
+    uint32_t probe_time;            // Timestamp of the press being measured, 0 = none
+    uint32_t probe_frames;          // Frames presented since, given up after a second
+    uint64_t probe_display[32];     // Screen when the press was applied
+    uint32_t probe_count, probe_min, probe_max;
+    uint64_t probe_sum;
+} input_queue_t;
+
+// Faults a ROM can run into. The machine carries on as before (addresses wrap, the stack is a
+// ring, invalid opcodes are skipped) but records the first one for --fuzz.
+typedef enum {
+    FAULT_NONE,
+    FAULT_OPCODE,                   // Invalid opcode
+    FAULT_MEMORY,                   // Access through I past 0xFFF
+    FAULT_STACK_OVERFLOW,           // 2NNN with 16 calls already on the stack
+    FAULT_STACK_UNDERFLOW,          // 00EE with an empty stack
+    FAULTS
+} fault_t;
+
 // Chip8 Machine object
 typedef struct {
     emul_state_t state;
-    uint8_t ram[4096]; 
-    bool display[64*32];
-    uint32_t pixel_color[64*32];    //color to lerp (?)
+    uint8_t *page[RAM_PAGES];       //each page points into the shared ROM image until first written
+    uint16_t private_pages;         //bit p set = page p is this machine's own copy
+    rom_image_t *rom;
+    uint64_t display[32];           //one row per word, pixel x of a row is bit 63 - x
+    uint32_t *pixel_color;          //color to lerp (?), 64*32 entries owned by the caller
     uint16_t stack[16];
     uint16_t *stack_ptr;
     uint8_t V[16];                  //the register file, V0 --> VF
     uint16_t I;                     //The register to store memory address
     uint16_t PC;
-    uint8_t delay_timer; 
-    uint8_t sound_timer;
-    bool keypad[16];
+    uint8_t delay_timer;            //value the delay timer was set to at slot delay_set, read with get_delay_timer
+    uint8_t sound_timer;            //value the sound timer was set to at slot sound_set, read with get_sound_timer
+    uint64_t delay_set, sound_set;
+    uint16_t keypad;                //bit n set = key n held down
     const char *rom_name;
     instruction_t inst;             //currently executing instruction for debugging purposes
     bool draw;                      //flag to indicate if the screen needs to be redrawn
+    uint64_t dirty_rows;            //rows whose pixels changed since the last render, bit y = row y
+    uint64_t fade_rows;             //rows whose colors are still fading towards fg/bg
+    uint32_t rng;                   //per-instance xorshift state for CXNN, so instances can run on any thread
+    uint8_t audio_pattern[16];      //XO-CHIP 1-bit audio pattern loaded by F002
+    uint8_t pitch;                  //XO-CHIP pitch register set by FX3A
+    bool audio_pattern_loaded;      //the plain tone plays until the ROM loads a pattern
+    bool audio_dirty;               //pattern or pitch changed since the audio callback last saw them
+    uint32_t traps;                 //invalid opcodes executed (and skipped) since the last reset
+    uint64_t cycles;                //instruction slots since reset, every frame is a whole budget of them
+    uint32_t tick_slots;            //slots per 60hz timer tick, frames end on multiples of it
+    uint8_t fault;                  //first fault_t raised since reset, FAULT_NONE if none
+    uint16_t fault_pc;              //address of the instruction that raised it
 } chip8_t;
 
+// Grid mode: many chip8 instances rendered into one window through a shared texture atlas
+typedef struct {
+    chip8_t *chip8s;
+    bool *beeping;                  // Sound timer state of each instance after its last frame
+    uint32_t *pixel_colors;         // 64*32 fade colors per instance
+    uint32_t count;                 // Number of hosted instances
+    uint32_t cols, rows;            // Atlas layout in tiles
+    uint32_t tile_scale;            // Window pixels per CHIP-8 pixel
+    uint32_t focus;                 // Instance receiving keyboard input
+    bool focus_changed;             // Focus moved since the last frame
+    const config_t *config;
+    SDL_Texture *atlas;
+    uint32_t *pixels;               // Locked atlas pixels while a frame is being produced
+    int pitch;                      // Locked atlas pitch in pixels
+    SDL_Thread **threads;
+    uint32_t thread_count;
+    SDL_mutex *lock;
+    SDL_cond *start, *done;
+    uint32_t generation;            // Bumped once per frame to wake the workers
+    uint32_t busy;                  // Workers still running the current frame
+    SDL_atomic_t next;              // Next instance index to hand out
+    bool quit;
+} grid_t;
+
+// Shared-memory frame export, the segment layout (shm_frame_t) is declared in chip8.h
+typedef struct {
+    shm_frame_t *frame;             // Mapped segment (NULL = export disabled)
+    const char *name;
+    uint16_t keypad;                // External keypad mask applied last frame
+} shm_t;
+
+// Emulation state needed to rewind a machine, presentation state (pixel_color) is left out.
+// Only pages the machine has written are stored, the rest still match its ROM image.
+typedef struct {
+    uint16_t private_pages;
+    uint8_t pages[RAM_PAGES][RAM_PAGE_SIZE];
+    uint64_t display[32];
+    uint16_t stack[16];
+    uint8_t stack_depth;
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint64_t delay_set, sound_set;
+    uint16_t keypad;
+    uint32_t rng;
+    uint8_t audio_pattern[16];
+    uint8_t pitch;
+    bool audio_pattern_loaded;
+    uint64_t cycles;
+} chip8_state_t;
+
+// Rollback netplay: each peer owns half of the keypad and predicts the other half
+#define NETPLAY_MAGIC 0x504E3843    // "C8NP"
+#define NETPLAY_RING 32             // Frames of history kept, must exceed twice the rollback window
+#define NETPLAY_MAX_ROLLBACK 15
+#define NETPLAY_P1_KEYS 0x05B7      // Keys 1 2 4 5 7 8 A 0, the left two keypad columns
+
+typedef struct {
+    uint32_t magic;
+    uint32_t frame;                 // Frame of the newest input in inputs[count-1]
+    uint16_t count;
+    uint16_t inputs[NETPLAY_RING / 2];
+} netplay_packet_t;
+
+typedef struct {
+    int sock;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint16_t own_keys;              // Keypad mask owned by this peer
+    uint32_t rollback;              // Max frames simulated ahead of confirmed remote input
+    uint32_t frame;                 // Next frame to simulate
+    int64_t remote_confirmed;       // Newest frame with known remote input (-1 = none)
+    uint16_t local_input[NETPLAY_RING];
+    uint16_t remote_input[NETPLAY_RING];
+    uint16_t predicted[NETPLAY_RING];   // Remote input each simulated frame actually used
+    chip8_state_t *snapshots;       // State at the start of each frame, NETPLAY_RING entries
+    bool beeping;                   // Sound timer state after the newest frame
+    uint64_t rollbacks;
+    uint64_t resimulated;
+} netplay_t;
+
+// Batched engine, V/PC/I/timers/stack for all lanes are stored structure-of-arrays so that a
+// step where every lane executes the same opcode runs as plain loops across lanes that the
+// compiler vectorizes. Lanes that diverge fall back to a per-lane interpreter.
+struct batch {
+    uint32_t lanes;
+    config_t config;
+    uint8_t *V;                     // V[reg * lanes + lane]
+    uint16_t *PC;
+    uint16_t *I;
+    uint8_t *delay_timer;
+    uint8_t *sound_timer;
+    uint16_t *stack;                // stack[depth * lanes + lane]
+    uint8_t *stack_depth;
+    uint16_t *keypad;               // Keypad mask per lane
+    uint32_t *rng;
+    uint8_t *ram;                   // ram[lane * 4096 + address]
+    uint8_t *rom;                   // Power-on ram image shared by every lane
+    uint8_t *frames;                // Observations, frames[lane * 64*32 + pixel]
+    uint8_t *active;                // 0 once a lane hit the CHIP8 display wait this frame
+    uint16_t *opcode;               // Opcode each lane fetched this step
+    uint16_t reward_addr;
+    uint8_t *reward_prev;
+    uint64_t executed;              // Instructions executed across all lanes
+};
+
+// RAM search state: the snapshot filters compare against and the surviving addresses
+struct ram_search {
+    uint8_t snapshot[4096];
+    uint64_t candidates[4096 / 64];
+    uint32_t count;
+};
+
 //Lerp function to interpolate between two colors, as in to smoothly transition between two colors
 uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const float t)
 {
@@ -95,43 +573,265 @@ uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const
     return (ret_r << 24) | (ret_g << 16) | (ret_b << 8) | ret_a;
 }
 
+// Histogram bucket of a duration: exact below 8ns, then 8 sub-buckets per power of two
+uint32_t metrics_bucket(const uint64_t ns) {
+    if (ns < 8) return (uint32_t)ns;
+    const uint32_t e = 63 - __builtin_clzll(ns);
+    return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+}
+
+// Smallest duration that falls into bucket b
+uint64_t metrics_bucket_floor(const uint32_t b) {
+    if (b < 8) return b;
+    return (uint64_t)(8 + b % 8) << (b / 8 - 1);
+}
+
+// Add to a counter only one thread writes
+void metrics_add(_Atomic uint64_t *counter, const uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Record the wall time of one pass through the main loop, SDL_Delay included
+void metrics_record_frame(metrics_t *metrics, const uint64_t ticks) {
+    const uint64_t ns = (uint64_t)(ticks * metrics->ns_per_tick);
+
+    metrics_add(&metrics->frame_time_ns, ns);
+    metrics_add(&metrics->frame_time[metrics_bucket(ns)], 1);
+}
+
+// A callback arriving more than two buffers after the previous one means the device ran dry
+void metrics_record_audio(metrics_t *metrics, const uint32_t samples, const uint32_t sample_rate) {
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const bool paused = atomic_exchange_explicit(&metrics->audio_paused, false, memory_order_relaxed);
+    const double buffer_ns = 1e9 * samples / sample_rate;
+
+    if (metrics->audio_last && !paused && (now - metrics->audio_last) * metrics->ns_per_tick > 2 * buffer_ns) {
+        metrics_add(&metrics->audio_underruns, 1);
+    }
+    metrics->audio_last = now;
+    metrics_add(&metrics->audio_callbacks, 1);
+    metrics_add(&metrics->audio_samples, samples);
+}
+
+// Queue the frame the main loop just finished. A full queue drops the frame rather than make
+// the main loop wait for the disk.
+void record_frame(recorder_t *recorder, const chip8_t *chip8, const bool sound) {
+    const uint32_t head = atomic_load_explicit(&recorder->frame_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&recorder->frame_tail, memory_order_acquire) == RECORD_FRAMES) {
+        metrics_add(&recorder->dropped_frames, 1);
+        return;
+    }
+
+    record_frame_t *frame = &recorder->frames[head % RECORD_FRAMES];
+    memcpy(frame->display, chip8->display, sizeof(frame->display));
+    frame->sound = sound;
+    atomic_store_explicit(&recorder->frame_head, head + 1, memory_order_release);
+}
+
+// Queue the samples the audio callback just produced, whatever does not fit is dropped. While
+// emulation is paused no frames are recorded, so neither are samples.
+void record_audio(recorder_t *recorder, const int16_t *samples, const uint32_t count) {
+    if (atomic_load_explicit(&recorder->paused, memory_order_relaxed)) return;
+    const uint32_t head = atomic_load_explicit(&recorder->sample_head, memory_order_relaxed);
+    const uint32_t space = RECORD_SAMPLES - (head - atomic_load_explicit(&recorder->sample_tail, memory_order_acquire));
+    const uint32_t n = count < space ? count : space;
+    const uint32_t start = head % RECORD_SAMPLES;
+    const uint32_t first = n < RECORD_SAMPLES - start ? n : RECORD_SAMPLES - start;
+
+    memcpy(&recorder->samples[start], samples, first * sizeof(int16_t));
+    memcpy(recorder->samples, samples + first, (n - first) * sizeof(int16_t));
+    atomic_store_explicit(&recorder->sample_head, head + n, memory_order_release);
+    if (n < count) metrics_add(&recorder->dropped_samples, count - n);
+}
+
+// Emulated time of the current instruction slot, in audio samples
+uint64_t sound_time(const chip8_t *chip8, const config_t *config) {
+    return chip8->cycles * config->audio_sample_rate / ((uint64_t)chip8->tick_slots * 60);
+}
+
+// Tell the audio callback the tone turns on or off at this time (or right away with now). Only
+// changes are queued. A full queue keeps the old state so that the next call retries.
+void sound_gate(sound_queue_t *sound, const uint64_t time, const bool on, const bool now) {
+    if (sound->on == on) return;
+
+    const uint32_t head = atomic_load_explicit(&sound->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&sound->tail, memory_order_acquire) == SOUND_EVENTS) return;
+
+    sound->events[head % SOUND_EVENTS] = (sound_event_t){ .time = time, .on = on, .now = now };
+    atomic_store_explicit(&sound->head, head + 1, memory_order_release);
+    sound->on = on;
+}
+
+// Precompute the callback's tables so that it never needs floating point math
+void init_audio(audio_t *audio, config_t *config) {
+    *audio = (audio_t){.config = config, .pitch = 64, .gate = true};
+
+    // XO-CHIP plays the 128-bit pattern at 4000*2^((pitch-64)/48) bits per second
+    for (uint32_t pitch = 0; pitch < 256; pitch++) {
+        const double rate = 4000.0 * pow(2.0, ((double)pitch - 64.0) / 48.0);
+        audio->pitch_step[pitch] = (uint32_t)(rate / 128.0 / config->audio_sample_rate * 4294967296.0);
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        audio->sine[i] = (int16_t)(32767.0 * sin(2.0 * M_PI * i / 256.0));
+    }
+
+    // Band-limited step: running integral of a Blackman-windowed sinc cut off just below Nyquist,
+    // sampled at every tap and sub-sample offset. Only its difference from an ideal step is kept.
+    const uint32_t steps = 64;
+    const uint32_t half = BLEP_TAPS / 2;
+    double integral[BLEP_TAPS * 64 + 1];
+    double sum = 0.0;
+    for (uint32_t i = 0; i <= BLEP_TAPS * steps; i++) {
+        const double t = (double)i / steps - half;
+        const double window = 0.42 + 0.5 * cos(M_PI * t / half) + 0.08 * cos(2.0 * M_PI * t / half);
+        const double sinc = (t == 0.0) ? 1.0 : sin(0.9 * M_PI * t) / (0.9 * M_PI * t);
+        sum += window * sinc;
+        integral[i] = sum;
+    }
+    for (uint32_t phase = 0; phase < BLEP_PHASES; phase++) {
+        for (uint32_t tap = 0; tap < BLEP_TAPS; tap++) {
+            // Time of this tap relative to the edge, which happened phase/BLEP_PHASES samples
+            // before the sample that first sees the new level
+            const double t = (double)tap - half + (double)phase / BLEP_PHASES;
+            const int32_t i = (int32_t)((t + half) * steps);
+            const double step = (i < 0) ? 0.0 : integral[i > (int32_t)(BLEP_TAPS * steps) ? BLEP_TAPS * steps : (uint32_t)i] / sum;
+            const double ideal = (tap >= half) ? 1.0 : 0.0;
+            audio->blep[phase][tap] = (int16_t)lrint((step - ideal) * 32767.0);
+        }
+    }
+}
+
+// Level of bit n of the 1-bit waveform, the plain square tone is the 2-bit pattern "10"
+bool audio_bit(const audio_t *audio, const bool pattern, const uint32_t n) {
+    if (pattern) return (audio->pattern[n >> 3] >> (7 - (n & 7))) & 1;
+    return n == 0;
+}
+
+// Sample of this n sample buffer the next queued event applies at, n when none is due in it.
+// An event first seen far outside the expected window means the clocks lost each other (first
+// event, pause, reset, drift), so the emulated clock is anchored again one latency ahead. A
+// tone starting from silence is held to a tighter window, which is where drift gets corrected.
+uint32_t sound_next(audio_t *audio, const uint32_t n) {
+    const uint32_t tail = atomic_load_explicit(&audio->sound.tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&audio->sound.head, memory_order_acquire)) return n;
+
+    const sound_event_t *event = &audio->sound.events[tail % SOUND_EVENTS];
+    if (event->now) return 0;
+
+    const int64_t latency = audio->latency;
+    const int64_t lo = audio->gate ? -latency : latency / 2;
+    int64_t pos = (int64_t)(event->time + audio->sound_offset - audio->played);
+    if (audio->checked != tail + 1) {
+        audio->checked = tail + 1;
+        if (!audio->synced || pos < lo || pos > 2 * latency) {
+            audio->sound_offset = audio->played + audio->latency - event->time;
+            audio->synced = true;
+            pos = latency;
+        }
+    }
+    if (pos < 0) pos = 0;
+    return pos < n ? (uint32_t)pos : n;
+}
+
+// Apply the next queued event
+void sound_pop(audio_t *audio) {
+    const uint32_t tail = atomic_load_explicit(&audio->sound.tail, memory_order_relaxed);
+    audio->gate = audio->sound.events[tail % SOUND_EVENTS].on;
+    atomic_store_explicit(&audio->sound.tail, tail + 1, memory_order_release);
+}
+
 //SDL Audio callback function
 void audio_callback(void *userdata, uint8_t *stream, int len) 
 {
-    config_t *config = (config_t *)userdata;
+    audio_t *audio = (audio_t *)userdata;
+    const config_t *config = audio->config;
     int16_t *audio_data = (int16_t *)stream;
-    // Phase accumulator for wave generation
-    static double phase = 0.0; 
+    const int32_t volume = config->volume;
+    const bool pattern = (config->current_extension == XOCHIP) && audio->use_pattern;
+    const uint32_t tone_step = (uint32_t)(((uint64_t)config->square_wave_freq << 32) / config->audio_sample_rate);
+
+    const uint32_t n = (uint32_t)len / 2;
+    uint32_t next = sound_next(audio, n);
 
-    // Calculate the phase increment per sample
-    double phase_increment = (2.0 * M_PI * config->square_wave_freq) / config->audio_sample_rate;
+    if (audio->metrics) metrics_record_audio(audio->metrics, n, config->audio_sample_rate);
 
-    // Fill the audio buffer with appropriate wave samples
-    for (int i = 0; i < len / 2; i++) {
-        if (config->use_sine_wave) 
-        {
-    // Generate sine wave (your existing code)
-            audio_data[i] = (int16_t)(config->volume * sin(phase));
-        } 
-        else 
-        {
-            // Generate square wave
-            // Simply check if we're in the first or second half of the wave cycle
-            audio_data[i] = (phase < M_PI) ? config->volume : -config->volume;
+    if (!pattern && config->use_sine_wave) {
+        for (uint32_t i = 0; i < n; i++) {
+            while (next <= i) {
+                sound_pop(audio);
+                next = sound_next(audio, n);
+            }
+            audio_data[i] = audio->gate ? (int16_t)((volume * audio->sine[audio->phase >> 24]) >> 15) : 0;
+            audio->phase += tone_step;
         }
+        if (audio->recorder) record_audio(audio->recorder, audio_data, n);
+        audio->played += n;
+        return;
+    }
 
-        // Increment the phase
-        phase += phase_increment;
+    // 1-bit waveform: the phase accumulator walks the pattern bits (or the two halves of the
+    // square wave), and every edge gets a band-limited step from the table at its sub-sample
+    // position instead of an instant jump, which would alias.
+    const uint32_t step = pattern ? audio->pitch_step[audio->pitch] : tone_step;
+    const uint32_t shift = pattern ? 25 : 31;   // Phase bits below the bit index
+    const uint32_t bit_mask = pattern ? 127 : 1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        // Gating is one more band-limited edge, to or from silence, right on this sample
+        if (next <= i) {
+            while (next <= i) {
+                sound_pop(audio);
+                next = sound_next(audio, n);
+            }
+            const int32_t level = !audio->gate ? 0 :
+                audio_bit(audio, pattern, (audio->phase >> shift) & bit_mask) ? volume : -volume;
+            const int32_t delta = level - audio->level;
+            for (uint32_t tap = 0; delta != 0 && tap < BLEP_TAPS; tap++) {
+                audio->ring[(audio->ring_pos + tap) % BLEP_RING] += (delta * audio->blep[0][tap]) >> 15;
+            }
+            audio->level = level;
+        }
 
-        // Wrap the phase to avoid overflow
-        if (phase >= 2.0 * M_PI) {
-            phase -= 2.0 * M_PI;
+        const uint32_t prev = audio->phase;
+        audio->phase += step;
+
+        // Walk every bit boundary crossed since the last sample
+        uint32_t boundary = ((prev >> shift) + 1) << shift;
+        uint32_t since = audio->phase - boundary;   // Phase elapsed since the boundary, wraps
+        while (since < step) {
+            const int32_t level = !audio->gate ? 0 :
+                audio_bit(audio, pattern, (boundary >> shift) & bit_mask) ? volume : -volume;
+            const int32_t delta = level - audio->level;
+
+            if (delta != 0) {
+                const uint32_t blep_phase = (uint32_t)(((uint64_t)since * BLEP_PHASES) / step);
+                for (uint32_t tap = 0; tap < BLEP_TAPS; tap++) {
+                    audio->ring[(audio->ring_pos + tap) % BLEP_RING] += (delta * audio->blep[blep_phase][tap]) >> 15;
+                }
+                audio->level = level;
+            }
+            boundary += 1u << shift;
+            since = audio->phase - boundary;
         }
+
+        // The naive level lands half the residual length later, centered on its edge
+        audio->ring[(audio->ring_pos + BLEP_TAPS / 2) % BLEP_RING] += audio->level;
+
+        int32_t sample = audio->ring[audio->ring_pos];
+        audio->ring[audio->ring_pos] = 0;
+        audio->ring_pos = (audio->ring_pos + 1) % BLEP_RING;
+
+        if (sample > INT16_MAX) sample = INT16_MAX;
+        if (sample < INT16_MIN) sample = INT16_MIN;
+        audio_data[i] = (int16_t)sample;
     }
+    if (audio->recorder) record_audio(audio->recorder, audio_data, n);
+    audio->played += n;
 }
 
 // Initialize SDL
-bool init_sdl(sdl_t *sdl, config_t *config) {
+bool init_sdl(sdl_t *sdl, config_t *config, audio_t *audio) {
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) != 0) {
         SDL_Log("Could not initialize SDL Subsystems! %s", SDL_GetError());
         return false;
@@ -159,10 +859,12 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
         .freq = 44100,
         .format = AUDIO_S16LSB, // Signed 16-bit samples in little-endian byte order
         .channels = 1, // Mono
-        .samples = 512, // Buffer size
+        .samples = config->audio_buffer, // Buffer size
         .callback = audio_callback, // Function to call when audio device needs data
-        .userdata = config,
+        .userdata = audio,
     };
+    sdl->audio = audio;
+    init_audio(audio, config);
      sdl -> dev = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
 
     if(sdl->dev==0) {
@@ -176,6 +878,9 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
         return false;
     }
 
+    // A fresh event lands a buffer plus a frame ahead, the main loop only pushes once a frame
+    audio->latency = sdl->have.samples + sdl->have.freq / 60;
+
     return true;  // Success
 }
 
@@ -196,6 +901,54 @@ bool set_config_from_args(config_t *config, const int argc, char **argv) {
         .color_lerp_rate = 0.7,        // Rate of interpolation between 0.0 and 1.0, inclusive, default is 0.7
         .use_sine_wave = true,  //By default, use sine wave
         .current_extension = CHIP8, // Default extension is CHIP8
+        .upscale_filter = SCALE_NEAREST,
+        .grid_count = 0,            // Single instance by default
+        .grid_threads = 0,          // 0 = one worker per CPU core
+        .shm_name = NULL,           // Shared-memory export is off by default
+        .netplay_port = 0,          // Netplay is off by default
+        .netplay_player = 1,
+        .rollback_frames = 8,       // Hides up to ~133ms of round trip
+        .batch_lanes = 0,           // Batched benchmark is off by default
+        .batch_frames = 600,        // 10 seconds of emulated time
+        .rom_dir = NULL,            // ROM library is off by default
+#ifdef DEBUG
+        .fusion = false,            // Trace every instruction on its own
+#else
+        .fusion = true,
+#endif
+        .fusion_profile = NULL,     // Fuse the built-in sequences
+        .fusion_set = NULL,
+        .profile_opcodes = false,
+        .profile_out = NULL,
+        .profile = NULL,
+        .metrics_path = NULL,       // Metrics export is off by default
+        .metrics_interval = 1000,
+        .metrics = NULL,
+        .trace = NULL,
+        .log_traps = true,
+        .diff_engine = DIFF_OFF,    // Differential mode is off by default
+        .diff_frames = 3600,        // A minute of emulated time per run
+        .diff_fuzz = 0,
+        .diff_seed = 0,
+        .library = NULL,
+        .pack_path = NULL,          // ROMs are loaded from files by default
+        .pack_out = NULL,
+        .pack = NULL,
+        .record_path = NULL,        // A/V recording is off by default
+        .convert_path = NULL,
+        .latency_probe = false,
+        .input = NULL,
+        .audio_buffer = 256,        // About 6ms at 44.1khz
+        .search_value = 0,
+        .search = NULL,
+        .fuzz_execs = 0,            // Fuzzing is off by default
+        .fuzz_frames = 60,
+        .fuzz_rom = false,
+        .fuzz_seed = 0,
+        .fuzz_replay = NULL,
+        .coverage = NULL,
+        .vip_timing = false,        // Flat instr_per_sec budget by default
+        .sound = NULL,
     };
     
     for (int i = 1; i < argc; i++) {
@@ -229,13 +982,200 @@ bool set_config_from_args(config_t *config, const int argc, char **argv) {
             config->current_extension = XOCHIP;
             printf("Using XO-CHIP extensions\n");
         }
+        else if (strncmp(argv[i], "--upscale", strlen("--upscale")) == 0) {
+            i++;
+            if (strcmp(argv[i], "scale2x") == 0) config->upscale_filter = SCALE_2X;
+            else if (strcmp(argv[i], "scale3x") == 0) config->upscale_filter = SCALE_3X;
+            else if (strcmp(argv[i], "scale4x") == 0) config->upscale_filter = SCALE_4X;
+            else config->upscale_filter = SCALE_NEAREST;
+            printf("Upscaling with %s\n", argv[i]);
+        }
+        else if (strncmp(argv[i], "--shm", strlen("--shm")) == 0) {
+            i++;
+            config->shm_name = argv[i];
+            printf("Publishing frames to shared memory %s\n", config->shm_name);
+        }
+        else if (strncmp(argv[i], "--netplay", strlen("--netplay")) == 0) {
+            // --netplay <local_port> <peer_host:port>
+            config->netplay_port = (uint16_t)strtol(argv[++i], NULL, 10);
+            config->netplay_peer = argv[++i];
+            printf("Netplay on UDP port %u with peer %s\n", config->netplay_port, config->netplay_peer);
+        }
+        else if (strncmp(argv[i], "--player", strlen("--player")) == 0) {
+            i++;
+            config->netplay_player = (uint8_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--rollback-frames", strlen("--rollback-frames")) == 0) {
+            i++;
+            config->rollback_frames = (uint32_t)strtol(argv[i], NULL, 10);
+            if (config->rollback_frames > NETPLAY_MAX_ROLLBACK) config->rollback_frames = NETPLAY_MAX_ROLLBACK;
+        }
+        else if (strncmp(argv[i], "--batch-frames", strlen("--batch-frames")) == 0) {
+            i++;
+            config->batch_frames = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--batch", strlen("--batch")) == 0) {
+            i++;
+            config->batch_lanes = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--grid-threads", strlen("--grid-threads")) == 0) {
+            i++;
+            config->grid_threads = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--grid", strlen("--grid")) == 0) {
+            i++;
+            config->grid_count = (uint32_t)strtol(argv[i], NULL, 10);
+            printf("Hosting %u instances in grid mode\n", config->grid_count);
+        }
+        else if (strncmp(argv[i], "--no-fusion", strlen("--no-fusion")) == 0) {
+            config->fusion = false;
+        }
+        else if (strncmp(argv[i], "--fusion-profile", strlen("--fusion-profile")) == 0) {
+            i++;
+            config->fusion_profile = argv[i];
+        }
+        else if (strncmp(argv[i], "--profile-out", strlen("--profile-out")) == 0) {
+            i++;
+            config->fusion = false;
+            config->profile_opcodes = true;
+            config->profile_out = argv[i];
+        }
+        else if (strncmp(argv[i], "--profile", strlen("--profile")) == 0) {
+            // Sequences are counted as executed one by one, so fusion stays off
+            config->fusion = false;
+            config->profile_opcodes = true;
+        }
+        else if (strncmp(argv[i], "--metrics-interval", strlen("--metrics-interval")) == 0) {
+            i++;
+            config->metrics_interval = (uint32_t)strtol(argv[i], NULL, 10);
+            if (config->metrics_interval == 0) config->metrics_interval = 1;
+        }
+        else if (strncmp(argv[i], "--metrics", strlen("--metrics")) == 0) {
+            i++;
+            config->metrics_path = argv[i];
+            printf("Writing metrics to %s\n", config->metrics_path);
+        }
+        else if (strncmp(argv[i], "--diff-frames", strlen("--diff-frames")) == 0) {
+            i++;
+            config->diff_frames = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--diff-fuzz", strlen("--diff-fuzz")) == 0) {
+            i++;
+            config->diff_fuzz = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--diff-seed", strlen("--diff-seed")) == 0) {
+            i++;
+            config->diff_seed = (uint32_t)strtoul(argv[i], NULL, 0);
+        }
+        else if (strncmp(argv[i], "--diff", strlen("--diff")) == 0) {
+            i++;
+            if (strcmp(argv[i], "fused") == 0) config->diff_engine = DIFF_FUSED;
+            else if (strcmp(argv[i], "batch") == 0) config->diff_engine = DIFF_BATCH;
+            else {
+                SDL_Log("Unknown --diff engine %s, expected fused or batch\n", argv[i]);
+                return false;
+            }
+        }
+        else if (strncmp(argv[i], "--rom-dir", strlen("--rom-dir")) == 0) {
+            i++;
+            config->rom_dir = argv[i];
+        }
+        else if (strncmp(argv[i], "--vip-timing", strlen("--vip-timing")) == 0) {
+            config->vip_timing = true;
+            printf("Using COSMAC VIP instruction timing\n");
+        }
+        else if (strncmp(argv[i], "--rom-pack", strlen("--rom-pack")) == 0) {
+            i++;
+            config->pack_path = argv[i];
+        }
+        else if (strncmp(argv[i], "--pack", strlen("--pack")) == 0) {
+            i++;
+            config->pack_out = argv[i];
+        }
+        else if (strncmp(argv[i], "--record-av", strlen("--record-av")) == 0) {
+            i++;
+            config->record_path = argv[i];
+        }
+        else if (strncmp(argv[i], "--convert-av", strlen("--convert-av")) == 0) {
+            i++;
+            config->convert_path = argv[i];
+        }
+        else if (strncmp(argv[i], "--latency-probe", strlen("--latency-probe")) == 0) {
+            config->latency_probe = true;
+        }
+        else if (strncmp(argv[i], "--fuzz-frames", strlen("--fuzz-frames")) == 0) {
+            i++;
+            config->fuzz_frames = (uint32_t)strtol(argv[i], NULL, 10);
+            if (config->fuzz_frames == 0) config->fuzz_frames = 1;
+        }
+        else if (strncmp(argv[i], "--fuzz-rom", strlen("--fuzz-rom")) == 0) {
+            config->fuzz_rom = true;
+        }
+        else if (strncmp(argv[i], "--fuzz-seed", strlen("--fuzz-seed")) == 0) {
+            i++;
+            config->fuzz_seed = (uint32_t)strtoul(argv[i], NULL, 0);
+        }
+        else if (strncmp(argv[i], "--fuzz-replay", strlen("--fuzz-replay")) == 0) {
+            i++;
+            config->fuzz_replay = argv[i];
+        }
+        else if (strncmp(argv[i], "--fuzz", strlen("--fuzz")) == 0) {
+            i++;
+            config->fuzz_execs = strtoull(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--search-value", strlen("--search-value")) == 0) {
+            i++;
+            config->search_value = (uint8_t)strtol(argv[i], NULL, 0);
+        }
+        else if (strncmp(argv[i], "--audio-buffer", strlen("--audio-buffer")) == 0) {
+            i++;
+            config->audio_buffer = (uint32_t)strtol(argv[i], NULL, 10);
+            if (config->audio_buffer < 32) config->audio_buffer = 32;
+            if (config->audio_buffer > 8192) config->audio_buffer = 8192;
+        }
     }
     return true;
 }
 
-//initialise chip8
-bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]) {
-    const uint32_t entry_point = 0x200; // CHIP8 Roms will be loaded to 0x200
+// Mark the addresses of the image where a superinstruction can replace the next opcodes. Loops
+// are only fused when their jump goes back to the start of the sequence, other addresses get
+// the first sequence of the set whose opcode classes match.
+void build_fusion_table(rom_image_t *image, const fusion_set_t *set) {
+    uint8_t classes[4096];
+    memset(image->fusion, FUSE_NONE, sizeof(image->fusion));
+    for (uint32_t addr = 0; addr + 2 <= sizeof(image->ram); addr++) {
+        classes[addr] = opcode_class((image->ram[addr] << 8) | image->ram[addr + 1]);
+    }
+
+    for (uint32_t addr = 0; addr + 4 <= sizeof(image->ram); addr++) {
+        const uint8_t *code = &image->ram[addr];
+        const uint16_t op0 = (code[0] << 8) | code[1];
+        const uint16_t op1 = (code[2] << 8) | code[3];
+        const uint16_t op2 = (addr + 6 <= sizeof(image->ram)) ? (code[4] << 8) | code[5] : 0;
+        const uint16_t x = op0 & 0x0F00;
+
+        if ((op0 & 0xF0FF) == 0xF007 && op1 == (0x3000 | x) && op2 == (0x1000 | addr)) {
+            image->fusion[addr] = FUSE_WAIT_LOOP;
+            continue;
+        }
+        if ((op0 & 0xF000) == 0x7000 && (op1 & 0xFF00) == (0x3000 | x) && op2 == (0x1000 | addr)) {
+            image->fusion[addr] = FUSE_COUNT_LOOP;
+            continue;
+        }
+        for (uint32_t s = 0; set && s < set->count; s++) {
+            const fusion_sequence_t *sequence = &set->sequences[s];
+            bool match = addr + 2u * sequence->length <= sizeof(image->ram);
+            for (uint32_t k = 0; match && k < sequence->length; k++) match = classes[addr + 2 * k] == sequence->classes[k];
+            if (match) {
+                image->fusion[addr] = FUSE_SEQUENCE + s;
+                break;
+            }
+        }
+    }
+}
+
+// New image holding just the font, refs starts at 0 until a machine is reset from it
+rom_image_t *new_rom_image(const char rom_name[]) {
     const unsigned char font[80] = {
         0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0   
         0x20, 0x60, 0x20, 0x20, 0x70,   // 1  
@@ -254,893 +1194,4542 @@ bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]) {
         0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
         0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
     };
-    //insiitalise entire chip8
-    memset(chip8, 0, sizeof(chip8_t));
+    rom_image_t *image = calloc(1, sizeof(rom_image_t));
+    if (!image) {
+        SDL_Log("Could not allocate memory for rom %s\n", rom_name);
+        return NULL;
+    }
+    image->rom_name = rom_name;
 
     //load font
-    memcpy(&chip8->ram[0], font, sizeof(font));
-    //SDL_Log("Size of font: %zu\n", sizeof(font));
-    //SDL_Log("Size of font: %zx", sizeof(font));
+    memcpy(&image->ram[0], font, sizeof(font));
+    return image;
+}
+
+// Load font + ROM into a new power-on image
+rom_image_t *load_rom_image(const char rom_name[]) {
+    const uint32_t entry_point = 0x200; // CHIP8 Roms will be loaded to 0x200
+    rom_image_t *image = new_rom_image(rom_name);
+    if (!image) return NULL;
+
     //load rom
     FILE * rom = fopen(rom_name, "rb");
     if(!rom)
     {
         SDL_Log("Rom file %s is invalid, or does not exist\n", rom_name);
-        return false;
+        free(image);
+        return NULL;
     }
 
     fseek(rom, 0, SEEK_END); //set the pointer to an offset specified in the file
     const size_t rom_size = ftell(rom); //to assess the size of the rom to be loaded
-    const size_t max_size = sizeof chip8 ->ram - entry_point;
+    const size_t max_size = sizeof image->ram - entry_point;
     rewind(rom); //will set the pointer back to the start of the file
 
     if (rom_size > max_size) {
         SDL_Log("Rom file %s is too big! Rom size: %llu, Max size allowed: %llu\n", 
                 rom_name, (long long unsigned)rom_size, (long long unsigned)max_size);
-        return false;
+        fclose(rom);
+        free(image);
+        return NULL;
     }
 
-    if (fread(&chip8->ram[entry_point], rom_size, 1, rom)!=1){
+    if (fread(&image->ram[entry_point], rom_size, 1, rom)!=1){
         SDL_Log("Rom file %s cannot be loaded onto CHIP8 memory!\n", rom_name);
-        return false;
+        fclose(rom);
+        free(image);
+        return NULL;
     }
     fclose(rom);
+    image->rom_size = rom_size;
+    return image;
+}
+
+void release_rom_image(rom_image_t *image) {
+    if (image && --image->refs == 0) free(image);
+}
+
+// Release a machine's private RAM pages and its hold on the ROM image
+void free_chip8(chip8_t *chip8) {
+    for (uint8_t p = 0; p < RAM_PAGES; p++) {
+        if (chip8->private_pages & (1 << p)) free(chip8->page[p]);
+        chip8->page[p] = NULL;
+    }
+    chip8->private_pages = 0;
+    release_rom_image(chip8->rom);
+    chip8->rom = NULL;
+}
+
+// Power-on reset from an image, every page is shared until the machine writes to it
+void reset_chip8(chip8_t *chip8, const config_t config, rom_image_t *image) {
+    image->refs++;                       //taken first, the image may be the one being released below
+    free_chip8(chip8);
+
+    uint32_t *pixel_color = chip8->pixel_color;
+    //insiitalise entire chip8
+    memset(chip8, 0, sizeof(chip8_t));
+    chip8->pixel_color = pixel_color;
+    chip8->rom = image;
+    for (uint8_t p = 0; p < RAM_PAGES; p++) chip8->page[p] = &image->ram[p * RAM_PAGE_SIZE];
 
     // Default machine state on running
     chip8->state = RUNNING;  
-    chip8->PC = entry_point;
-    chip8->rom_name = rom_name;
+    chip8->PC = 0x200;
+    chip8->rom_name = image->rom_name;
     chip8->stack_ptr = &chip8->stack[0]; //SP points to the start of the stack
-    memset(&chip8->pixel_color[0], config.bg_color, sizeof(chip8->pixel_color)); //initialising pixels to background color
-    
-    return true;
+    chip8->rng = (uint32_t)rand() | 1;   //xorshift state must never be zero
+    chip8->pitch = 64;                   //XO-CHIP default pitch, 4000 bits per second
+    chip8->tick_slots = config.vip_timing ? VIP_FRAME_CYCLES :
+                        config.instr_per_sec / 60 ? config.instr_per_sec / 60 : 1;
+    chip8->audio_dirty = true;
+    chip8->dirty_rows = UINT64_MAX;      //pixel colors start out of step with the display
+    chip8->draw = true;
+    if (pixel_color) {
+        for (uint32_t i = 0; i < 64*32; i++) pixel_color[i] = config.bg_color; //initialising pixels to background color
+    }
 }
 
-// Final cleanup
-void final_cleanup(const sdl_t sdl) {
-    SDL_DestroyRenderer(sdl.renderer);
-    SDL_DestroyWindow(sdl.window);
-    SDL_CloseAudioDevice(sdl.dev);
-    SDL_Quit();  // Shuts down SDL subsystems
+// Timers hold the value they were set to and the slot it happened at, and count down at every
+// tick boundary since then. Nothing has to run per tick, a read works out the current value.
+uint8_t timer_at(const uint8_t value, const uint64_t set, const uint64_t now, const uint32_t tick_slots) {
+    const uint64_t ticks = now / tick_slots - set / tick_slots;
+    return ticks >= value ? 0 : (uint8_t)(value - ticks);
 }
 
-// Clear screen / SDL window to background color
-void clear_screen(const sdl_t sdl, const config_t config) {
-    // Extract color components (ARGB format)
-    const uint8_t r = (config.bg_color >> 24) & 0xFF;  // Alpha component
-    const uint8_t g = (config.bg_color >> 16) & 0xFF;  // Red component
-    const uint8_t b = (config.bg_color >> 8) & 0xFF;   // Green component
-    const uint8_t a = (config.bg_color >> 0) & 0xFF;   // Blue component
+uint8_t get_delay_timer(const chip8_t *chip8) {
+    return timer_at(chip8->delay_timer, chip8->delay_set, chip8->cycles, chip8->tick_slots);
+}
 
-    // Debug print to verify color values
-    //printf("Setting background color: R=%u, G=%u, B=%u, A=%u\n", r, g, b, a);
+uint8_t get_sound_timer(const chip8_t *chip8) {
+    return timer_at(chip8->sound_timer, chip8->sound_set, chip8->cycles, chip8->tick_slots);
+}
 
-SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-    SDL_RenderClear(sdl.renderer);
+// Whether the sound timer was running in the last slot before now, i.e. during the frame that
+// just ended when called between frames
+bool frame_beeped(const chip8_t *chip8) {
+    return chip8->cycles && timer_at(chip8->sound_timer, chip8->sound_set, chip8->cycles - 1, chip8->tick_slots);
 }
 
-// Update window with any changes
-void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
-    SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
-
-    // Grab bg color values to draw outlines
-    const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
-    const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
-    const uint8_t bg_b = (config.bg_color >>  8) & 0xFF;
-    const uint8_t bg_a = (config.bg_color >>  0) & 0xFF;
-
-    // Loop through display pixels, draw a rectangle per pixel to the SDL window
-    for (uint32_t i = 0; i < sizeof chip8->display; i++) {
-        // Translate 1D index i value to 2D X/Y coordinates
-        // X = i % window width
-        // Y = i / window width
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
-
-        if (chip8->display[i]) {
-            // Pixel is on, draw foreground color
-            if (chip8->pixel_color[i] != config.fg_color) {
-                // Lerp towards fg_color
-                chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], 
-                                               config.fg_color, 
-                                               config.color_lerp_rate);
-            }
+// Addresses wrap at 4K like the original interpreter's 12-bit address bus
+uint8_t read_ram(const chip8_t *chip8, const uint16_t addr) {
+    return chip8->page[(addr & 0x0FFF) / RAM_PAGE_SIZE][addr % RAM_PAGE_SIZE];
+}
 
-            const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const uint8_t b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const uint8_t a = (chip8->pixel_color[i] >>  0) & 0xFF;
+// Write a byte, copying the page out of the shared image on the first write to it
+void write_ram(chip8_t *chip8, uint16_t addr, const uint8_t value) {
+    addr &= 0x0FFF;
+    const uint8_t p = addr / RAM_PAGE_SIZE;
+    if (!(chip8->private_pages & (1 << p))) {
+        uint8_t *copy = malloc(RAM_PAGE_SIZE);
+        if (!copy) {
+            SDL_Log("Could not allocate a RAM page, write to 0x%03X dropped\n", addr);
+            return;
+        }
+        memcpy(copy, chip8->page[p], RAM_PAGE_SIZE);
+        chip8->page[p] = copy;
+        chip8->private_pages |= 1 << p;
+    }
+    chip8->page[p][addr % RAM_PAGE_SIZE] = value;
+}
 
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
-        
-            // Only draw outlines if pixel_outlines is enabled
-            if (config.pixel_outlines) {
-                // If user requested drawing pixel outlines, draw those here
-                SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-                SDL_RenderDrawRect(sdl.renderer, &rect);
-            }
-        } else {
-            // Pixel is off, draw background color
-            if (chip8->pixel_color[i] != config.bg_color) {
-                // Lerp towards bg_color
-                chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], 
-                                               config.bg_color, 
-                                               config.color_lerp_rate);
-            }
+bool pixel_on(const chip8_t *chip8, const uint32_t x, const uint32_t y) {
+    return (chip8->display[y] >> (63 - x)) & 1;
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Preload every ROM in a directory so switching never touches the disk. The library holds a
+// reference on each image, machines switched onto it take their own.
+bool init_rom_library(rom_library_t *library, const char dir[], const char rom_name[],
+                      const fusion_set_t *fusion_set) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        SDL_Log("Could not open ROM directory %s: %s\n", dir, strerror(errno));
+        return false;
+    }
 
-            const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const uint8_t b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const uint8_t a = (chip8->pixel_color[i] >>  0) & 0xFF;
+    uint32_t capacity = 0, found = 0;
+    char **paths = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (entry->d_name[0] == '.') continue;
+
+        const size_t len = strlen(dir) + strlen(entry->d_name) + 2;
+        char *path = malloc(len);
+        struct stat st;
+        if (!path) break;
+        snprintf(path, len, "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (found == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **grown = realloc(paths, capacity * sizeof(char *));
+            if (!grown) {
+                free(path);
+                break;
+            }
+            paths = grown;
+        }
+        paths[found++] = path;
+    }
+    closedir(d);
+    qsort(paths, found, sizeof(char *), compare_paths);
+
+    library->paths = calloc(found ? found : 1, sizeof(char *));
+    library->images = calloc(found ? found : 1, sizeof(rom_image_t *));
+    if (!library->paths || !library->images) {
+        SDL_Log("Could not allocate the ROM library\n");
+        for (uint32_t i = 0; i < found; i++) free(paths[i]);
+        free(paths);
+        return false;
+    }
 
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
+    // Files that are not loadable ROMs are skipped
+    for (uint32_t i = 0; i < found; i++) {
+        rom_image_t *image = load_rom_image(paths[i]);
+        if (!image) {
+            free(paths[i]);
+            continue;
         }
+        build_fusion_table(image, fusion_set);
+        image->refs++;
+        if (strcmp(paths[i], rom_name) == 0) library->current = library->count;
+        library->paths[library->count] = paths[i];
+        library->images[library->count++] = image;
     }
+    free(paths);
 
-    SDL_RenderPresent(sdl.renderer);
+    if (library->count == 0) {
+        SDL_Log("No loadable ROMs in %s\n", dir);
+        return false;
+    }
+    printf("Loaded %u ROMs from %s\n", library->count, dir);
+    return true;
 }
 
-void handle_input(chip8_t *chip8, config_t *config) {
-    SDL_Event event;
+void rom_library_cleanup(rom_library_t *library) {
+    for (uint32_t i = 0; i < library->count; i++) {
+        release_rom_image(library->images[i]);
+        free(library->paths[i]);
+    }
+    free(library->images);
+    free(library->paths);
+}
 
-    while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-            case SDL_QUIT:
-                chip8->state = QUIT;
-                break;
-            // Exit window, end program
+// Little-endian integer of the given byte width, the file formats below are all little-endian
+void write_le(FILE *out, const uint32_t value, const uint32_t bytes) {
+    for (uint32_t i = 0; i < bytes; i++) fputc((value >> (8 * i)) & 0xFF, out);
+}
 
-            case SDL_KEYDOWN:
-                switch (event.key.keysym.sym) {
-                    case SDLK_ESCAPE: //pressing escape button quits it
-                        printf("==== QUIT ====\n");
-                        chip8->state = QUIT;
-                        break;
-                    case SDLK_SPACE: //pressing space to pause the emulator action
-                        if (chip8->state == RUNNING) {
-                            chip8->state = PAUSED;
-                            puts("==== PAUSED ====");
-                        } else {
-                            chip8->state = RUNNING;
-                        }
-                        break;
+uint32_t read_le(const uint8_t *in, const uint32_t bytes) {
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < bytes; i++) value |= (uint32_t)in[i] << (8 * i);
+    return value;
+}
+
+// ROM pack: a ROM catalogue in one file that is mmapped once, so loading a ROM is a binary
+// search of the index and a memcpy, with no per-ROM file system calls.
+//   header   32 bytes: "C8PK", version, ROM count, index, strings and data offsets, file size
+//   index    40 bytes per ROM, sorted by the FNV-1a hash of its name: hash, ROM offset and size,
+//            name and key hint offsets into the strings, speed, fg and bg colors, quirk mode
+//   strings  NUL-terminated names and key hints, starting with an empty string
+//   data     ROMs, each starting on a 16-byte boundary
+#define PACK_MAGIC "C8PK"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 32
+#define PACK_ENTRY_SIZE 40
+#define PACK_ALIGN 16
+#define PACK_MANIFEST "manifest.txt"    // Optional metadata in the packed directory, not a ROM
+
+typedef struct rom_pack {
+    const uint8_t *map;
+    size_t size;
+    uint32_t count;
+    const uint8_t *index;
+    const char *strings;
+} rom_pack_t;
+
+// One ROM of a pack, pointing into the mapping
+typedef struct {
+    uint64_t hash;
+    const char *name;
+    const char *hints;              // What the keys do, "" when unknown
+    const uint8_t *rom;
+    uint32_t size;
+    uint32_t instr_per_sec;         // 0 = keep the configured speed
+    uint32_t fg_color;
+    uint32_t bg_color;
+    extension_t extension;
+} pack_entry_t;
+
+uint64_t fnv1a64(const char text[]) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (const char *c = text; *c; c++) hash = (hash ^ (uint8_t)*c) * 0x100000001B3ull;
+    return hash;
+}
+
+// Packs are indexed by file name, without the directory
+const char *rom_base_name(const char path[]) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+uint64_t pack_hash_at(const rom_pack_t *pack, const uint32_t i) {
+    const uint8_t *entry = &pack->index[i * PACK_ENTRY_SIZE];
+    return read_le(entry, 4) | (uint64_t)read_le(entry + 4, 4) << 32;
+}
+
+void pack_entry_at(const rom_pack_t *pack, const uint32_t i, pack_entry_t *out) {
+    const uint8_t *entry = &pack->index[i * PACK_ENTRY_SIZE];
+    *out = (pack_entry_t){
+        .hash = pack_hash_at(pack, i),
+        .rom = pack->map + read_le(entry + 8, 4),
+        .size = read_le(entry + 12, 4),
+        .name = pack->strings + read_le(entry + 16, 4),
+        .hints = pack->strings + read_le(entry + 20, 4),
+        .instr_per_sec = read_le(entry + 24, 4),
+        .fg_color = read_le(entry + 28, 4),
+        .bg_color = read_le(entry + 32, 4),
+        .extension = (extension_t)entry[36],
+    };
+}
+
+void close_rom_pack(rom_pack_t *pack) {
+    if (pack->map) munmap((void *)pack->map, pack->size);
+    *pack = (rom_pack_t){0};
+}
+
+// Map a pack and check every offset in it once, lookups trust the index afterwards
+bool open_rom_pack(rom_pack_t *pack, const char path[]) {
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        SDL_Log("Could not open ROM pack %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = st.st_size >= PACK_HEADER_SIZE ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        SDL_Log("Could not map ROM pack %s\n", path);
+        return false;
+    }
+    *pack = (rom_pack_t){.map = map, .size = st.st_size};
+
+    const uint8_t *header = pack->map;
+    const uint32_t count = read_le(header + 8, 4);
+    const uint32_t index = read_le(header + 12, 4);
+    const uint32_t strings = read_le(header + 16, 4);
+    const uint32_t data = read_le(header + 20, 4);
+    bool valid = memcmp(header, PACK_MAGIC, 4) == 0 && read_le(header + 4, 4) == PACK_VERSION &&
+                 read_le(header + 24, 4) == pack->size && index >= PACK_HEADER_SIZE &&
+                 (uint64_t)index + (uint64_t)count * PACK_ENTRY_SIZE <= strings && strings < data &&
+                 data <= pack->size && pack->map[data - 1] == '\0';
+    if (valid) {
+        pack->count = count;
+        pack->index = pack->map + index;
+        pack->strings = (const char *)pack->map + strings;
+    }
+
+    // The strings end on a NUL, so any offset inside them is a terminated string
+    for (uint32_t i = 0; valid && i < count; i++) {
+        const uint8_t *entry = &pack->index[i * PACK_ENTRY_SIZE];
+        const uint32_t rom = read_le(entry + 8, 4), size = read_le(entry + 12, 4);
+        valid = rom >= data && rom % PACK_ALIGN == 0 && size <= 0x1000 - 0x200 && (uint64_t)rom + size <= pack->size &&
+                read_le(entry + 16, 4) < data - strings && read_le(entry + 20, 4) < data - strings &&
+                entry[36] <= XOCHIP && (i == 0 || pack_hash_at(pack, i - 1) <= pack_hash_at(pack, i));
+    }
+    if (!valid) {
+        SDL_Log("%s is not a valid ROM pack\n", path);
+        close_rom_pack(pack);
+        return false;
+    }
+    return true;
+}
+
+// Binary search for the first entry with the hash, then the one with the name among any
+// colliding entries (name NULL takes the first)
+bool rom_pack_find(const rom_pack_t *pack, const uint64_t hash, const char name[], pack_entry_t *entry) {
+    uint32_t lo = 0, hi = pack->count;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (pack_hash_at(pack, mid) < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < pack->count && pack_hash_at(pack, lo) == hash; lo++) {
+        pack_entry_at(pack, lo, entry);
+        if (!name || strcmp(entry->name, name) == 0) return true;
+    }
+    return false;
+}
+
+// A ROM is looked up by its file name, or by its hash written as 0x followed by 16 hex digits
+bool rom_pack_lookup(const rom_pack_t *pack, const char rom_name[], pack_entry_t *entry) {
+    const char *name = rom_base_name(rom_name);
+    if (rom_pack_find(pack, fnv1a64(name), name, entry)) return true;
+
+    char *end;
+    const uint64_t hash = strtoull(rom_name, &end, 16);
+    return strncmp(rom_name, "0x", 2) == 0 && strlen(rom_name) == 18 && *end == '\0' &&
+           rom_pack_find(pack, hash, NULL, entry);
+}
+
+rom_image_t *load_pack_image(const pack_entry_t *entry) {
+    rom_image_t *image = new_rom_image(entry->name);
+    if (!image) return NULL;
+    memcpy(&image->ram[0x200], entry->rom, entry->size);
+    image->rom_size = entry->size;
+    return image;
+}
+
+// The ROM's pack entry decides its quirk mode, speed and colors
+void apply_pack_entry(config_t *config, const pack_entry_t *entry) {
+    config->current_extension = entry->extension;
+    if (entry->instr_per_sec) config->instr_per_sec = entry->instr_per_sec;
+    config->fg_color = entry->fg_color;
+    config->bg_color = entry->bg_color;
+    if (entry->hints[0]) printf("%s keys: %s\n", entry->name, entry->hints);
+}
+
+// Load a ROM from the pack when there is one, from its file otherwise, and find its superinstructions
+rom_image_t *load_rom(const config_t config, const char rom_name[]) {
+    rom_image_t *image = NULL;
+    pack_entry_t entry;
+    if (!config.pack) {
+        image = load_rom_image(rom_name);
+    } else if (rom_pack_lookup(config.pack, rom_name, &entry)) {
+        image = load_pack_image(&entry);
+    } else {
+        SDL_Log("Rom %s is not in the ROM pack\n", rom_name);
+    }
+    if (image) build_fusion_table(image, config.fusion_set);
+    return image;
+}
+
+//initialise chip8
+bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]) {
+    rom_image_t *image = load_rom(config, rom_name);
+    if (!image) return false;
+    reset_chip8(chip8, config, image);
+    return true;
+}
+
+// Library over every ROM of a pack, sorted by name. Images are only loaded when switched to.
+bool init_rom_library_from_pack(rom_library_t *library, const rom_pack_t *pack, const char rom_name[]) {
+    library->paths = calloc(pack->count ? pack->count : 1, sizeof(char *));
+    library->images = calloc(pack->count ? pack->count : 1, sizeof(rom_image_t *));
+    if (!library->paths || !library->images || !pack->count) {
+        SDL_Log(pack->count ? "Could not allocate the ROM library\n" : "The ROM pack is empty\n");
+        return false;
+    }
+    library->pack = pack;
+    for (uint32_t i = 0; i < pack->count; i++) {
+        pack_entry_t entry;
+        pack_entry_at(pack, i, &entry);
+        library->paths[i] = strdup(entry.name);
+        if (!library->paths[i]) return false;
+        library->count++;
+    }
+    qsort(library->paths, library->count, sizeof(char *), compare_paths);
+
+    for (uint32_t i = 0; i < library->count; i++) {
+        if (strcmp(library->paths[i], rom_base_name(rom_name)) == 0) library->current = i;
+    }
+    return true;
+}
+
+// A ROM being packed and the index entry it gets
+typedef struct {
+    uint64_t hash;
+    const char *name;
+    const rom_image_t *image;
+    char hints[128];
+    uint32_t instr_per_sec;
+    uint32_t fg_color, bg_color;
+    extension_t extension;
+    uint32_t name_offset, hints_offset, rom_offset;
+} pack_build_t;
+
+int compare_pack_builds(const void *a, const void *b) {
+    const pack_build_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+void write_padding(FILE *out, const uint32_t from, const uint32_t to) {
+    for (uint32_t i = from; i < to; i++) fputc(0, out);
+}
+
+// Metadata for one ROM from the manifest, one line per ROM:
+//   <file name> <chip8|superchip|xochip> <instructions per second> <fg RRGGBBAA> <bg RRGGBBAA> [key hints]
+// ROMs without a line get the packer's command line settings.
+void read_pack_manifest(FILE *manifest, pack_build_t *build) {
+    char line[512];
+
+    rewind(manifest);
+    while (fgets(line, sizeof(line), manifest)) {
+        char name[256], mode[16];
+        uint32_t speed, fg, bg;
+        int hints = 0;
+
+        if (line[0] == '#' || sscanf(line, "%255s %15s %u %x %x %n", name, mode, &speed, &fg, &bg, &hints) < 5) continue;
+        if (strcmp(name, build->name) != 0) continue;
+
+        build->extension = strcmp(mode, "xochip") == 0 ? XOCHIP : strcmp(mode, "superchip") == 0 ? SUPERCHIP : CHIP8;
+        build->instr_per_sec = speed;
+        build->fg_color = fg;
+        build->bg_color = bg;
+        line[strcspn(line, "\r\n")] = '\0';
+        snprintf(build->hints, sizeof(build->hints), "%s", hints ? &line[hints] : "");
+        return;
+    }
+}
+
+// --pack: write every ROM of the directory, with its manifest metadata, into one pack file
+bool run_pack(const config_t config, const char dir[]) {
+    rom_library_t library = {0};
+    if (!init_rom_library(&library, dir, "", NULL)) return false;
+
+    const size_t manifest_len = strlen(dir) + sizeof(PACK_MANIFEST) + 1;
+    char *manifest_path = malloc(manifest_len);
+    pack_build_t *builds = calloc(library.count, sizeof(pack_build_t));
+    FILE *out = fopen(config.pack_out, "wb");
+    if (!manifest_path || !builds || !out) {
+        SDL_Log("Could not write ROM pack %s: %s\n", config.pack_out, out ? "out of memory" : strerror(errno));
+        if (out) fclose(out);
+        free(manifest_path);
+        free(builds);
+        rom_library_cleanup(&library);
+        return false;
+    }
+    snprintf(manifest_path, manifest_len, "%s/%s", dir, PACK_MANIFEST);
+    FILE *manifest = fopen(manifest_path, "r");
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < library.count; i++) {
+        const char *name = rom_base_name(library.paths[i]);
+        if (strcmp(name, PACK_MANIFEST) == 0) continue;
+
+        pack_build_t *build = &builds[count++];
+        *build = (pack_build_t){
+            .hash = fnv1a64(name), .name = name, .image = library.images[i],
+            .instr_per_sec = config.instr_per_sec, .fg_color = config.fg_color, .bg_color = config.bg_color,
+            .extension = config.current_extension,
+        };
+        if (manifest) read_pack_manifest(manifest, build);
+    }
+    if (manifest) fclose(manifest);
+    qsort(builds, count, sizeof(pack_build_t), compare_pack_builds);
+
+    // Lay out the strings (offset 0 is the empty string) and the 16-byte aligned ROMs
+    const uint32_t index = PACK_HEADER_SIZE;
+    const uint32_t strings = index + count * PACK_ENTRY_SIZE;
+    uint32_t strings_size = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        builds[i].name_offset = strings_size;
+        strings_size += strlen(builds[i].name) + 1;
+        builds[i].hints_offset = builds[i].hints[0] ? strings_size : 0;
+        if (builds[i].hints[0]) strings_size += strlen(builds[i].hints) + 1;
+    }
+    const uint32_t data = (strings + strings_size + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+    uint32_t end = data;
+    for (uint32_t i = 0; i < count; i++) {
+        builds[i].rom_offset = end;
+        end = (end + builds[i].image->rom_size + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+    }
+
+    fwrite(PACK_MAGIC, 1, 4, out);
+    write_le(out, PACK_VERSION, 4);
+    write_le(out, count, 4);
+    write_le(out, index, 4);
+    write_le(out, strings, 4);
+    write_le(out, data, 4);
+    write_le(out, end, 4);
+    write_padding(out, 28, PACK_HEADER_SIZE);
+
+    for (uint32_t i = 0; i < count; i++) {
+        const pack_build_t *build = &builds[i];
+        write_le(out, (uint32_t)build->hash, 4);
+        write_le(out, (uint32_t)(build->hash >> 32), 4);
+        write_le(out, build->rom_offset, 4);
+        write_le(out, build->image->rom_size, 4);
+        write_le(out, build->name_offset, 4);
+        write_le(out, build->hints_offset, 4);
+        write_le(out, build->instr_per_sec, 4);
+        write_le(out, build->fg_color, 4);
+        write_le(out, build->bg_color, 4);
+        write_le(out, build->extension, 4);
+    }
+
+    fputc(0, out);
+    for (uint32_t i = 0; i < count; i++) {
+        fwrite(builds[i].name, 1, strlen(builds[i].name) + 1, out);
+        if (builds[i].hints[0]) fwrite(builds[i].hints, 1, strlen(builds[i].hints) + 1, out);
+    }
+    write_padding(out, strings + strings_size, data);
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t size = builds[i].image->rom_size;
+        fwrite(&builds[i].image->ram[0x200], 1, size, out);
+        write_padding(out, builds[i].rom_offset + size, i + 1 < count ? builds[i + 1].rom_offset : end);
+    }
+
+    bool ok = !ferror(out);
+    if (fclose(out) != 0) ok = false;
+    if (!ok) {
+        SDL_Log("Could not write ROM pack %s\n", config.pack_out);
+    } else {
+        printf("Packed %u ROMs into %s (%u bytes)\n", count, config.pack_out, end);
+    }
+    free(manifest_path);
+    free(builds);
+    rom_library_cleanup(&library);
+    return ok;
+}
+
+// Reset the machine onto the ROM step entries away in the library
+void switch_rom(chip8_t *chip8, config_t *config, const int step) {
+    rom_library_t *library = config->library;
+    const uint64_t start = SDL_GetPerformanceCounter();
+
+    library->current = (library->current + library->count + step) % library->count;
+    if (library->pack) {
+        pack_entry_t entry;
+        const char *name = library->paths[library->current];
+        if (!rom_pack_find(library->pack, fnv1a64(name), name, &entry)) return;
+        apply_pack_entry(config, &entry);
+        if (!library->images[library->current]) {
+            rom_image_t *image = load_pack_image(&entry);
+            if (!image) return;
+            build_fusion_table(image, config->fusion_set);
+            image->refs++;
+            library->images[library->current] = image;
+        }
+    }
+    reset_chip8(chip8, *config, library->images[library->current]);
+
+    const double us = (double)((SDL_GetPerformanceCounter() - start) * 1000000) / SDL_GetPerformanceFrequency();
+    printf("==== ROM %u/%u: %s (%.1f us) ====\n", library->current + 1, library->count, library->paths[library->current], us);
+}
+
+// Final cleanup
+void final_cleanup(const sdl_t sdl) {
+    if (sdl.screen) SDL_DestroyTexture(sdl.screen);
+    SDL_DestroyRenderer(sdl.renderer);
+    SDL_DestroyWindow(sdl.window);
+    SDL_CloseAudioDevice(sdl.dev);
+    SDL_Quit();  // Shuts down SDL subsystems
+}
+
+// Clear screen / SDL window to background color
+void clear_screen(const sdl_t sdl, const config_t config) {
+    // Extract color components (ARGB format)
+    const uint8_t r = (config.bg_color >> 24) & 0xFF;  // Alpha component
+    const uint8_t g = (config.bg_color >> 16) & 0xFF;  // Red component
+    const uint8_t b = (config.bg_color >> 8) & 0xFF;   // Green component
+    const uint8_t a = (config.bg_color >> 0) & 0xFF;   // Blue component
+
+    // Debug print to verify color values
+    //printf("Setting background color: R=%u, G=%u, B=%u, A=%u\n", r, g, b, a);
+
+SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+    SDL_RenderClear(sdl.renderer);
+}
+
+// Step pixel i towards its fg/bg target color and return the new color
+uint32_t fade_pixel(chip8_t *chip8, const config_t config, const uint32_t i) {
+    const uint32_t target = pixel_on(chip8, i % config.window_width, i / config.window_width) ? config.fg_color : config.bg_color;
+
+    if (chip8->pixel_color[i] != target) {
+        const uint32_t color = color_lerp(chip8->pixel_color[i], target, config.color_lerp_rate);
+
+        // Truncation can stall the lerp a step short of the target, snap to it when it does
+        chip8->pixel_color[i] = (color == chip8->pixel_color[i]) ? target : color;
+    }
+    return chip8->pixel_color[i];
+}
+
+// Fade the rows that changed or are still fading. Returns the rows whose colors were touched
+// and clears the dirty state.
+uint64_t fade_dirty_rows(chip8_t *chip8, const config_t config) {
+    const uint64_t rows = chip8->dirty_rows | chip8->fade_rows;
+    uint64_t fading = 0;
+
+    for (uint32_t y = 0; y < config.window_height; y++) {
+        if (!((rows >> y) & 1)) continue;
+
+        for (uint32_t x = 0; x < config.window_width; x++) {
+            const uint32_t i = y * config.window_width + x;
+            const uint32_t target = pixel_on(chip8, x, y) ? config.fg_color : config.bg_color;
+
+            if (fade_pixel(chip8, config, i) != target) fading |= (uint64_t)1 << y;
+        }
+    }
+    chip8->fade_rows = fading;
+    chip8->dirty_rows = 0;
+    chip8->draw = false;
+    return rows & (((uint64_t)1 << config.window_height) - 1);
+}
+
+// Texture pixels per CHIP-8 pixel for the current filter. Plain nearest scaling is left to the
+// GPU, outlines need the full window resolution to be drawn in.
+uint32_t screen_scale(const config_t config) {
+    switch (config.upscale_filter) {
+        case SCALE_2X: return 2;
+        case SCALE_3X: return 3;
+        case SCALE_4X: return 4;
+        default: {
+            const uint32_t scale = config.pixel_outlines ? config.scale_factor : 1;
+            // The HUD font needs a few texture pixels per CHIP-8 pixel to be readable
+            return (config.hud && config.hud->visible && scale < HUD_SCALE) ? HUD_SCALE : scale;
+        }
+    }
+}
+
+// (Re)create the screen texture when the filter or outline setting changed its size
+bool create_screen_texture(sdl_t *sdl, const config_t config) {
+    const uint32_t scale = screen_scale(config);
+    if (sdl->screen && sdl->screen_scale == scale) return true;
+
+    if (sdl->screen) SDL_DestroyTexture(sdl->screen);
+    sdl->screen = SDL_CreateTexture(sdl->renderer, 
+                                    SDL_PIXELFORMAT_RGBA8888, 
+                                    SDL_TEXTUREACCESS_STREAMING,
+                                    config.window_width * scale,
+                                    config.window_height * scale);
+    if (!sdl->screen) {
+        SDL_Log("Could not create screen texture: %s\n", SDL_GetError());
+        return false;
+    }
+    // Smooth the final stretch for the edge-smoothing filters, keep hard pixels otherwise
+    SDL_SetTextureScaleMode(sdl->screen, config.upscale_filter == SCALE_NEAREST ? SDL_ScaleModeNearest : SDL_ScaleModeLinear);
+    sdl->screen_scale = scale;
+    sdl->screen_hash = 0;
+    return true;
+}
+
+// 64-bit hash of everything that decides the texture contents
+uint64_t frame_hash(const chip8_t *chip8, const config_t config) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ ((uint64_t)config.upscale_filter << 8) ^ config.pixel_outlines;
+    const uint64_t *words = (const uint64_t *)chip8->pixel_color;
+
+    for (uint32_t i = 0; i < 64*32 * sizeof(uint32_t) / sizeof(uint64_t); i++) {
+        hash = (hash ^ words[i]) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// The filters below upscale source rows y0..y1 of a w x h image. dst points at the output row
+// for source row y0.
+
+// Replicate every pixel into a scale x scale block, lit pixels (bit 63 - x of row y) optionally get a bg colored outline
+void scale_nearest(const uint32_t *src, const uint64_t *lit, const uint32_t w, const uint32_t y0, const uint32_t y1,
+                   const uint32_t scale, const bool outlines, const uint32_t bg_color,
+                   uint32_t *dst, const uint32_t pitch) {
+    for (uint32_t y = y0; y <= y1; y++) {
+        for (uint32_t sy = 0; sy < scale; sy++) {
+            uint32_t *out = dst + ((y - y0) * scale + sy) * pitch;
+            const bool edge_row = (sy == 0 || sy == scale - 1);
+
+            for (uint32_t x = 0; x < w; x++) {
+                const uint32_t color = src[y * w + x];
+                const bool outline = outlines && ((lit[y] >> (63 - x)) & 1);
+
+                for (uint32_t sx = 0; sx < scale; sx++) {
+                    const bool edge = edge_row || sx == 0 || sx == scale - 1;
+                    *out++ = (outline && edge) ? bg_color : color;
+                }
+            }
+        }
+    }
+}
+
+// Scale2x: each pixel becomes 2x2, a corner takes a neighbour's color where two neighbours agree
+// along that diagonal. Written branch free over whole rows so the compiler vectorizes it.
+void scale2x(const uint32_t *src, const uint32_t w, const uint32_t h, const uint32_t y0, const uint32_t y1,
+             uint32_t *dst, const uint32_t pitch) {
+    for (uint32_t y = y0; y <= y1; y++) {
+        const uint32_t *row = src + y * w;
+        const uint32_t *up = src + (y > 0 ? y - 1 : y) * w;
+        const uint32_t *down = src + (y < h - 1 ? y + 1 : y) * w;
+        uint32_t *out0 = dst + (2 * (y - y0)) * pitch;
+        uint32_t *out1 = out0 + pitch;
+
+        for (uint32_t x = 0; x < w; x++) {
+            const uint32_t P = row[x];
+            const uint32_t A = up[x];
+            const uint32_t D = down[x];
+            const uint32_t C = row[x > 0 ? x - 1 : x];
+            const uint32_t B = row[x < w - 1 ? x + 1 : x];
+
+            out0[2 * x]     = (C == A && C != D && A != B) ? A : P;
+            out0[2 * x + 1] = (A == B && A != C && B != D) ? B : P;
+            out1[2 * x]     = (D == C && D != B && C != A) ? C : P;
+            out1[2 * x + 1] = (B == D && B != A && D != C) ? D : P;
+        }
+    }
+}
+
+// Scale3x: 3x3 output per pixel from its 3x3 neighbourhood
+//   A B C      E0 E1 E2
+//   D E F  ->  E3 E4 E5
+//   G H I      E6 E7 E8
+void scale3x(const uint32_t *src, const uint32_t w, const uint32_t h, const uint32_t y0, const uint32_t y1,
+             uint32_t *dst, const uint32_t pitch) {
+    for (uint32_t y = y0; y <= y1; y++) {
+        const uint32_t *row = src + y * w;
+        const uint32_t *up = src + (y > 0 ? y - 1 : y) * w;
+        const uint32_t *down = src + (y < h - 1 ? y + 1 : y) * w;
+        uint32_t *out0 = dst + (3 * (y - y0)) * pitch;
+        uint32_t *out1 = out0 + pitch;
+        uint32_t *out2 = out1 + pitch;
+
+        for (uint32_t x = 0; x < w; x++) {
+            const uint32_t l = x > 0 ? x - 1 : x;
+            const uint32_t r = x < w - 1 ? x + 1 : x;
+            const uint32_t A = up[l],   B = up[x],   C = up[r];
+            const uint32_t D = row[l],  E = row[x],  F = row[r];
+            const uint32_t G = down[l], H = down[x], I = down[r];
+            const bool db = D == B && B != F && D != H;
+            const bool bf = B == F && B != D && F != H;
+            const bool dh = D == H && D != B && H != F;
+            const bool hf = H == F && D != H && B != F;
+
+            out0[3 * x]     = db ? D : E;
+            out0[3 * x + 1] = ((db && E != C) || (bf && E != A)) ? B : E;
+            out0[3 * x + 2] = bf ? F : E;
+            out1[3 * x]     = ((db && E != G) || (dh && E != A)) ? D : E;
+            out1[3 * x + 1] = E;
+            out1[3 * x + 2] = ((bf && E != I) || (hf && E != C)) ? F : E;
+            out2[3 * x]     = dh ? D : E;
+            out2[3 * x + 1] = ((hf && E != G) || (dh && E != I)) ? H : E;
+            out2[3 * x + 2] = hf ? F : E;
+        }
+    }
+}
+
+// 3x5 HUD font for ASCII 32-95, lowercase is drawn as uppercase. One octal digit per row, top
+// row first, bit 2 is the left column.
+const uint16_t hud_font[64] = {
+    000000, 022202, 055000, 057575, 036336, 041241, 025257, 022000,     //  !"#$%&'
+    012421, 042124, 005250, 002720, 000024, 000700, 000002, 011244,     // ()*+,-./
+    075557, 026222, 071747, 071717, 055711, 074717, 074757, 071111,     // 01234567
+    075757, 075717, 002020, 002024, 012421, 007070, 042124, 071202,     // 89:;<=>?
+    075547, 025755, 065656, 034443, 065556, 074647, 074644, 034553,     // @ABCDEFG
+    055755, 072227, 011152, 055655, 044447, 057755, 065555, 025552,     // HIJKLMNO
+    065644, 025563, 065655, 034716, 072222, 055557, 055552, 055775,     // PQRSTUVW
+    055255, 055222, 071247, 064446, 044211, 031113, 025000, 000007,     // XYZ[\]^_
+};
+
+// Texture band the HUD draws into, everything is clipped to it
+typedef struct {
+    uint32_t *pixels;
+    uint32_t pitch;                 // In pixels
+    uint32_t width, height;
+    uint32_t zoom;                  // Texture pixels per font pixel
+} hud_canvas_t;
+
+void hud_fill(const hud_canvas_t *canvas, const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h,
+              const uint32_t color) {
+    for (uint32_t py = y; py < y + h && py < canvas->height; py++) {
+        for (uint32_t px = x; px < x + w && px < canvas->width; px++) canvas->pixels[py * canvas->pitch + px] = color;
+    }
+}
+
+// Dim a box to a quarter of its brightness so the text on top stays readable over any frame
+void hud_darken(const hud_canvas_t *canvas, const uint32_t w, const uint32_t h) {
+    for (uint32_t py = 0; py < h && py < canvas->height; py++) {
+        uint32_t *row = &canvas->pixels[py * canvas->pitch];
+        for (uint32_t px = 0; px < w && px < canvas->width; px++) row[px] = ((row[px] >> 2) & 0x3F3F3F00) | 0xFF;
+    }
+}
+
+void hud_text(const hud_canvas_t *canvas, const uint32_t x, const uint32_t y, const char text[], const uint32_t color) {
+    const uint32_t z = canvas->zoom;
+
+    for (uint32_t i = 0; text[i]; i++) {
+        const uint8_t c = (text[i] >= 'a' && text[i] <= 'z') ? text[i] - 32 : (uint8_t)text[i];
+        const uint16_t glyph = (c >= 32 && c < 96) ? hud_font[c - 32] : 0;
+
+        for (uint32_t row = 0; row < 5; row++) {
+            for (uint32_t col = 0; col < 3; col++) {
+                if ((glyph >> ((4 - row) * 3 + (2 - col))) & 1) {
+                    hud_fill(canvas, x + (i * 4 + col) * z, y + row * z, z, z, color);
+                }
+            }
+        }
+    }
+}
+
+// Texture rows the HUD covers for a texture of the given height
+uint32_t hud_height(const uint32_t texture_height) {
+    const uint32_t zoom = texture_height / 128 ? texture_height / 128 : 1;
+    return (4 * 6 + 4 + 16) * zoom;      // 4 text lines, margins, frame time graph
+}
+
+// Draw the HUD over the top left of the texture: effective speed, frame/emulate/render times
+// averaged over the history, audio queue fill, the active mode, and a graph of the last frames.
+// Text is formatted on the stack, nothing is allocated.
+void draw_hud(const hud_t *hud, const sdl_t *sdl, const config_t config, const hud_canvas_t *canvas) {
+    static const char *const modes[] = {"CHIP-8", "SCHIP", "XO-CHIP"};
+    static const char *const filters[] = {"NEAREST", "SCALE2X", "SCALE3X", "SCALE4X"};
+    const double ms = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    const uint32_t z = canvas->zoom;
+    const uint32_t width = (2 + HUD_HISTORY * 2 + 2) * z;
+    uint64_t frame = 0, emulate = 0, render = 0;
+    uint32_t frames = 0;
+    char line[48];
+
+    for (uint32_t i = 0; i < HUD_HISTORY; i++) {
+        if (!hud->frame[i]) continue;
+        frame += hud->frame[i];
+        emulate += hud->emulate[i];
+        render += hud->render[i];
+        frames++;
+    }
+    if (!frames) frames = 1;
+
+    hud_darken(canvas, width, hud_height(canvas->height));
+
+    const double fps = frame ? 1000.0 * frames / (frame * ms) : 0.0;
+    if (config.vip_timing) snprintf(line, sizeof(line), "IPS %u VIP FPS %.0f", hud->ips, fps);
+    else snprintf(line, sizeof(line), "IPS %u/%u FPS %.0f", hud->ips, config.instr_per_sec, fps);
+    hud_text(canvas, 2 * z, 2 * z, line, 0xFFFFFFFF);
+    snprintf(line, sizeof(line), "FRM %.1f EMU %.2f DRW %.2f", frame * ms / frames, emulate * ms / frames,
+             render * ms / frames);
+    hud_text(canvas, 2 * z, 8 * z, line, 0xFFFFFFFF);
+    const uint32_t queued = atomic_load_explicit(&sdl->audio->sound.head, memory_order_relaxed) -
+                            atomic_load_explicit(&sdl->audio->sound.tail, memory_order_relaxed);
+    snprintf(line, sizeof(line), "SND Q %u/%u BUF %u", queued, SOUND_EVENTS, sdl->have.samples);
+    hud_text(canvas, 2 * z, 14 * z, line, 0xFFFFFFFF);
+    snprintf(line, sizeof(line), "%s %s FADE %.1f", modes[config.current_extension], filters[config.upscale_filter],
+             config.color_lerp_rate);
+    hud_text(canvas, 2 * z, 20 * z, line, 0xFFFFFFFF);
+
+    // One bar per frame, oldest on the left: emulating (green), rendering (blue) and the rest of
+    // the frame (grey), stacked. Full height is two frame periods, the dots mark one period.
+    const uint32_t top = 28 * z, graph = 16 * z;
+    const double period = (double)SDL_GetPerformanceFrequency() / 60.0;
+    for (uint32_t i = 0; i < HUD_HISTORY; i++) {
+        const uint32_t slot = (hud->pos + i) % HUD_HISTORY;
+        const uint32_t x = (2 + i * 2) * z;
+        const uint32_t total = (uint32_t)fmin(graph, hud->frame[slot] * graph / (2 * period));
+        const uint32_t emu = (uint32_t)fmin(total, hud->emulate[slot] * graph / (2 * period));
+        const uint32_t draw = (uint32_t)fmin(total - emu, hud->render[slot] * graph / (2 * period));
+
+        hud_fill(canvas, x, top + graph - total, 2 * z, total - emu - draw, 0x808080FF);
+        hud_fill(canvas, x, top + graph - emu - draw, 2 * z, draw, 0x4080FFFF);
+        hud_fill(canvas, x, top + graph - emu, 2 * z, emu, 0x40E040FF);
+        if (i % 2 == 0) hud_fill(canvas, x, top + graph / 2, z, z, 0xFFE040FF);
+    }
+}
+
+// Record where the last frame's time went and update the effective speed once a second
+void hud_record_frame(hud_t *hud, const uint64_t frame, const uint64_t emulate, const uint64_t render) {
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+
+    hud->frame[hud->pos] = frame;
+    hud->emulate[hud->pos] = emulate;
+    hud->render[hud->pos] = render;
+    hud->pos = (hud->pos + 1) % HUD_HISTORY;
+
+    if (!hud->window_start) {
+        hud->window_start = now;
+        hud->instructions = 0;
+    } else if (now - hud->window_start >= freq) {
+        hud->ips = (uint32_t)(hud->instructions * freq / (now - hud->window_start));
+        hud->window_start = now;
+        hud->instructions = 0;
+    }
+}
+
+// Update window with any changes. Only rows that changed or are still fading are faded and
+// upscaled into the streaming texture, and nothing is uploaded or presented when the frame is
+// identical to the one already on screen.
+void update_screen(sdl_t *sdl, const config_t config, chip8_t *chip8) {
+    static uint32_t scale2x_buffer[128*64];     // Scale4x intermediate, 2x the framebuffer
+    const uint32_t w = config.window_width;
+    const uint32_t h = config.window_height;
+    const uint64_t all_rows = ((uint64_t)1 << h) - 1;
+    const uint32_t old_scale = sdl->screen_scale;
+
+    const bool hud = config.hud && config.hud->visible;
+
+    uint64_t rows = fade_dirty_rows(chip8, config);
+
+    if (!create_screen_texture(sdl, config)) return;
+    if (sdl->screen_scale != old_scale) rows = all_rows;    // New texture starts out empty
+    if (hud != sdl->hud_drawn) {
+        // The overlay comes or goes, rebuild the whole frame under it
+        rows = all_rows;
+        sdl->screen_hash = 0;
+        sdl->hud_drawn = hud;
+    }
+
+    // The HUD changes every frame, the rows under it are redrawn with it
+    if (hud) {
+        const uint32_t hud_rows = (hud_height(h * sdl->screen_scale) + sdl->screen_scale - 1) / sdl->screen_scale;
+        rows |= (hud_rows < h) ? ((uint64_t)1 << hud_rows) - 1 : all_rows;
+    }
+
+    const uint64_t hash = frame_hash(chip8, config);
+    if (!hud && (hash == sdl->screen_hash || rows == 0)) return;
+    sdl->screen_hash = hash;
+
+    // The smoothing filters read the rows above and below, so their neighbours change too
+    const uint32_t reach = (config.upscale_filter == SCALE_4X) ? 2 : (config.upscale_filter != SCALE_NEAREST);
+    for (uint32_t i = 0; i < reach; i++) {
+        rows |= (rows << 1) | (rows >> 1);
+    }
+    rows &= all_rows;
+
+    uint32_t y0 = 0, y1 = h - 1;
+    while (!((rows >> y0) & 1)) y0++;
+    while (!((rows >> y1) & 1)) y1--;
+
+    // Lock just the band of texture rows that changes
+    const uint32_t scale = sdl->screen_scale;
+    const SDL_Rect band = {.x = 0, .y = y0 * scale, .w = w * scale, .h = (y1 - y0 + 1) * scale};
+    void *pixels;
+    int pitch;
+
+    if (SDL_LockTexture(sdl->screen, &band, &pixels, &pitch) != 0) {
+        SDL_Log("Could not lock screen texture: %s\n", SDL_GetError());
+        return;
+    }
+    uint32_t *dst = (uint32_t *)pixels;
+    const uint32_t dst_pitch = pitch / sizeof(uint32_t);
+
+    switch (config.upscale_filter) {
+        case SCALE_2X:
+            scale2x(chip8->pixel_color, w, h, y0, y1, dst, dst_pitch);
+            break;
+        case SCALE_3X:
+            scale3x(chip8->pixel_color, w, h, y0, y1, dst, dst_pitch);
+            break;
+        case SCALE_4X: {
+            // First pass covers the intermediate rows the second pass reads around the band
+            const uint32_t a0 = y0 > 0 ? y0 - 1 : 0;
+            const uint32_t a1 = y1 < h - 1 ? y1 + 1 : h - 1;
+            scale2x(chip8->pixel_color, w, h, a0, a1, &scale2x_buffer[2 * a0 * 2 * w], 2 * w);
+            scale2x(scale2x_buffer, 2 * w, 2 * h, 2 * y0, 2 * y1 + 1, dst, dst_pitch);
+            break;
+        }
+        default:
+            scale_nearest(chip8->pixel_color, chip8->display, w, y0, y1, scale,
+                          config.pixel_outlines, config.bg_color, dst, dst_pitch);
+            break;
+    }
+
+    // The band starts at texture row 0 whenever the HUD is shown, its rows are always in it
+    if (hud) {
+        const uint32_t zoom = (h * scale) / 128 ? (h * scale) / 128 : 1;
+        const hud_canvas_t canvas = {
+            .pixels = dst, .pitch = dst_pitch, .width = w * scale, .height = (y1 + 1) * scale, .zoom = zoom,
+        };
+        draw_hud(config.hud, sdl, config, &canvas);
+    }
+    SDL_UnlockTexture(sdl->screen);
+
+    SDL_RenderCopy(sdl->renderer, sdl->screen, NULL, NULL);
+    SDL_RenderPresent(sdl->renderer);
+}
+
+// Host keys for the CHIP8 keypad: the 4x4 block under 1234 plus the arrow keys
+typedef struct {
+    SDL_Keycode sym;
+    uint8_t key;
+} keymap_t;
+
+const keymap_t keymap[] = {
+    {SDLK_1, 0x1}, {SDLK_2, 0x2}, {SDLK_3, 0x3}, {SDLK_4, 0xC},
+    {SDLK_q, 0x4}, {SDLK_w, 0x5}, {SDLK_e, 0x6}, {SDLK_r, 0xD},
+    {SDLK_a, 0x7}, {SDLK_s, 0x8}, {SDLK_d, 0x9}, {SDLK_f, 0xE},
+    {SDLK_z, 0xA}, {SDLK_x, 0x0}, {SDLK_c, 0xB}, {SDLK_v, 0xF},
+    {SDLK_UP, 0x5}, {SDLK_DOWN, 0x8}, {SDLK_LEFT, 0x4}, {SDLK_RIGHT, 0x6},
+};
+
+// CHIP8 key for a host key, -1 if it is not mapped
+int keymap_lookup(const SDL_Keycode sym) {
+    for (size_t i = 0; i < sizeof keymap / sizeof keymap[0]; i++) {
+        if (keymap[i].sym == sym) return keymap[i].key;
+    }
+    return -1;
+}
+
+// Spread the queued events over the next frame's instructions by where their timestamps fall
+// between the previous frame and now
+void input_schedule(input_queue_t *queue, const uint32_t budget) {
+    const uint32_t now = SDL_GetTicks();
+    const uint32_t span = now - queue->window_start;
+    uint32_t last = 0;
+
+    for (uint32_t i = 0; i < queue->count; i++) {
+        input_event_t *event = &queue->events[i];
+        const uint32_t offset = event->time - queue->window_start;
+        uint32_t instr = 0;
+
+        // Events from before the window (e.g. while paused) go first, ones after it go last
+        if (span && offset <= span) instr = (uint32_t)((uint64_t)offset * budget / span);
+        else if (offset > span && offset < UINT32_MAX / 2) instr = budget;
+        if (instr >= budget) instr = budget ? budget - 1 : 0;
+        if (instr < last) instr = last;     // Keep the events in order
+        event->instr = last = instr;
+    }
+    queue->applied = 0;
+    queue->window_start = now;
+}
+
+// Apply the queued events due at or before instruction i, returning where the next one is due
+uint32_t input_apply(chip8_t *chip8, input_queue_t *queue, const uint32_t i, const uint32_t budget) {
+    while (queue->applied < queue->count && queue->events[queue->applied].instr <= i) {
+        const input_event_t *event = &queue->events[queue->applied++];
+
+        if (event->down) {
+            chip8->keypad |= 1u << event->key;
+            if (queue->probe && !queue->probe_time) {
+                queue->probe_time = event->time ? event->time : 1;
+                queue->probe_frames = 0;
+                memcpy(queue->probe_display, chip8->display, sizeof chip8->display);
+            }
+        } else {
+            chip8->keypad &= ~(1u << event->key);
+        }
+    }
+    return queue->applied < queue->count ? queue->events[queue->applied].instr : budget;
+}
+
+// Press or release a key, through the input queue when there is one. A full queue is applied
+// at once first, so the keypad still sees every change in order.
+void key_event(chip8_t *chip8, const config_t *config, const uint8_t key, const bool down,
+               const uint32_t time) {
+    input_queue_t *queue = config->input;
+
+    if (!queue) {
+        if (down) chip8->keypad |= 1u << key;
+        else chip8->keypad &= ~(1u << key);
+        return;
+    }
+    if (queue->count == INPUT_QUEUE) {
+        input_apply(chip8, queue, UINT32_MAX, 0);
+        queue->count = queue->applied = 0;
+    }
+    queue->events[queue->count++] = (input_event_t){ .time = time, .key = key, .down = down };
+}
+
+// After a present: if the screen changed since the probed press, record how long it took
+void input_probe(input_queue_t *queue, const chip8_t *chip8) {
+    if (!queue->probe_time) return;
+
+    if (memcmp(queue->probe_display, chip8->display, sizeof chip8->display) != 0) {
+        const uint32_t latency = SDL_GetTicks() - queue->probe_time;
+        printf("Latency: %u ms (%u frames)\n", latency, queue->probe_frames + 1);
+        if (!queue->probe_count || latency < queue->probe_min) queue->probe_min = latency;
+        if (latency > queue->probe_max) queue->probe_max = latency;
+        queue->probe_sum += latency;
+        queue->probe_count++;
+        queue->probe_time = 0;
+    } else if (++queue->probe_frames >= 60) {
+        queue->probe_time = 0;      // The ROM ignored this press
+    }
+}
+
+ram_search_t *ram_search_create(void) {
+    return calloc(1, sizeof(ram_search_t));
+}
+
+void ram_search_destroy(ram_search_t *search) {
+    free(search);
+}
+
+// Start over from a snapshot of ram with every address a candidate
+void ram_search_begin(ram_search_t *search, const uint8_t ram[4096]) {
+    memcpy(search->snapshot, ram, sizeof(search->snapshot));
+    memset(search->candidates, 0xFF, sizeof(search->candidates));
+    search->count = 4096;
+}
+
+// One pass over the address space, 64 addresses per candidate word. Each filter is a plain
+// byte compare loop with no branches, which the compiler turns into 16/32-byte vector compares
+// (add -mavx2 on x86), then the compare results are packed into the candidate bits. Words with
+// no candidates left are skipped.
+uint32_t ram_search_filter(ram_search_t *search, const uint8_t ram[4096], const int filter, const uint8_t value) {
+    uint32_t count = 0;
+
+    for (uint32_t w = 0; w < 4096 / 64; w++) {
+        if (!search->candidates[w]) continue;
+
+        const uint8_t *now = &ram[w * 64];
+        const uint8_t *prev = &search->snapshot[w * 64];
+        uint8_t hit[64];
+        switch (filter) {
+            case RAM_SEARCH_UNCHANGED: for (uint32_t b = 0; b < 64; b++) hit[b] = now[b] == prev[b]; break;
+            case RAM_SEARCH_CHANGED:   for (uint32_t b = 0; b < 64; b++) hit[b] = now[b] != prev[b]; break;
+            case RAM_SEARCH_INCREASED: for (uint32_t b = 0; b < 64; b++) hit[b] = now[b] > prev[b]; break;
+            case RAM_SEARCH_DECREASED: for (uint32_t b = 0; b < 64; b++) hit[b] = now[b] < prev[b]; break;
+            case RAM_SEARCH_EQUALS:    for (uint32_t b = 0; b < 64; b++) hit[b] = now[b] == value; break;
+            default:                   memset(hit, 1, sizeof(hit)); break;
+        }
+
+        uint64_t bits = 0;
+        for (uint32_t b = 0; b < 64; b++) bits |= (uint64_t)hit[b] << b;
+        search->candidates[w] &= bits;
+        count += (uint32_t)__builtin_popcountll(search->candidates[w]);
+    }
+
+    memcpy(search->snapshot, ram, sizeof(search->snapshot));
+    search->count = count;
+    return count;
+}
+
+// Flat copy of a machine's RAM, shared pages included
+void copy_ram(const chip8_t *chip8, uint8_t ram[4096]) {
+    for (uint32_t p = 0; p < RAM_PAGES; p++) memcpy(&ram[p * RAM_PAGE_SIZE], chip8->page[p], RAM_PAGE_SIZE);
+}
+
+// F1 starts a RAM search, F2-F6 filter it against the previous snapshot, F7 lists the
+// candidates. Few enough candidates are listed with their last two values after every step.
+void search_key(ram_search_t *search, const chip8_t *chip8, const config_t *config, const SDL_Keycode sym) {
+    static const char *const names[] = {"unchanged", "changed", "increased", "decreased", "equal to"};
+    uint8_t ram[4096], prev[4096];
+    copy_ram(chip8, ram);
+    memcpy(prev, search->snapshot, sizeof(prev));
+
+    if (sym == SDLK_F1) {
+        ram_search_begin(search, ram);
+        printf("RAM search: 4096 candidates\n");
+        return;
+    }
+    if (sym != SDLK_F7) {
+        const int filter = RAM_SEARCH_UNCHANGED + (int)(sym - SDLK_F2);
+        const uint64_t start = SDL_GetPerformanceCounter();
+        ram_search_filter(search, ram, filter, config->search_value);
+        const double us = (double)(SDL_GetPerformanceCounter() - start) * 1e6 / (double)SDL_GetPerformanceFrequency();
+        if (filter == RAM_SEARCH_EQUALS) {
+            printf("RAM search: %u candidates %s %u (%.1f us)\n", search->count, names[filter], config->search_value, us);
+        } else {
+            printf("RAM search: %u candidates %s (%.1f us)\n", search->count, names[filter], us);
+        }
+        if (search->count > 16) return;
+    }
+
+    for (uint32_t a = 0; a < 4096; a++) {
+        if ((search->candidates[a / 64] >> (a % 64)) & 1) printf("  0x%03X: %3u -> %3u\n", a, prev[a], ram[a]);
+    }
+}
+
+// Apply a single SDL event to the emulator
+void handle_event(chip8_t *chip8, config_t *config, const SDL_Event event) {
+    switch (event.type) {
+        case SDL_QUIT:
+            chip8->state = QUIT;
+            break;
+        // Exit window, end program
+
+        case SDL_KEYDOWN:
+            switch (event.key.keysym.sym) {
+                case SDLK_ESCAPE: //pressing escape button quits it
+                    printf("==== QUIT ====\n");
+                    chip8->state = QUIT;
+                    break;
+                case SDLK_SPACE: //pressing space to pause the emulator action
+                    if (chip8->state == RUNNING) {
+                        chip8->state = PAUSED;
+                        puts("==== PAUSED ====");
+                    } else {
+                        chip8->state = RUNNING;
+                    }
+                    break;
+
+                case SDLK_EQUALS:
+                    //press '=' to reset the emulator from its in-memory ROM image, no disk access
+                    //A netplay peer would not reset along and the machines would diverge for good
+                    if (!config->netplay_port) reset_chip8(chip8, *config, chip8->rom);
+                    break;
+
+                case SDLK_PAGEUP:
+                    //PAGEUP/PAGEDOWN switch to the previous/next ROM of the library
+                    if (config->library && !config->netplay_port) switch_rom(chip8, config, -1);
+                    break;
+
+                case SDLK_PAGEDOWN:
+                    if (config->library && !config->netplay_port) switch_rom(chip8, config, 1);
+                    break;
+                
+                case SDLK_j:
+                    //press 'j' tp decrease lerping rate
+                    if (config->color_lerp_rate > 0.1) {
+                        config->color_lerp_rate -= 0.1;
+                    }
+                    break;
+                
+                case SDLK_k:
+                    //press 'k' to increase lerping rate
+                    if (config->color_lerp_rate < 1.0) {
+                        config->color_lerp_rate += 0.1;
+                    }
+                    break;
+
+                case SDLK_o:
+                    //press 'o' to reduce the volume
+                    if (config->volume > 0) {
+                        config->volume -= 250;
+                    }
+                    break;
+                
+                case SDLK_p:
+                    //press 'p' to increase the volume
+                    if (config->volume < INT16_MAX) {
+                        config->volume += 250;
+                    }
+                    break;
+                
+                case SDLK_t: // 't' to toggle between sine and square wave
+                    config->use_sine_wave = !config->use_sine_wave;
+                    printf("Sound wave type: %s\n", config->use_sine_wave ? "Sine" : "Square");
+                    break;
+                    
+                case SDLK_y: // 'y' to toggle pixel outlines
+                    config->pixel_outlines = !config->pixel_outlines;
+                    printf("Pixel outlines: %s\n", config->pixel_outlines ? "Enabled" : "Disabled");
+                    break;
+
+                case SDLK_h: // 'h' to toggle the performance HUD
+                    if (config->hud) config->hud->visible = !config->hud->visible;
+                    break;
+
+                case SDLK_F1: case SDLK_F2: case SDLK_F3: case SDLK_F4:
+                case SDLK_F5: case SDLK_F6: case SDLK_F7:
+                    if (config->search) search_key(config->search, chip8, config, event.key.keysym.sym);
+                    break;
+
+                default: {
+                    const int key = keymap_lookup(event.key.keysym.sym);
+                    if (key >= 0) key_event(chip8, config, key, true, event.key.timestamp);
+                    break;
+                }
+            }
+            break;
+
+        case SDL_KEYUP: {
+            const int key = keymap_lookup(event.key.keysym.sym);
+            if (key >= 0) key_event(chip8, config, key, false, event.key.timestamp);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+void handle_input(chip8_t *chip8, config_t *config) {
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event)) {
+        handle_event(chip8, config, event);
+    }
+}
+
+// Block until an event arrives (or IDLE_WAIT_MS passes) instead of spinning through empty frames
+void wait_for_input(chip8_t *chip8, config_t *config) {
+    SDL_Event event;
+
+    if (SDL_WaitEventTimeout(&event, IDLE_WAIT_MS)) {
+        handle_event(chip8, config, event);
+    }
+}
+
+void init_frame_timer(frame_timer_t *timer) {
+    *timer = (frame_timer_t){.period = SDL_GetPerformanceFrequency() / 60};
+}
+
+// Wait for the end of the current frame. SDL_Delay only sleeps in whole milliseconds and wakes
+// up late by up to a scheduler tick, so it covers the wait up to the oversleep seen recently and
+// the last stretch spins on the performance counter.
+void wait_frame(frame_timer_t *timer) {
+    const uint64_t ms = SDL_GetPerformanceFrequency() / 1000;
+    uint64_t now = SDL_GetPerformanceCounter();
+
+    if (timer->deadline == 0) timer->deadline = now;
+
+    while (now + timer->oversleep + ms < timer->deadline) {
+        const uint64_t delay = (timer->deadline - now - timer->oversleep) / ms;
+        SDL_Delay((uint32_t)delay);
+        const uint64_t woke = SDL_GetPerformanceCounter();
+        const uint64_t late = (woke - now > delay * ms) ? woke - now - delay * ms : 0;
+
+        // Jump up to a late wakeup straight away, drift back down slowly
+        timer->oversleep = (late > timer->oversleep) ? late : timer->oversleep - (timer->oversleep - late) / 16;
+        now = woke;
+    }
+    while (now < timer->deadline) now = SDL_GetPerformanceCounter();
+
+    // A frame that overran by more than a whole period starts a new schedule rather than
+    // running the next frames back to back to catch up
+    timer->deadline += timer->period;
+    if (now >= timer->deadline) timer->deadline = now + timer->period;
+}
+
+#ifdef DEBUG
+void print_debug_info(chip8_t *chip8){
+
+    printf("Address: 0x%04X and Opcode: 0x%04X Desc: ", chip8->PC-2, chip8->inst.opcode);
+    switch ((chip8->inst.opcode >> 12) & 0X0F ) {
+        case 0X00: 
+            if(chip8->inst.nn == 0XE0){
+                //0X00E0 --> clear screen
+                printf("clear screen\n");
+            }
+            else if(chip8->inst.nn == 0XEE){
+                //0X00EE --> returns from a sub routine
+                //Grabs the last address from the stack 
+                printf("return from a subroutine to address 0x%04X\n", *(chip8->stack_ptr - 1));
+                //chip8->PC = *--chip8->stack_ptr;
+            }
+            else{
+                printf("Unimplemented code\n");
+            }
+        break;
+
+        case 0x01:
+            // 0x1NNN: Jumps to address NNN
+            printf("Jumps to address NNN: 0x%04x\n", chip8->inst.nnn); // Jump to subroutine address
+            break;
+
+        case 0X02:
+            printf("calls a subroutine at address: 0X%04x\n", chip8->inst.nnn);
+            //0X2NNN calls a subroutine AT address NNN 
+            //*chip8->stack_ptr++ = chip8->PC; //store current address in PC
+            //chip8->PC = chip8->inst.nnn;
+        break;
+
+        case 0x03:
+            // 0x3XNN: Check if VX == NN, if so, skip the next instruction
+            printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",
+                   chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.nn);
+            break;
+
+        case 0x04:
+            // 0x4XNN: Check if VX != NN, if so, skip the next instruction
+            printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",
+                   chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.nn);
+            break;
+
+        case 0x05:
+            // 0x5XY0: Check if VX == VY, if so, skip the next instruction
+            printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
+                   chip8->inst.x, chip8->V[chip8->inst.x], 
+                   chip8->inst.y, chip8->V[chip8->inst.y]);
+            break;
+
+        case 0x06:
+            ///0x6XNN sets the register Vx to nn
+            printf("Set register V%x to NN 0x%02x\n",
+            chip8->inst.x, chip8->inst.nn);
+            //chip8->V[chip8->inst.x] = chip8->inst.nn;
+            break;
+        
+         case 0x07:
+            //0x7XNN sets the register Vx+= nn
+            printf("Set register V%X (0x%02X) += NN (0x%02X). Result: 0x%02X\n",
+                   chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.nn,
+                   chip8->V[chip8->inst.x] + chip8->inst.nn);
+            break;
+        
+        case 0x08:
+            switch(chip8->inst.n) {
+                case 0:
+                    // 0x8XY0: Set register VX = VY
+                    printf("Set register V%X = V%X (0x%02X)\n",
+                           chip8->inst.x, chip8->inst.y, chip8->V[chip8->inst.y]);
+                    break;
+
+                case 1:
+                    // 0x8XY1: Set register VX |= VY
+                    printf("Set register V%X (0x%02X) |= V%X (0x%02X); Result: 0x%02X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->inst.y, chip8->V[chip8->inst.y],
+                           chip8->V[chip8->inst.x] | chip8->V[chip8->inst.y]);
+                    break;
+
+                case 2:
+                    // 0x8XY2: Set register VX &= VY
+                    printf("Set register V%X (0x%02X) &= V%X (0x%02X); Result: 0x%02X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->inst.y, chip8->V[chip8->inst.y],
+                           chip8->V[chip8->inst.x] & chip8->V[chip8->inst.y]);
+                    break;
+
+                case 3:
+                    // 0x8XY3: Set register VX ^= VY
+                    printf("Set register V%X (0x%02X) ^= V%X (0x%02X); Result: 0x%02X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->inst.y, chip8->V[chip8->inst.y],
+                           chip8->V[chip8->inst.x] ^ chip8->V[chip8->inst.y]);
+                    break;
+
+                case 4:
+                    // 0x8XY4: Set register VX += VY, set VF to 1 if carry
+                    printf("Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry; Result: 0x%02X, VF = %X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->inst.y, chip8->V[chip8->inst.y],
+                           chip8->V[chip8->inst.x] + chip8->V[chip8->inst.y],
+                           ((uint16_t)(chip8->V[chip8->inst.x] + chip8->V[chip8->inst.y]) > 255));
+                    break;
+
+                case 5:
+                    // 0x8XY5: Set register VX -= VY, set VF to 1 if there is not a borrow (result is positive/0)
+                    printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->inst.y, chip8->V[chip8->inst.y],
+                           chip8->V[chip8->inst.x] - chip8->V[chip8->inst.y],
+                           (chip8->V[chip8->inst.y] <= chip8->V[chip8->inst.x]));
+                    break;
+
+                case 6:
+                    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
+                    printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->V[chip8->inst.x] & 1,
+                           chip8->V[chip8->inst.x] >> 1);
+                    break;
+
+                case 7:
+                    // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive/0)
+                    printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
+                           chip8->inst.x, chip8->inst.y, chip8->V[chip8->inst.y],
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->V[chip8->inst.y] - chip8->V[chip8->inst.x],
+                           (chip8->V[chip8->inst.x] <= chip8->V[chip8->inst.y]));
+                    break;
+                // note, Vx is V%, chip8->int.x
+                //value in vx is chip8->V[chip8->int.x]
+                case 0xE:
+                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+                    printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x],
+                           (chip8->V[chip8->inst.x] & 0X80) >> 7,
+                           chip8->V[chip8->inst.x] << 1);
+                    break;
+
+                default:
+                    // Wrong/unimplemented opcode
+                    break;
+            }
+            break;
+        
+        case 0x09:
+            // 0x9XY0: Check if VX != VY; Skip next instruction if so
+            printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n",
+                   chip8->inst.x, chip8->V[chip8->inst.x], 
+                   chip8->inst.y, chip8->V[chip8->inst.y]);
+            break;
+
+        case 0x0A:
+            //0xANN sets index register to address NNN
+            printf("Sets the I register to NNN (0x%04X)\n",
+            chip8->inst.nnn);
+            //chip8->I = chip8->inst.nnn;
+            break;
+        
+        case 0x0B:
+            // 0xBNNN: Jump to V0 + NNN
+            printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
+                   chip8->V[0], chip8->inst.nnn, chip8->V[0] + chip8->inst.nnn);
+            break;
+        
+        case 0x0C:
+            // 0xCXNN: Sets register VX = random % 256 & NN (bitwise AND)
+            printf("Set V%X = random %% 256 & NN (0x%02X)\n",
+                   chip8->inst.x, chip8->inst.nn);
+            break;
+
+        case 0x0D:
+            printf("Draw N(%u)height sprite t coords V%0X (0x%02X) and V%X (0x%02x) from memory location I (%04x)\n",
+            chip8->inst.n, chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.y, chip8->V[chip8->inst.y], chip8->I);
+
+        //default: printf("Unimplemented Opcode\n");
+        break;
+        
+        case 0x0E:
+            if (chip8->inst.nn == 0x9E) {
+                // 0xEX9E: Skip next instruction if key in VX is pressed
+                printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n",
+                       chip8->inst.x, chip8->V[chip8->inst.x], (chip8->keypad >> (chip8->V[chip8->inst.x] & 0xF)) & 1);
+
+            } else if (chip8->inst.nn == 0xA1) {
+                // 0xEX9E: Skip next instruction if key in VX is not pressed
+                printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n",
+                       chip8->inst.x, chip8->V[chip8->inst.x], (chip8->keypad >> (chip8->V[chip8->inst.x] & 0xF)) & 1);
+            }
+            break;
+        
+        case 0x0F:
+            switch (chip8->inst.nn) {
+                case 0x0A:
+                    // 0xFX0A: VX = get_key(); Await until a keypress, and store in VX
+                    printf("Await until a key is pressed; Store key in V%X\n",
+                           chip8->inst.x);
+                    break;
+
+                case 0x02:
+                    // 0xF002: XO-CHIP, load 16-byte audio pattern from I
+                    printf("Load audio pattern from memory at I (0x%04X)\n", chip8->I);
+                    break;
+
+                case 0x3A:
+                    // 0xFX3A: XO-CHIP, pitch register = VX
+                    printf("Set audio pitch = V%X (0x%02X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x]);
+                    break;
+
+                case 0x1E:
+                    // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does not affect VF
+                    printf("I (0x%04X) += V%X (0x%02X); Result (I): 0x%04X\n",
+                           chip8->I, chip8->inst.x, chip8->V[chip8->inst.x],
+                           chip8->I + chip8->V[chip8->inst.x]);
+                    break;
+                
+                case 0x07:
+                    // 0xFX07: VX = delay timer
+                    printf("Set V%X = delay timer value (0x%02X)\n",
+                           chip8->inst.x, get_delay_timer(chip8));
+                    break;
+
+                case 0x15:
+                    // 0xFX15: delay timer = VX 
+                    printf("Set delay timer value = V%X (0x%02X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x]);
+                    break;
+
+                case 0x18:
+                    // 0xFX18: sound timer = VX 
+                    printf("Set sound timer value = V%X (0x%02X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x]);
+                    break;
+                
+                case 0x29:
+                    // 0xFX29: Set register I to sprite location in memory for character in VX (0x0-0xF)
+                    printf("Set I to sprite location in memory for character in V%X (0x%02X). Result(VX*5) = (0x%02X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->V[chip8->inst.x] * 10);
+                    break;
+                
+                case 0x33:
+                    // 0xFX33: Store BCD representation of VX at memory offset from I;
+                    //   I = hundred's place, I+1 = ten's place, I+2 = one's place
+                    printf("Store BCD representation of V%X (0x%02X) at memory from I (0x%04X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->I);
+                    break;
+                
+                case 0x55:
+                    // 0xFX55: Register dump V0-VX inclusive to memory offset from I;
+                    //   SCHIP does not inrement I, CHIP8 does increment I
+                    printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->I);
+                    break;
+
+                case 0x65:
+                    // 0xFX65: Register load V0-VX inclusive from memory offset from I;
+                    //   SCHIP does not inrement I, CHIP8 does increment I
+                    printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
+                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->I);
+                    break;
+
+                default:
+                    break; //unimplemented codes
+
+    }
+    
+ }
+}
+#endif
+
+// Split an opcode into its operand fields
+void decode_instr(instruction_t *inst, const uint16_t opcode) {
+    inst->opcode = opcode;
+    inst->nnn = opcode & 0x0FFF; // 12-bit address
+    inst->nn  = opcode & 0x00FF; // 8-bit constant
+    inst->n   = opcode & 0x000F; // 4-bit constant
+    inst->x   = (opcode >> 8) & 0x000F; // X register
+    inst->y   = (opcode >> 4) & 0x000F; // Y register
+}
+
+// Remember the first fault, at the instruction being executed
+void raise_fault(chip8_t *chip8, const fault_t fault) {
+    if (chip8->fault) return;
+    chip8->fault = fault;
+    chip8->fault_pc = (chip8->PC - 2) & 0x0FFF;
+}
+
+// 0xDXYN for the instruction in chip8->inst
+void draw_sprite(chip8_t *chip8, const config_t config) {
+    // Get coordinates from registers
+    uint8_t x_start = chip8->V[chip8->inst.x];
+    uint8_t y_start = chip8->V[chip8->inst.y];
+    //chip8->inst.n = 10;
+    uint8_t height = chip8->inst.n;
+    if (chip8->I + height > 0x1000) raise_fault(chip8, FAULT_MEMORY);
+    
+    // Log the instruction details
+    //SDL_Log("Drawing sprite: x=%d, y=%d, height=%d, I=0x%04X", 
+            //x_start, y_start, height, chip8->I);
+    
+    // Reset collision flag
+    chip8->V[0xF] = 0;
+    
+    // Draw each row of the sprite
+    for (uint8_t row = 0; row < height; row++) {
+        // Calculate Y position (with wrapping)
+        uint8_t y_pos = (y_start + row) % config.window_height;
+        
+        // Get the sprite row data from memory
+        uint8_t sprite_byte = read_ram(chip8, chip8->I + row);
+
+        // Any set bit flips a pixel, so the row changes unless the sprite row is empty
+        if (sprite_byte) {
+            chip8->dirty_rows |= (uint64_t)1 << y_pos;
+            chip8->draw = true;
+        }
+        
+        // Log the sprite data
+        //SDL_Log("  Row %d: Sprite data = 0x%02X", row, sprite_byte);
+        
+        // Line the sprite byte up with its columns in the row word, rotating wraps it at the edge
+        const uint8_t shift = x_start % config.window_width;
+        const uint64_t sprite = (uint64_t)sprite_byte << 56;
+        const uint64_t sprite_row = shift ? (sprite >> shift) | (sprite << (64 - shift)) : sprite;
+
+        // Check for collision, then XOR the whole row at once
+        if (chip8->display[y_pos] & sprite_row) {
+            chip8->V[0xF] = 1;
+        }
+        chip8->display[y_pos] ^= sprite_row;
+    }
+}
+
+// Opcode handlers, one per instruction. Each runs the instruction already decoded into
+// chip8->inst, PC has been advanced past it.
+
+// Any opcode no handler claims: 0NNN machine code calls, 5XYN/8XYN with an unused N, FX codes
+// outside the instruction set and extension opcodes in the wrong mode. It is skipped like
+// before, but counted, and the first one a machine hits is logged.
+void op_TRAP(chip8_t *chip8, const config_t *config) {
+    raise_fault(chip8, FAULT_OPCODE);
+    if (chip8->traps++ == 0 && config->log_traps) {
+        SDL_Log("Invalid opcode 0x%04X at 0x%03X skipped, further ones are only counted\n",
+                chip8->inst.opcode, (chip8->PC - 2) & 0x0FFF);
+    }
+}
+
+void op_00E0(chip8_t *chip8, const config_t *config) {
+    // 0x0NE0 with N != 0 is a machine code call, not supported
+    if (chip8->inst.x != 0) {
+        op_TRAP(chip8, config);
+        return;
+    }
+    // 0x00E0: Clear screen, only rows that had lit pixels change
+    for (uint32_t y = 0; y < config->window_height; y++) {
+        if (chip8->display[y]) {
+            chip8->dirty_rows |= (uint64_t)1 << y;
+            chip8->draw = true;
+        }
+    }
+    memset(chip8->display, 0, sizeof(chip8->display));
+}
+
+void op_00EE(chip8_t *chip8, const config_t *config) {
+    // 0x0NEE with N != 0 is a machine code call, not supported
+    if (chip8->inst.x != 0) {
+        op_TRAP(chip8, config);
+        return;
+    }
+    // 0x00EE: Return from subroutine
+    // The stack is a ring of 16, so a ROM that returns too often stays in bounds
+    if (chip8->stack_ptr == &chip8->stack[0]) {
+        raise_fault(chip8, FAULT_STACK_UNDERFLOW);
+        chip8->stack_ptr = &chip8->stack[16];
+    }
+    chip8->PC = *--chip8->stack_ptr; // Pop address from stack
+}
+
+void op_1NNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x1NNN: Jumps to address NNN
+    chip8->PC = chip8->inst.nnn; // Jump to subroutine address
+}
+
+void op_2NNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x2NNN: Call subroutine at address NNN
+    if (chip8->stack_ptr == &chip8->stack[16]) {
+        raise_fault(chip8, FAULT_STACK_OVERFLOW);
+        chip8->stack_ptr = &chip8->stack[0];    // Wrap, like 00EE
+    }
+    *chip8->stack_ptr++ = chip8->PC; // Push current address to stack
+    chip8->PC = chip8->inst.nnn; // Jump to subroutine address
+}
+
+void op_3XNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x3xnn Skip next instruction if Vx == kk.
+    //The interpreter compares register Vx to kk, and if they are equal, increments the program counter by 2.
+    if(chip8->V[chip8->inst.x] == chip8->inst.nn)
+    {
+        chip8->PC += 2;
+    }
+}
+
+void op_4XNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //Skip next instruction if Vx != kk.
+    //The interpreter compares register Vx to kk, and if they are not equal, increments the program counter by 2.
+    if(chip8->V[chip8->inst.x] != chip8->inst.nn)
+    {
+        chip8->PC += 2;
+    }
+}
+
+void op_5XY0(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x5XY0
+    //Skip next instruction if Vx == Vy.
+    if(chip8->V[chip8->inst.x] == chip8->V[chip8->inst.y]){
+        chip8->PC += 2;
+    }
+}
+
+void op_6XNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x6XNN: Set register Vx to NN
+    chip8->V[chip8->inst.x] = chip8->inst.nn;
+}
+
+void op_7XNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x7XNN: Add NN to register Vx
+    chip8->V[chip8->inst.x] += chip8->inst.nn;
+}
+
+void op_8XY0(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x8XY0: Set register VX = VY
+    chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y];
+}
+
+void op_8XY1(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x8XY1,  bitwise OR, Vx |= VY
+    chip8->V[chip8->inst.x] |= chip8->V[chip8->inst.y];
+    //Chip8 ONLY quirk --> VF is changed, set to zero
+    chip8->V[0XF] = 0;
+}
+
+void op_8XY2(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x8XY2, bitwise and, vx &= vy
+    chip8->V[chip8->inst.x] &= chip8->V[chip8->inst.y];
+    //chip8 only quirk --> VF is changed, set to zero
+    chip8->V[0XF] = 0;
+}
+
+void op_8XY3(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x8XY3, bitwise xor, vx ^= vy
+    chip8->V[chip8->inst.x] ^= chip8->V[chip8->inst.y];
+    //chip8 only quirk --> VF is changed, set to zero
+    chip8->V[0XF] = 0;
+}
+
+void op_8XY4(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x8XY4: ADD Vx, Vy
+    const bool carry = ((uint16_t)(chip8->V[chip8->inst.x] + chip8->V[chip8->inst.y]) > 255);
+    chip8->V[chip8->inst.x] += chip8->V[chip8->inst.y];
+    chip8->V[0XF] = carry ? 1 : 0;
+}
+
+void op_8XY5(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0x8XY5: SUB Vx, Vy, Vx = Vx - Vy
+    //VF is set to 0 when there's a borrow, and 1 when there isn't
+    const bool carry = (chip8->V[chip8->inst.x] >= chip8->V[chip8->inst.y]);
+    chip8->V[chip8->inst.x] -= chip8->V[chip8->inst.y];
+    chip8->V[0xF] = carry ? 1 : 0;
+}
+
+void op_8XY6(chip8_t *chip8, const config_t *config) {
+    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
+    bool carry;
+    if (config->current_extension == CHIP8) {
+        carry = chip8->V[chip8->inst.y] & 1;    // Use VY
+        chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y] >> 1; // Set VX = VY result
+    } else {
+        carry = chip8->V[chip8->inst.x] & 1;    // Use VX
+        chip8->V[chip8->inst.x] >>= 1;          // Use VX
+    }
+    chip8->V[0xF] = carry;
+}
+
+void op_8XY7(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x8XY7 Vx= Vy - Vx
+    const bool carry = (chip8->V[chip8->inst.y] >= chip8->V[chip8->inst.x]);
+    chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y] - chip8->V[chip8->inst.x];
+    chip8->V[0xF] = carry ? 1 : 0;
+}
+
+void op_8XYE(chip8_t *chip8, const config_t *config) {
+    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+    bool carry;
+    if (config->current_extension == CHIP8) {
+        carry = (chip8->V[chip8->inst.y] & 0x80) >> 7; // Use VY
+        chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y] << 1; // Set VX = VY result
+    } else {
+        carry = (chip8->V[chip8->inst.x] & 0x80) >> 7;  // VX
+        chip8->V[chip8->inst.x] <<= 1;                  // Use VX
+    }
+    chip8->V[0xF] = carry;
+}
+
+void op_9XY0(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //0x9XY0, if Vx != Vy, skip next instruction
+    if(chip8->V[chip8->inst.x] != chip8->V[chip8->inst.y]){
+        chip8->PC += 2;
+    }
+}
+
+void op_ANNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0xANN: Set index register to address NNN
+    chip8->I = chip8->inst.nnn;
+}
+
+void op_BNNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //Bnnn jump to V[0] + nnn address
+    chip8->PC = chip8->V[0] + chip8->inst.nnn;
+}
+
+void op_CXNN(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //CXNN step the instance's xorshift rng for a random number from 0-255 and bitwise and with inst.nn to store result in Vx
+    chip8->rng ^= chip8->rng << 13;
+    chip8->rng ^= chip8->rng >> 17;
+    chip8->rng ^= chip8->rng << 5;
+    chip8->V[chip8->inst.x] = ((chip8->rng % 256) & chip8->inst.nn);
+}
+
+void op_DXYN(chip8_t *chip8, const config_t *config) {
+    // 0xDXYN: Draw an N row sprite from memory at I at (VX, VY), VF = collision
+    draw_sprite(chip8, *config);
+}
+
+void op_EX9E(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0xEX9E: Skip next instruction if key in VX is pressed
+    if((chip8->keypad >> (chip8->V[chip8->inst.x] & 0xF)) & 1)
+        chip8->PC += 2;
+}
+
+void op_EXA1(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    // 0xEXA1: Skip next instruction if key in VX is not pressed
+    if(!((chip8->keypad >> (chip8->V[chip8->inst.x] & 0xF)) & 1)){
+        chip8->PC += 2;
+    }
+}
+
+void op_F002(chip8_t *chip8, const config_t *config) {
+    //0xF002 (XO-CHIP): load the 16-byte audio pattern from memory at I
+    if (config->current_extension != XOCHIP || chip8->inst.x != 0) {
+        op_TRAP(chip8, config);
+        return;
+    }
+    if (chip8->I + sizeof(chip8->audio_pattern) > 0x1000) raise_fault(chip8, FAULT_MEMORY);
+    for (uint8_t i = 0; i < sizeof(chip8->audio_pattern); i++) {
+        chip8->audio_pattern[i] = read_ram(chip8, chip8->I + i);
+    }
+    chip8->audio_pattern_loaded = true;
+    chip8->audio_dirty = true;
+}
+
+void op_FX07(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //set Vx = delay timer
+    chip8->V[chip8->inst.x] = get_delay_timer(chip8);
+}
+
+void op_FX0A(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    bool any_key_pressed = false;
+    for (uint8_t i = 0; i < 16; i++) {
+        if ((chip8->keypad >> i) & 1) {
+            chip8->V[chip8->inst.x] = i; // Store the pressed key in V[x]
+            any_key_pressed = true;
+            break; // Exit the loop as soon as a key is found
+        }
+    }
+    if (! any_key_pressed) {
+        chip8->PC -= 2; // Decrement PC if no key is pressed
+    }
+}
+
+void op_FX15(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //Set delaytimer = Vx
+    chip8->delay_timer = chip8->V[chip8->inst.x];
+    chip8->delay_set = chip8->cycles;
+}
+
+void op_FX18(chip8_t *chip8, const config_t *config) {
+    //set the sound timer to Vx
+    chip8->sound_timer = chip8->V[chip8->inst.x];
+    chip8->sound_set = chip8->cycles;
+    if (config->sound) sound_gate(config->sound, sound_time(chip8, config), chip8->sound_timer > 0, false);
+}
+
+void op_FX1E(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //Adds VX to I. VF is not affected.
+    chip8->I += chip8->V[chip8->inst.x] ;
+}
+
+void op_FX29(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //Set I = location of sprite for digit Vx.
+    chip8->I = chip8->V[chip8->inst.x] * 5;
+}
+
+void op_FX33(chip8_t *chip8, const config_t *config) {
+    (void)config;
+    //The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at
+    //location I+1, and the ones digit at location I+2.
+    if (chip8->I + 3 > 0x1000) raise_fault(chip8, FAULT_MEMORY);
+    uint8_t bcd = chip8->V[chip8->inst.x];
+    write_ram(chip8, chip8->I + 2, bcd % 10);
+    bcd = bcd/10;
+    write_ram(chip8, chip8->I + 1, bcd % 10);
+    bcd = bcd/10;
+    write_ram(chip8, chip8->I, bcd);
+}
+
+void op_FX3A(chip8_t *chip8, const config_t *config) {
+    //0xFX3A (XO-CHIP): set the audio pitch register to Vx
+    if (config->current_extension != XOCHIP) {
+        op_TRAP(chip8, config);
+        return;
+    }
+    chip8->pitch = chip8->V[chip8->inst.x];
+    chip8->audio_dirty = true;
+}
+
+void op_FX55(chip8_t *chip8, const config_t *config) {
+    //0xFx55 --> The interpreter copies the values of registers V0 through Vx into memory, starting at the address in I.
+    //I itself is incremented in chip8 and chip48, but not in SCHIP
+    if (chip8->I + chip8->inst.x + 1 > 0x1000) raise_fault(chip8, FAULT_MEMORY);
+    for (uint8_t i = 0; i <= chip8->inst.x; i++) {
+        if (config->current_extension == CHIP8)
+            write_ram(chip8, chip8->I++, chip8->V[i]); // Increment I each time
+        else
+            write_ram(chip8, chip8->I + i, chip8->V[i]); // I doesn't change
+    }
+}
+
+void op_FX65(chip8_t *chip8, const config_t *config) {
+    // 0xFX65: Register load V0-VX inclusive from memory offset from I
+    if (chip8->I + chip8->inst.x + 1 > 0x1000) raise_fault(chip8, FAULT_MEMORY);
+    for (uint8_t i = 0; i <= chip8->inst.x; i++) {
+        if (config->current_extension == CHIP8)
+            chip8->V[i] = read_ram(chip8, chip8->I++); // Increment I each time
+        else
+            chip8->V[i] = read_ram(chip8, chip8->I + i); // I doesn't change
+    }
+}
+
+// Every handler, in op_t order. X-macro so the handler table and the threaded labels in
+// run_block can't drift apart.
+#define OPCODE_HANDLERS(X) \
+    X(TRAP) X(00E0) X(00EE) X(1NNN) X(2NNN) X(3XNN) X(4XNN) X(5XY0) X(6XNN) X(7XNN) \
+    X(8XY0) X(8XY1) X(8XY2) X(8XY3) X(8XY4) X(8XY5) X(8XY6) X(8XY7) X(8XYE) X(9XY0) \
+    X(ANNN) X(BNNN) X(CXNN) X(DXYN) X(EX9E) X(EXA1) X(F002) X(FX07) X(FX0A) X(FX15) \
+    X(FX18) X(FX1E) X(FX29) X(FX33) X(FX3A) X(FX55) X(FX65)
+
+#define OP_ENUM(name) OP_##name,
+typedef enum {
+    OPCODE_HANDLERS(OP_ENUM)        // OP_TRAP is 0, so table entries left out trap
+    OPS
+} op_t;
+
+typedef void (*op_handler_t)(chip8_t *chip8, const config_t *config);
+
+#define OP_FUNCTION(name) op_##name,
+const op_handler_t op_handlers[OPS] = { OPCODE_HANDLERS(OP_FUNCTION) };
+
+// Two level dispatch table, op_table[opcode >> 12][opcode & 0xFF]. The low byte holds every
+// field the decoder looks at besides the top nibble (NN, or Y and N), so one lookup finds the
+// handler. Built by the compiler, entries not listed stay 0 = OP_TRAP.
+#define OP_X16(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, \
+                    __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, \
+                    __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, \
+                    __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+#define OP_ROW(op) OP_X16(OP_X16(op))
+const uint8_t op_table[16][256] = {
+    [0x0] = {[0xE0] = OP_00E0, [0xEE] = OP_00EE},
+    [0x1] = {OP_ROW(OP_1NNN)},
+    [0x2] = {OP_ROW(OP_2NNN)},
+    [0x3] = {OP_ROW(OP_3XNN)},
+    [0x4] = {OP_ROW(OP_4XNN)},
+    [0x5] = {OP_X16(OP_5XY0, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP,
+                    OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP)},
+    [0x6] = {OP_ROW(OP_6XNN)},
+    [0x7] = {OP_ROW(OP_7XNN)},
+    [0x8] = {OP_X16(OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6, OP_8XY7,
+                    OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_8XYE, OP_TRAP)},
+    [0x9] = {OP_X16(OP_9XY0, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP,
+                    OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP, OP_TRAP)},
+    [0xA] = {OP_ROW(OP_ANNN)},
+    [0xB] = {OP_ROW(OP_BNNN)},
+    [0xC] = {OP_ROW(OP_CXNN)},
+    [0xD] = {OP_ROW(OP_DXYN)},
+    [0xE] = {[0x9E] = OP_EX9E, [0xA1] = OP_EXA1},
+    [0xF] = {[0x02] = OP_F002, [0x07] = OP_FX07, [0x0A] = OP_FX0A, [0x15] = OP_FX15,
+             [0x18] = OP_FX18, [0x1E] = OP_FX1E, [0x29] = OP_FX29, [0x33] = OP_FX33,
+             [0x3A] = OP_FX3A, [0x55] = OP_FX55, [0x65] = OP_FX65},
+};
+
+// Fetch the opcode at PC into chip8->inst and step PC past it
+void fetch_instr(chip8_t *chip8) {
+    // Get next opcode (Big Endian) and fill current instruction format
+    decode_instr(&chip8->inst, (read_ram(chip8, chip8->PC) << 8) | read_ram(chip8, chip8->PC + 1));
+    chip8->PC += 2; // Increment PC
+
+#ifdef DEBUG
+    print_debug_info(chip8); // Debug output
+#endif
+}
+
+//emulate chip8 instructions
+void emu_instr(chip8_t *chip8, const config_t config) {
+    fetch_instr(chip8);
+    op_handlers[op_table[chip8->inst.opcode >> 12][chip8->inst.nn]](chip8, &config);
+    chip8->cycles++;
+}
+
+// Run up to budget instructions back to back, returns how many ran (at least 1). Stops early
+// after a CHIP8 DXYN (display wait), and before an address that has a superinstruction so the
+// caller can run it fused. With GCC/Clang every handler ends in its own indirect jump to the
+// next one (threaded code), so each jump is predicted from the opcode before it instead of all
+// opcodes sharing a single dispatch branch.
+uint32_t run_block(chip8_t *chip8, const config_t config, const uint32_t budget) {
+    const uint8_t *fusion = config.fusion ? chip8->rom->fusion : NULL;
+    const bool display_wait = config.current_extension == CHIP8;
+    uint32_t executed = 0;
+
+#if defined(__GNUC__) && !defined(CHIP8_NO_THREADED)
+    #define OP_LABEL(name) &&do_##name,
+    static const void *const labels[OPS] = { OPCODE_HANDLERS(OP_LABEL) };
+
+    #define NEXT_INSTR() \
+        chip8->cycles++; \
+        if (++executed == budget || (display_wait && (chip8->inst.opcode >> 12) == 0xD) || \
+            (fusion && fusion[chip8->PC & 0x0FFF])) return executed; \
+        fetch_instr(chip8); \
+        goto *labels[op_table[chip8->inst.opcode >> 12][chip8->inst.nn]];
+
+    #define OP_BODY(name) do_##name: op_##name(chip8, &config); NEXT_INSTR()
+
+    fetch_instr(chip8);
+    goto *labels[op_table[chip8->inst.opcode >> 12][chip8->inst.nn]];
+    OPCODE_HANDLERS(OP_BODY)
+
+    #undef OP_BODY
+    #undef NEXT_INSTR
+    #undef OP_LABEL
+#else
+    do {
+        emu_instr(chip8, config);
+    } while (++executed < budget && !(display_wait && (chip8->inst.opcode >> 12) == 0xD) &&
+             !(fusion && fusion[chip8->PC & 0x0FFF]));
+    return executed;
+#endif
+}
+
+// Hand a changed XO-CHIP pattern/pitch to the audio callback
+void sync_audio(const sdl_t sdl, chip8_t *chip8) {
+    if (!chip8->audio_dirty) return;
+
+    SDL_LockAudioDevice(sdl.dev);
+    memcpy(sdl.audio->pattern, chip8->audio_pattern, sizeof(sdl.audio->pattern));
+    sdl.audio->pitch = chip8->pitch;
+    sdl.audio->use_pattern = chip8->audio_pattern_loaded;
+    SDL_UnlockAudioDevice(sdl.dev);
+    chip8->audio_dirty = false;
+}
+
+// Pause or unpause the audio device. A paused device stops calling back, so the gap before
+// the next callback must not count as an underrun.
+void pause_audio(const sdl_t sdl, const bool pause) {
+    SDL_PauseAudioDevice(sdl.dev, pause);
+    if (pause && sdl.audio->metrics) {
+        atomic_store_explicit(&sdl.audio->metrics->audio_paused, true, memory_order_relaxed);
+    }
+}
+
+// Start or stop the tone after a frame. The sound timer runs out on a tick boundary, which is
+// where frames end, so with the sound queue the tone stops on the sample this frame ends at
+// and the device is never paused (each pause or resume takes the SDL audio lock).
+void update_sound(const sdl_t sdl, const config_t *config, const chip8_t *chip8){
+    if (config->sound) {
+        sound_gate(config->sound, sound_time(chip8, config), get_sound_timer(chip8) > 0, false);
+    } else {
+        pause_audio(sdl, !frame_beeped(chip8));
+    }
+}
+
+// Run a sequence of the fusion set from pc: each opcode is decoded straight from the image and
+// its handler called without a fetch, a dispatch lookup or a budget check. Stops early where
+// running one by one would leave the sequence: a skip or jump taken, a display wait, or a write
+// to memory this machine did not own yet (it may be the code still to run).
+uint32_t run_sequence(chip8_t *chip8, const config_t config, const fusion_sequence_t *sequence, const uint16_t pc) {
+    const bool display_wait = config.current_extension == CHIP8;
+    const uint32_t pages = chip8->private_pages;
+
+    for (uint32_t k = 0; k < sequence->length; k++) {
+        const uint8_t *code = &chip8->rom->ram[pc + 2 * k];
+        const uint16_t next = pc + 2 * k + 2;
+        decode_instr(&chip8->inst, (code[0] << 8) | code[1]);
+        chip8->PC = next;
+        op_handlers[sequence->ops[k]](chip8, &config);
+        chip8->cycles++;
+        if (chip8->PC != next || (display_wait && sequence->ops[k] == OP_DXYN) ||
+            chip8->private_pages != pages) return k + 1;
+    }
+    return sequence->length;
+}
+
+// Hand-written loop idioms, they stand for whole passes of the loop and return how many
+// instructions those were
+uint32_t run_loop_idiom(chip8_t *chip8, const uint8_t kind, const uint32_t budget) {
+    const uint16_t pc = chip8->PC;
+    const uint8_t *code = &chip8->rom->ram[pc];
+    const uint8_t x = code[0] & 0x0F;
+
+    if (kind == FUSE_WAIT_LOOP) {
+        chip8->V[x] = get_delay_timer(chip8);
+        if (chip8->V[x] == 0) {
+            // 3X00 skips the jump
+            chip8->PC = pc + 6;
+            decode_instr(&chip8->inst, (code[2] << 8) | code[3]);
+            return 2;
+        }
+        // The timer only changes at the next tick boundary, every whole pass before it is the same
+        const uint64_t left = chip8->tick_slots - chip8->cycles % chip8->tick_slots;
+        const uint32_t slots = left < budget ? (uint32_t)left : budget;
+        if (slots < 3) return 0;
+        chip8->PC = pc;
+        decode_instr(&chip8->inst, (code[4] << 8) | code[5]);
+        return slots - slots % 3;
+    }
+
+    // FUSE_COUNT_LOOP
+    uint32_t executed = 0;
+    do {
+        chip8->V[x] += code[1];
+        executed += 2;
+        if (chip8->V[x] == code[3]) {
+            chip8->PC = pc + 6;
+            decode_instr(&chip8->inst, (code[2] << 8) | code[3]);
+            return executed;
+        }
+        executed++;
+    } while (budget - executed >= 3);
+    chip8->PC = pc;
+    decode_instr(&chip8->inst, (code[4] << 8) | code[5]);
+    return executed;
+}
+
+// Run the superinstruction at PC if there is one and budget instructions allow it. Returns how
+// many instructions it stood for, with their cycles counted, 0 when the next instruction has to
+// run on its own. Jumps into the middle of a sequence land on an address with its own (or no)
+// fusion entry.
+uint32_t run_fused(chip8_t *chip8, const config_t config, const uint32_t budget) {
+    const uint16_t pc = chip8->PC;
+    if (pc > 0x0FFF || budget < 2) return 0;
+
+    const uint8_t kind = chip8->rom->fusion[pc];
+    if (kind == FUSE_NONE || (kind >= FUSE_SEQUENCE && !config.fusion_set)) return 0;
+    const fusion_sequence_t *sequence = kind >= FUSE_SEQUENCE ? &config.fusion_set->sequences[kind - FUSE_SEQUENCE] : NULL;
+    const uint32_t length = sequence ? sequence->length : 3;
+    if (budget < length) return 0;
+
+    // The table describes the pristine image, pages this machine has written may hold other code
+    if (((chip8->private_pages >> (pc / RAM_PAGE_SIZE)) & 1) ||
+        ((chip8->private_pages >> ((pc + 2 * length - 1) / RAM_PAGE_SIZE)) & 1)) return 0;
+
+    if (sequence) return run_sequence(chip8, config, sequence, pc);
+    const uint32_t executed = run_loop_idiom(chip8, kind, budget);
+    chip8->cycles += executed;
+    return executed;
+}
+
+// Count the edge from the previous instruction to the one at addr
+void coverage_record(coverage_t *coverage, const uint16_t addr) {
+    const uint16_t id = (uint16_t)((addr & 0x0FFF) * 40503u);  // Spread 12-bit addresses over the map
+    coverage->map[(coverage->prev ^ id) & (COVERAGE_SIZE - 1)]++;
+    coverage->prev = id >> 1;
+}
+
+void profile_record(profile_t *profile, const uint16_t addr, const uint16_t opcode) {
+    const uint8_t c = opcode_class(opcode);
+
+    if (addr == profile->prev_addr[0] + 2) {
+        profile->pairs[profile->prev[0]][c]++;
+        if (profile->prev_addr[0] == profile->prev_addr[1] + 2) {
+            profile->triples[profile->prev[1]][profile->prev[0]][c]++;
+        }
+    }
+    profile->prev[1] = profile->prev[0];
+    profile->prev[0] = c;
+    profile->prev_addr[1] = profile->prev_addr[0];
+    profile->prev_addr[0] = addr;
+    profile->executed++;
+}
+
+typedef struct {
+    uint64_t count;
+    uint32_t index;
+} profile_entry_t;
+
+int compare_profile_entries(const void *a, const void *b) {
+    const uint64_t ca = ((const profile_entry_t *)a)->count;
+    const uint64_t cb = ((const profile_entry_t *)b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+// Print the most frequent pairs and triples, the candidates for new superinstructions
+void print_profile(const profile_t *profile) {
+    const uint32_t n2 = OPCODE_CLASSES * OPCODE_CLASSES;
+    const uint32_t n3 = n2 * OPCODE_CLASSES;
+    profile_entry_t *entries = malloc(n3 * sizeof(profile_entry_t));
+    if (!entries || profile->executed == 0) {
+        free(entries);
+        return;
+    }
+
+    printf("==== Opcode profile: %llu instructions ====\n", (unsigned long long)profile->executed);
+    for (uint32_t i = 0; i < n2; i++) {
+        entries[i] = (profile_entry_t){.count = (&profile->pairs[0][0])[i], .index = i};
+    }
+    qsort(entries, n2, sizeof(profile_entry_t), compare_profile_entries);
+    for (uint32_t i = 0; i < 10 && entries[i].count; i++) {
+        const uint32_t a = entries[i].index / OPCODE_CLASSES, b = entries[i].index % OPCODE_CLASSES;
+        printf("  %s %s       %12llu  %5.2f%%\n", opcode_classes[a].name, opcode_classes[b].name,
+               (unsigned long long)entries[i].count, 100.0 * entries[i].count / profile->executed);
+    }
+
+    for (uint32_t i = 0; i < n3; i++) {
+        entries[i] = (profile_entry_t){.count = (&profile->triples[0][0][0])[i], .index = i};
+    }
+    qsort(entries, n3, sizeof(profile_entry_t), compare_profile_entries);
+    for (uint32_t i = 0; i < 10 && entries[i].count; i++) {
+        const uint32_t a = entries[i].index / n2;
+        const uint32_t b = entries[i].index / OPCODE_CLASSES % OPCODE_CLASSES;
+        const uint32_t c = entries[i].index % OPCODE_CLASSES;
+        printf("  %s %s %s  %12llu  %5.2f%%\n", opcode_classes[a].name, opcode_classes[b].name,
+               opcode_classes[c].name, (unsigned long long)entries[i].count,
+               100.0 * entries[i].count / profile->executed);
+    }
+    free(entries);
+}
+
+// One line of a profile file: a count followed by 2 or 3 opcode class names. Returns how many
+// classes the line has, 0 for comments and anything else.
+uint32_t parse_profile_line(const char line[], uint64_t *count, uint8_t classes[3]) {
+    char names[3][8];
+    unsigned long long n;
+    const int fields = sscanf(line, "%llu %7s %7s %7s", &n, names[0], names[1], names[2]);
+    if (fields < 3) return 0;
+
+    for (int i = 0; i < fields - 1; i++) {
+        uint8_t c = 0;
+        while (c < OPCODE_CLASSES && strcmp(opcode_classes[c].name, names[i]) != 0) c++;
+        if (c == OPCODE_CLASSES) return 0;
+        classes[i] = c;
+    }
+    *count = n;
+    return (uint32_t)fields - 1;
+}
+
+// --profile-out: add the counts already in path to this run's, then write them all back most
+// frequent first. Profiling ROMs one run at a time into the same file builds up a corpus profile.
+bool save_profile(profile_t *profile, const char path[]) {
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[128];
+        while (fgets(line, sizeof(line), in)) {
+            uint64_t count;
+            uint8_t c[3];
+            const uint32_t length = parse_profile_line(line, &count, c);
+            if (length == 2) profile->pairs[c[0]][c[1]] += count;
+            if (length == 3) profile->triples[c[0]][c[1]][c[2]] += count;
+        }
+        fclose(in);
+    }
+
+    // Pairs are indexed below n2, triples from n2 on
+    const uint32_t n2 = OPCODE_CLASSES * OPCODE_CLASSES;
+    const uint32_t n3 = n2 * OPCODE_CLASSES;
+    profile_entry_t *entries = malloc((n2 + n3) * sizeof(profile_entry_t));
+    FILE *out = entries ? fopen(path, "w") : NULL;
+    if (!out) {
+        SDL_Log("Could not write profile %s: %s\n", path, strerror(errno));
+        free(entries);
+        return false;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n2 + n3; i++) {
+        const uint64_t n = i < n2 ? (&profile->pairs[0][0])[i] : (&profile->triples[0][0][0])[i - n2];
+        if (n) entries[count++] = (profile_entry_t){.count = n, .index = i};
+    }
+    qsort(entries, count, sizeof(profile_entry_t), compare_profile_entries);
+
+    fprintf(out, "# Opcode profile: times each sequence ran from adjacent addresses, then its opcode classes\n");
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t index = entries[i].index;
+        fprintf(out, "%llu", (unsigned long long)entries[i].count);
+        if (index >= n2) fprintf(out, " %s", opcode_classes[(index - n2) / n2].name);
+        fprintf(out, " %s %s\n", opcode_classes[index % n2 / OPCODE_CLASSES].name,
+                opcode_classes[index % OPCODE_CLASSES].name);
+    }
+    fclose(out);
+    free(entries);
+    printf("Added %llu instructions to the profile in %s\n", (unsigned long long)profile->executed, path);
+    return true;
+}
+
+// Fused when no --fusion-profile is given, in the profile file format
+const char *const default_fusion_profile[] = {
+    "1 6XNN 6XNN",
+    "1 ANNN DXYN",
+};
+
+// Keep a profile line's sequence in the set if it saves more dispatches (count * (length - 1))
+// than the ones already there. Sequences holding an opcode that only traps are never fused.
+void fusion_set_add(fusion_set_t *set, const char line[]) {
+    fusion_sequence_t sequence = {0};
+    sequence.length = (uint8_t)parse_profile_line(line, &sequence.count, sequence.classes);
+    if (!sequence.length) return;
+    for (uint32_t k = 0; k < sequence.length; k++) {
+        const uint16_t match = opcode_classes[sequence.classes[k]].match;
+        sequence.ops[k] = op_table[match >> 12][match & 0xFF];
+        if (sequence.ops[k] == OP_TRAP) return;
+    }
+
+    const uint64_t saved = sequence.count * (sequence.length - 1);
+    uint32_t i = set->count;
+    while (i > 0 && set->sequences[i - 1].count * (set->sequences[i - 1].length - 1) < saved) i--;
+    if (i == FUSION_SEQUENCES) return;
+    if (set->count < FUSION_SEQUENCES) set->count++;
+    memmove(&set->sequences[i + 1], &set->sequences[i], (set->count - 1 - i) * sizeof(fusion_sequence_t));
+    set->sequences[i] = sequence;
+}
+
+// Pick the sequences to fuse from a profile file, or the built-in ones without a path
+bool load_fusion_set(fusion_set_t *set, const char path[]) {
+    memset(set, 0, sizeof(*set));
+    if (!path) {
+        for (uint32_t i = 0; i < sizeof(default_fusion_profile) / sizeof(default_fusion_profile[0]); i++) {
+            fusion_set_add(set, default_fusion_profile[i]);
+        }
+        return true;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        SDL_Log("Could not open profile %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), in)) fusion_set_add(set, line);
+    fclose(in);
+
+    printf("Fusing %u sequences from %s:", set->count, path);
+    for (uint32_t i = 0; i < set->count; i++) {
+        const fusion_sequence_t *sequence = &set->sequences[i];
+        if (i) printf(",");
+        for (uint32_t k = 0; k < sequence->length; k++) printf(" %s", opcode_classes[sequence->classes[k]].name);
+    }
+    printf("\n");
+    return true;
+}
+
+// Per-instruction hooks: opcode profile, fuzzing coverage and the diff trace
+void record_instr(const chip8_t *chip8, const config_t config, const uint16_t addr) {
+    if (config.profile) profile_record(config.profile, addr, chip8->inst.opcode);
+    if (config.coverage) coverage_record(config.coverage, addr);
+    if (config.trace) {
+        config.trace->entries[config.trace->count++ % TRACE_LENGTH] = (trace_entry_t){
+            .frame = config.trace->frame, .addr = addr, .opcode = chip8->inst.opcode,
+        };
+    }
+}
+
+// Machine cycles the VIP interpreter takes for the instruction just run from pc, fetch and
+// decode included. Approximate, from published timings of the VIP interpreter. Taken skips cost
+// a little more, sprites scale with their height and with how far each row has to be shifted.
+uint32_t vip_cycles(const chip8_t *chip8, const uint16_t pc) {
+    const instruction_t *inst = &chip8->inst;
+    const uint32_t skip = (chip8->PC == pc + 4) ? 9 : 0;
+
+    switch (inst->opcode >> 12) {
+        case 0x0: return inst->opcode == 0x00E0 ? 109 : 105;
+        case 0x1: case 0x2: case 0xB: return 105;
+        case 0x3: case 0x4: return 55 + skip;
+        case 0x5: case 0x9: case 0xE: return 73 + skip;
+        case 0x6: return 27;
+        case 0x7: return 45;
+        case 0x8: return 200;
+        case 0xA: return 55;
+        case 0xC: return 164;
+        case 0xD: {
+            const uint32_t rows = inst->n ? inst->n : 32;   // 16x16 sprites are two bytes a row
+            return 26 + rows * (46 + 8 * (chip8->V[inst->x] & 7));
+        }
+        default:
+            switch (inst->nn) {
+                case 0x1E: return 86;
+                case 0x29: return 91;
+                case 0x33: return 927;
+                case 0x55: case 0x65: return 14 + 37 * (inst->x + 1);
+                default: return 45;     // FX07, FX0A (per poll), FX15, FX18
+            }
+    }
+}
+
+// One frame under --vip-timing. The frame's machine cycles, less the interrupt, are spent
+// instruction by instruction, and one that runs past the frame end is paid for by the next
+// frame. DXYN waits for the next interrupt like the VIP does, then draws on the next frame's cycles.
+void emulate_frame_vip(chip8_t *chip8, const config_t config) {
+    const uint64_t start = chip8->cycles;
+    const uint32_t budget = (uint32_t)(chip8->tick_slots - start % chip8->tick_slots);
+    const uint64_t end = start + budget;
+    uint32_t executed = 0;
+
+    chip8->cycles += VIP_INTERRUPT_CYCLES;
+    while (chip8->cycles < end) {
+        if (config.input) input_apply(chip8, config.input, (uint32_t)(chip8->cycles - start), budget);
+
+        const uint16_t addr = chip8->PC;
+        fetch_instr(chip8);
+        op_handlers[op_table[chip8->inst.opcode >> 12][chip8->inst.nn]](chip8, &config);
+        record_instr(chip8, config, addr);
+        executed++;
+
+        if ((chip8->inst.opcode >> 12) == 0xD) {
+            chip8->cycles = end + vip_cycles(chip8, addr);
+            break;
+        }
+        chip8->cycles += vip_cycles(chip8, addr);
+    }
+
+    if (config.input) {
+        input_apply(chip8, config.input, UINT32_MAX, budget);
+        config.input->count = config.input->applied = 0;
+    }
+    if (config.metrics) atomic_fetch_add_explicit(&config.metrics->instructions, executed, memory_order_relaxed);
+    if (config.hud) config.hud->instructions += executed;
+}
+
+// Emulate CHIP8 Instructions for one emulator "frame" (60hz)
+void emulate_frame(chip8_t *chip8, const config_t config) {
+    if (config.vip_timing) {
+        emulate_frame_vip(chip8, config);
+        return;
+    }
+
+    // Frames end on the next tick boundary, which is where the timers count down
+    const uint64_t start = chip8->cycles;
+    const uint32_t budget = (uint32_t)(chip8->tick_slots - start % chip8->tick_slots);
+    uint32_t i;
+
+    for (i = 0; i < budget;) {
+        // Queued key changes split the frame at the instructions they are due before
+        const uint32_t limit = config.input ? input_apply(chip8, config.input, i, budget) : budget;
+        const uint32_t fused = config.fusion ? run_fused(chip8, config, limit - i) : 0;
+
+        if (fused) {
+            i += fused;
+        } else if (config.profile || config.trace || config.coverage) {
+            const uint16_t addr = chip8->PC;
+            emu_instr(chip8, config);
+            record_instr(chip8, config, addr);
+            i++;
+        } else {
+            i += run_block(chip8, config, limit - i);
+        }
+
+        // If drawing on CHIP8, only draw 1 sprite this frame (display wait)
+        // This matches original CHIP8's behavior where sprite drawing takes time
+        if ((config.current_extension == CHIP8) && 
+            ((chip8->inst.opcode >> 12) == 0xD)) {
+            break;
+        }
+    }
+
+    if (config.input) {
+        input_apply(chip8, config.input, UINT32_MAX, budget);
+        config.input->count = config.input->applied = 0;
+    }
+    chip8->cycles = start + budget;     // Slots left by a display wait still pass
+    if (config.metrics) atomic_fetch_add_explicit(&config.metrics->instructions, i, memory_order_relaxed);
+    if (config.hud) config.hud->instructions += i;
+}
+
+// Run one frame of grid instance i and copy its faded pixels into its atlas tile
+void grid_step_instance(grid_t *grid, const uint32_t i) {
+    chip8_t *chip8 = &grid->chip8s[i];
+    const config_t config = *grid->config;
+
+    if (chip8->state == RUNNING) {
+        emulate_frame(chip8, config);
+        grid->beeping[i] = frame_beeped(chip8);
+    } else {
+        grid->beeping[i] = false;
+    }
+
+    // The locked atlas keeps its old contents, so only rows that changed are rewritten
+    uint32_t *tile = grid->pixels + 
+                     (i / grid->cols) * config.window_height * grid->pitch + 
+                     (i % grid->cols) * config.window_width;
+    const uint64_t rows = fade_dirty_rows(chip8, config);
+    for (uint32_t y = 0; y < config.window_height; y++) {
+        if (!((rows >> y) & 1)) continue;
+        memcpy(&tile[y * grid->pitch], &chip8->pixel_color[y * config.window_width], 
+               config.window_width * sizeof(uint32_t));
+    }
+}
 
-                    case SDLK_EQUALS:
-                        //press '=' to reset the emulator
-                        init_chip8(chip8, *config, chip8->rom_name);
-                        break;
-                    
-                    case SDLK_j:
-                        //press 'j' tp decrease lerping rate
-                        if (config->color_lerp_rate > 0.1) {
-                            config->color_lerp_rate -= 0.1;
-                        }
-                        break;
-                    
-                    case SDLK_k:
-                        //press 'k' to increase lerping rate
-                        if (config->color_lerp_rate < 1.0) {
-                            config->color_lerp_rate += 0.1;
-                        }
-                        break;
+// Hand out instances to the calling thread until every instance has run this frame
+void grid_run_instances(grid_t *grid) {
+    uint32_t i;
+    while ((i = (uint32_t)SDL_AtomicAdd(&grid->next, 1)) < grid->count) {
+        grid_step_instance(grid, i);
+    }
+}
 
-                    case SDLK_o:
-                        //press 'o' to reduce the volume
-                        if (config->volume > 0) {
-                            config->volume -= 250;
-                        }
-                        break;
-                    
-                    case SDLK_p:
-                        //press 'p' to increase the volume
-                        if (config->volume < INT16_MAX) {
-                            config->volume += 250;
-                        }
-                        break;
-                    
-                    case SDLK_t: // 't' to toggle between sine and square wave
-                        config->use_sine_wave = !config->use_sine_wave;
-                        printf("Sound wave type: %s\n", config->use_sine_wave ? "Sine" : "Square");
-                        break;
-                        
-                    case SDLK_y: // 'y' to toggle pixel outlines
-                        config->pixel_outlines = !config->pixel_outlines;
-                        printf("Pixel outlines: %s\n", config->pixel_outlines ? "Enabled" : "Disabled");
-                        break;
+// Grid worker thread, sleeps until the main loop starts a new frame
+int grid_worker(void *data) {
+    grid_t *grid = (grid_t *)data;
+    uint32_t seen = 0;
 
-                    case SDLK_1: chip8->keypad[0x1] = true; break;
-                    case SDLK_2: chip8->keypad[0x2] = true; break;
-                    case SDLK_3: chip8->keypad[0x3] = true; break;
-                    case SDLK_4: chip8->keypad[0xC] = true; break;
-                    
-                    case SDLK_q: chip8->keypad[0x4] = true; break;
-                    case SDLK_w: chip8->keypad[0x5] = true; break;
-                    case SDLK_e: chip8->keypad[0x6] = true; break;
-                    case SDLK_r: chip8->keypad[0xD] = true; break;
-                    
-                    case SDLK_a: chip8->keypad[0x7] = true; break;
-                    case SDLK_s: chip8->keypad[0x8] = true; break;
-                    case SDLK_d: chip8->keypad[0x9] = true; break;
-                    case SDLK_f: chip8->keypad[0xE] = true; break;
-                    
-                    case SDLK_z: chip8->keypad[0xA] = true; break;
-                    case SDLK_x: chip8->keypad[0x0] = true; break;
-                    case SDLK_c: chip8->keypad[0xB] = true; break;
-                    case SDLK_v: chip8->keypad[0xF] = true; break;
-
-                       // Arrow key mappings
-                    case SDLK_UP:    chip8->keypad[0x5] = true; break; // Map UP to 0x5
-                    case SDLK_DOWN:  chip8->keypad[0x8] = true; break; // Map DOWN to 0x8
-                    case SDLK_LEFT:  chip8->keypad[0x4] = true; break; // Map LEFT to 0x4
-                    case SDLK_RIGHT: chip8->keypad[0x6] = true; break; // Map RIGHT to 0x6
-                    
-                    default:
-                        break;
-                }
-                break;
+    SDL_LockMutex(grid->lock);
+    while (true) {
+        while (grid->generation == seen && !grid->quit) {
+            SDL_CondWait(grid->start, grid->lock);
+        }
+        if (grid->quit) break;
+        seen = grid->generation;
+        SDL_UnlockMutex(grid->lock);
 
-            case SDL_KEYUP:
-                switch (event.key.keysym.sym) {
-                    case SDLK_1: chip8->keypad[0x1] = false; break;
-                    case SDLK_2: chip8->keypad[0x2] = false; break;
-                    case SDLK_3: chip8->keypad[0x3] = false; break;
-                    case SDLK_4: chip8->keypad[0xC] = false; break;
-    
-                    case SDLK_q: chip8->keypad[0x4] = false; break;
-                    case SDLK_w: chip8->keypad[0x5] = false; break;
-                    case SDLK_e: chip8->keypad[0x6] = false; break;
-                    case SDLK_r: chip8->keypad[0xD] = false; break;
-    
-                    case SDLK_a: chip8->keypad[0x7] = false; break;
-                    case SDLK_s: chip8->keypad[0x8] = false; break;
-                    case SDLK_d: chip8->keypad[0x9] = false; break;
-                    case SDLK_f: chip8->keypad[0xE] = false; break;
-    
-                    case SDLK_z: chip8->keypad[0xA] = false; break;
-                    case SDLK_x: chip8->keypad[0x0] = false; break;
-                    case SDLK_c: chip8->keypad[0xB] = false; break;
-                    case SDLK_v: chip8->keypad[0xF] = false; break;
-
-                      // Arrow key mappings
-                    case SDLK_UP:    chip8->keypad[0x5] = false; break; // Map UP to 0x5
-                    case SDLK_DOWN:  chip8->keypad[0x8] = false; break; // Map DOWN to 0x8
-                    case SDLK_LEFT:  chip8->keypad[0x4] = false; break; // Map LEFT to 0x4
-                    case SDLK_RIGHT: chip8->keypad[0x6] = false; break; // Map RIGHT to 0x6
-                    
-                    default:
-                        break;
-                }
-                break;
+        grid_run_instances(grid);
 
-            default:
-                break;
+        SDL_LockMutex(grid->lock);
+        if (--grid->busy == 0) {
+            SDL_CondSignal(grid->done);
         }
     }
+    SDL_UnlockMutex(grid->lock);
+    return 0;
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8){
+// Set up grid instances, the atlas texture and the worker pool
+bool init_grid(grid_t *grid, const sdl_t sdl, const config_t *config, const char rom_name[]) {
+    *grid = (grid_t){
+        .count = config->grid_count,
+        .config = config,
+    };
 
-    printf("Address: 0x%04X and Opcode: 0x%04X Desc: ", chip8->PC-2, chip8->inst.opcode);
-    switch ((chip8->inst.opcode >> 12) & 0X0F ) {
-        case 0X00: 
-            if(chip8->inst.nn == 0XE0){
-                //0X00E0 --> clear screen
-                printf("clear screen\n");
+    // Lay the tiles out as close to square as possible
+    grid->cols = 1;
+    while (grid->cols * grid->cols < grid->count) grid->cols++;
+    grid->rows = (grid->count + grid->cols - 1) / grid->cols;
+    grid->tile_scale = config->scale_factor * 2 / grid->cols;
+    if (grid->tile_scale == 0) grid->tile_scale = 1;
+
+    grid->chip8s = calloc(grid->count, sizeof(chip8_t));
+    grid->beeping = calloc(grid->count, sizeof(bool));
+    grid->pixel_colors = calloc(grid->count, 64*32 * sizeof(uint32_t));
+    if (!grid->chip8s || !grid->beeping || !grid->pixel_colors) {
+        SDL_Log("Could not allocate %u grid instances\n", grid->count);
+        return false;
+    }
+
+    // Every instance shares one copy of the font and ROM until it writes to a page
+    rom_image_t *image = load_rom(*config, rom_name);
+    if (!image) return false;
+    for (uint32_t i = 0; i < grid->count; i++) {
+        grid->chip8s[i].pixel_color = &grid->pixel_colors[i * 64*32];
+        reset_chip8(&grid->chip8s[i], *config, image);
+    }
+
+    SDL_SetWindowSize(sdl.window, 
+                      grid->cols * config->window_width * grid->tile_scale,
+                      grid->rows * config->window_height * grid->tile_scale);
+
+    grid->atlas = SDL_CreateTexture(sdl.renderer, 
+                                    SDL_PIXELFORMAT_RGBA8888, 
+                                    SDL_TEXTUREACCESS_STREAMING,
+                                    grid->cols * config->window_width,
+                                    grid->rows * config->window_height);
+    if (!grid->atlas) {
+        SDL_Log("Could not create grid atlas texture: %s\n", SDL_GetError());
+        return false;
+    }
+
+    grid->thread_count = config->grid_threads ? config->grid_threads : (uint32_t)SDL_GetCPUCount();
+    if (grid->thread_count > 0) grid->thread_count--;    // The main loop works a share too
+    grid->lock = SDL_CreateMutex();
+    grid->start = SDL_CreateCond();
+    grid->done = SDL_CreateCond();
+    grid->threads = calloc(grid->thread_count + 1, sizeof(SDL_Thread *));
+    if (!grid->lock || !grid->start || !grid->done || !grid->threads) {
+        SDL_Log("Could not create grid worker pool: %s\n", SDL_GetError());
+        return false;
+    }
+    for (uint32_t i = 0; i < grid->thread_count; i++) {
+        grid->threads[i] = SDL_CreateThread(grid_worker, "chip8 grid worker", grid);
+        if (!grid->threads[i]) {
+            SDL_Log("Could not create grid worker thread: %s\n", SDL_GetError());
+            grid->thread_count = i;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Stop the worker pool and free grid resources
+void grid_cleanup(grid_t *grid) {
+    if (grid->lock) {
+        SDL_LockMutex(grid->lock);
+        grid->quit = true;
+        SDL_CondBroadcast(grid->start);
+        SDL_UnlockMutex(grid->lock);
+    }
+    for (uint32_t i = 0; i < grid->thread_count; i++) {
+        SDL_WaitThread(grid->threads[i], NULL);
+    }
+    if (grid->atlas) SDL_DestroyTexture(grid->atlas);
+    if (grid->done) SDL_DestroyCond(grid->done);
+    if (grid->start) SDL_DestroyCond(grid->start);
+    if (grid->lock) SDL_DestroyMutex(grid->lock);
+    free(grid->threads);
+    free(grid->beeping);
+    for (uint32_t i = 0; grid->chip8s && i < grid->count; i++) {
+        free_chip8(&grid->chip8s[i]);
+    }
+    free(grid->chip8s);
+    free(grid->pixel_colors);
+}
+
+// Emulate and render every grid instance for one frame: one atlas upload and one present
+void grid_frame(grid_t *grid, const sdl_t sdl) {
+    void *pixels;
+    int pitch;
+
+    if (SDL_LockTexture(grid->atlas, NULL, &pixels, &pitch) != 0) {
+        SDL_Log("Could not lock grid atlas: %s\n", SDL_GetError());
+        return;
+    }
+    grid->pixels = (uint32_t *)pixels;
+    grid->pitch = pitch / sizeof(uint32_t);
+
+    // Wake the workers and take a share of the instances on this thread
+    SDL_LockMutex(grid->lock);
+    SDL_AtomicSet(&grid->next, 0);
+    grid->busy = grid->thread_count;
+    grid->generation++;
+    SDL_CondBroadcast(grid->start);
+    SDL_UnlockMutex(grid->lock);
+
+    grid_run_instances(grid);
+
+    SDL_LockMutex(grid->lock);
+    while (grid->busy > 0) {
+        SDL_CondWait(grid->done, grid->lock);
+    }
+    SDL_UnlockMutex(grid->lock);
+
+    SDL_UnlockTexture(grid->atlas);
+    SDL_RenderCopy(sdl.renderer, grid->atlas, NULL, NULL);
+
+    // Outline the instance that has keyboard focus
+    const SDL_Rect focus_rect = {
+        .x = (grid->focus % grid->cols) * grid->config->window_width * grid->tile_scale,
+        .y = (grid->focus / grid->cols) * grid->config->window_height * grid->tile_scale,
+        .w = grid->config->window_width * grid->tile_scale,
+        .h = grid->config->window_height * grid->tile_scale,
+    };
+    SDL_SetRenderDrawColor(sdl.renderer, 0xFF, 0x00, 0x00, 0xFF);
+    SDL_RenderDrawRect(sdl.renderer, &focus_rect);
+    SDL_RenderPresent(sdl.renderer);
+}
+
+// Route SDL events to the focused grid instance, clicking a tile moves focus
+void handle_grid_input(grid_t *grid, config_t *config) {
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT) {
+            const uint32_t col = event.button.x / (config->window_width * grid->tile_scale);
+            const uint32_t row = event.button.y / (config->window_height * grid->tile_scale);
+            const uint32_t i = row * grid->cols + col;
+
+            if (col < grid->cols && i < grid->count && i != grid->focus) {
+                // Release any keys still held on the instance losing focus
+                grid->chip8s[grid->focus].keypad = 0;
+                grid->focus = i;
+                grid->focus_changed = true;
             }
-            else if(chip8->inst.nn == 0XEE){
-                //0X00EE --> returns from a sub routine
-                //Grabs the last address from the stack 
-                printf("return from a subroutine to address 0x%04X\n", *(chip8->stack_ptr - 1));
-                //chip8->PC = *--chip8->stack_ptr;
+            continue;
+        }
+        handle_event(&grid->chip8s[grid->focus], config, event);
+    }
+}
+
+// Grid mode main loop
+void run_grid(const sdl_t sdl, config_t *config, const char rom_name[]) {
+    grid_t grid = {0};
+
+    uint64_t last_frame = 0;
+    frame_timer_t timer;
+    init_frame_timer(&timer);
+
+    // Start paused so the device is only touched when the focused instance starts or stops beeping
+    bool audio_paused = true;
+    pause_audio(sdl, audio_paused);
+
+    if (init_grid(&grid, sdl, config, rom_name)) {
+        while (grid.chip8s[grid.focus].state != QUIT) {
+            handle_grid_input(&grid, config);
+
+            grid_frame(&grid, sdl);
+
+            // Sound follows the focused instance, each pause or resume takes the SDL audio lock
+            if (audio_paused == grid.beeping[grid.focus]) {
+                audio_paused = !audio_paused;
+                pause_audio(sdl, audio_paused);
             }
-            else{
-                printf("Unimplemented code\n");
+            grid.chip8s[grid.focus].audio_dirty |= grid.focus_changed;
+            grid.focus_changed = false;
+            sync_audio(sdl, &grid.chip8s[grid.focus]);
+
+            wait_frame(&timer);
+
+            if (config->metrics) {
+                const uint64_t now = SDL_GetPerformanceCounter();
+                if (last_frame) metrics_record_frame(config->metrics, now - last_frame);
+                last_frame = now;
             }
-        break;
+        }
+    }
+    grid_cleanup(&grid);
+}
+
+// Write the metrics in Prometheus text format. The file is replaced with rename so scrapers
+// never read a half-written dump.
+void metrics_dump(metrics_t *metrics, const double ips) {
+    const size_t len = strlen(metrics->path) + 5;
+    char *tmp_path = malloc(len);
+    if (!tmp_path) return;
+    snprintf(tmp_path, len, "%s.tmp", metrics->path);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        SDL_Log("Could not write metrics to %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return;
+    }
+
+    fprintf(out, "# HELP chip8_instructions_total Instructions executed, all instances together.\n"
+                 "# TYPE chip8_instructions_total counter\n"
+                 "chip8_instructions_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&metrics->instructions, memory_order_relaxed));
+    fprintf(out, "# HELP chip8_instructions_per_second Instructions executed per second over the last dump interval.\n"
+                 "# TYPE chip8_instructions_per_second gauge\n"
+                 "chip8_instructions_per_second %.1f\n", ips);
+    fprintf(out, "# HELP chip8_target_instructions_per_second Configured instruction rate of one instance.\n"
+                 "# TYPE chip8_target_instructions_per_second gauge\n"
+                 "chip8_target_instructions_per_second %u\n", metrics->target_ips);
+    // Cumulative buckets, always the same le labels so rate() and histogram_quantile() work
+    // across dumps. Shorter frames count towards the first one, longer ones only towards +Inf.
+    fprintf(out, "# HELP chip8_frame_time_seconds Wall time of one main loop frame, SDL_Delay included.\n"
+                 "# TYPE chip8_frame_time_seconds histogram\n");
+    uint64_t total = 0;
+    for (uint32_t b = 0; b < METRICS_BUCKETS; b++) {
+        total += atomic_load_explicit(&metrics->frame_time[b], memory_order_relaxed);
+        if (b < METRICS_EXPORT_FIRST || b >= METRICS_EXPORT_LAST) continue;
+        fprintf(out, "chip8_frame_time_seconds_bucket{le=\"%.9f\"} %llu\n",
+                metrics_bucket_floor(b + 1) / 1e9, (unsigned long long)total);
+    }
+    fprintf(out, "chip8_frame_time_seconds_bucket{le=\"+Inf\"} %llu\n"
+                 "chip8_frame_time_seconds_sum %.9f\n"
+                 "chip8_frame_time_seconds_count %llu\n",
+            (unsigned long long)total,
+            atomic_load_explicit(&metrics->frame_time_ns, memory_order_relaxed) / 1e9,
+            (unsigned long long)total);
+
+    fprintf(out, "# HELP chip8_audio_callbacks_total Audio callback invocations.\n"
+                 "# TYPE chip8_audio_callbacks_total counter\n"
+                 "chip8_audio_callbacks_total %llu\n"
+                 "# HELP chip8_audio_samples_total Audio samples produced.\n"
+                 "# TYPE chip8_audio_samples_total counter\n"
+                 "chip8_audio_samples_total %llu\n"
+                 "# HELP chip8_audio_underruns_total Callbacks that arrived after the device ran out of samples.\n"
+                 "# TYPE chip8_audio_underruns_total counter\n"
+                 "chip8_audio_underruns_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&metrics->audio_callbacks, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&metrics->audio_samples, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&metrics->audio_underruns, memory_order_relaxed));
+
+    if (fclose(out) != 0 || rename(tmp_path, metrics->path) != 0) {
+        SDL_Log("Could not write metrics to %s: %s\n", metrics->path, strerror(errno));
+    }
+    free(tmp_path);
+}
+
+// Background exporter, keeps file I/O off the emulation thread
+int metrics_thread(void *data) {
+    metrics_t *metrics = data;
+    uint64_t last_instructions = 0;
+    uint64_t last_time = SDL_GetPerformanceCounter();
+
+    while (!atomic_load(&metrics->quit)) {
+        // Sleep in short steps so that shutdown is not held up by a long interval
+        for (uint32_t slept = 0; slept < metrics->interval && !atomic_load(&metrics->quit); slept += 50) {
+            SDL_Delay(metrics->interval - slept < 50 ? metrics->interval - slept : 50);
+        }
+
+        const uint64_t now = SDL_GetPerformanceCounter();
+        const uint64_t instructions = atomic_load_explicit(&metrics->instructions, memory_order_relaxed);
+        const double seconds = (now - last_time) * metrics->ns_per_tick / 1e9;
+
+        metrics_dump(metrics, seconds > 0 ? (instructions - last_instructions) / seconds : 0);
+        last_instructions = instructions;
+        last_time = now;
+    }
+    return 0;
+}
+
+bool init_metrics(metrics_t *metrics, const config_t config) {
+    metrics->ns_per_tick = 1e9 / SDL_GetPerformanceFrequency();
+    metrics->target_ips = config.instr_per_sec;
+    metrics->path = config.metrics_path;
+    metrics->interval = config.metrics_interval;
+    metrics->thread = SDL_CreateThread(metrics_thread, "chip8 metrics", metrics);
+    if (!metrics->thread) {
+        SDL_Log("Could not create metrics thread: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Stop the exporter, it writes one last dump on the way out
+void metrics_cleanup(metrics_t *metrics) {
+    if (!metrics->thread) return;
+    atomic_store(&metrics->quit, true);
+    SDL_WaitThread(metrics->thread, NULL);
+    metrics->thread = NULL;
+}
+
+// 16-bit mono PCM, the sizes are patched in when the recording stops
+void write_wav_header(FILE *out, const uint32_t sample_rate, const uint32_t data_bytes) {
+    fwrite("RIFF", 1, 4, out);
+    write_le(out, 36 + data_bytes, 4);
+    fwrite("WAVEfmt ", 1, 8, out);
+    write_le(out, 16, 4);                   // fmt chunk size
+    write_le(out, 1, 2);                    // PCM
+    write_le(out, 1, 2);                    // Mono
+    write_le(out, sample_rate, 4);
+    write_le(out, sample_rate * 2, 4);      // Bytes per second
+    write_le(out, 2, 2);                    // Bytes per sample frame
+    write_le(out, 16, 2);                   // Bits per sample
+    fwrite("data", 1, 4, out);
+    write_le(out, data_bytes, 4);
+}
+
+// .c8v video: 16 byte header (magic, width, height, frame rate, reserved, frame count), then per
+// frame a 2 byte length and the PackBits encoded XOR of the frame with the one before it. A
+// frame is 1 bit per pixel, row after row, MSB first.
+void write_c8v_header(FILE *out, const uint32_t frames) {
+    fwrite(C8V_MAGIC, 1, 4, out);
+    write_le(out, 64, 2);
+    write_le(out, 32, 2);
+    write_le(out, 60, 2);
+    write_le(out, 0, 2);
+    write_le(out, frames, 4);
+}
+
+// PackBits: a control byte c < 128 is followed by c + 1 literal bytes, c > 128 repeats the next
+// byte 257 - c times. Deltas are mostly zero bytes, an unchanged frame packs into 4 bytes.
+// out needs room for len + len / 128 + 1 bytes.
+uint32_t packbits(const uint8_t *in, const uint32_t len, uint8_t *out) {
+    uint32_t i = 0, o = 0;
+    while (i < len) {
+        uint32_t run = 1;
+        while (i + run < len && run < 128 && in[i + run] == in[i]) run++;
+        if (run >= 2) {
+            out[o++] = 257 - run;
+            out[o++] = in[i];
+            i += run;
+            continue;
+        }
+
+        // Literals up to the next run of three, a pair inside literals costs nothing extra
+        uint32_t literal = 1;
+        while (i + literal < len && literal < 128 &&
+               !(i + literal + 2 < len && in[i + literal] == in[i + literal + 1] &&
+                 in[i + literal] == in[i + literal + 2])) literal++;
+        out[o++] = literal - 1;
+        memcpy(&out[o], &in[i], literal);
+        o += literal;
+        i += literal;
+    }
+    return o;
+}
+
+// Returns false unless in unpacks to exactly len bytes
+bool unpackbits(const uint8_t *in, const uint32_t in_len, uint8_t *out, const uint32_t len) {
+    uint32_t i = 0, o = 0;
+    while (i < in_len) {
+        const uint8_t c = in[i++];
+        if (c < 128) {
+            if (i + c + 1 > in_len || o + c + 1 > len) return false;
+            memcpy(&out[o], &in[i], c + 1);
+            i += c + 1;
+            o += c + 1;
+        } else if (c > 128) {
+            if (i >= in_len || o + 257 - c > len) return false;
+            memset(&out[o], in[i++], 257 - c);
+            o += 257 - c;
+        }
+    }
+    return o == len;
+}
+
+// Display rows as the 256 frame bytes of the .c8v format
+void display_bytes(const uint64_t display[32], uint8_t bytes[256]) {
+    for (uint32_t row = 0; row < 32; row++) {
+        for (uint32_t b = 0; b < 8; b++) {
+            bytes[row * 8 + b] = (display[row] >> (56 - 8 * b)) & 0xFF;
+        }
+    }
+}
+
+// Write out every queued frame together with exactly its share of audio, rate / 60 samples, so
+// the WAV is always as long as the video. Samples the callback has not produced yet are waited
+// for, unless the device was paused at the end of the frame, the video queue is filling up or the
+// recording is stopping, then the rest of the share is silence. Audio queued further ahead of the
+// video than the slack is dropped, so the two can't drift apart.
+void recorder_drain(recorder_t *recorder, const bool flush) {
+    uint32_t tail = atomic_load_explicit(&recorder->frame_tail, memory_order_relaxed);
+    const uint32_t head = atomic_load_explicit(&recorder->frame_head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        const record_frame_t *frame = &recorder->frames[tail % RECORD_FRAMES];
+        const uint64_t rate = recorder->sample_rate;
+        const uint32_t share = (uint32_t)((recorder->video_frames + 1) * rate / 60 - recorder->video_frames * rate / 60);
+
+        uint32_t sample_tail = atomic_load_explicit(&recorder->sample_tail, memory_order_relaxed);
+        const uint32_t sample_head = atomic_load_explicit(&recorder->sample_head, memory_order_acquire);
+        uint32_t available = sample_head - sample_tail;
+        if (available < share && frame->sound && !flush && head - tail < RECORD_FRAMES / 2) break;
+        if (available > share + recorder->slack) {
+            const uint32_t excess = available - share - recorder->slack;
+            sample_tail += excess;
+            available -= excess;
+            metrics_add(&recorder->dropped_samples, excess);
+        }
+
+        uint64_t delta[32];
+        for (uint32_t row = 0; row < 32; row++) delta[row] = frame->display[row] ^ recorder->last[row];
+        memcpy(recorder->last, frame->display, sizeof(recorder->last));
+        atomic_store_explicit(&recorder->frame_tail, tail + 1, memory_order_release);
+
+        uint8_t bytes[256], packed[256 + 256 / 128 + 1];
+        display_bytes(delta, bytes);
+        const uint32_t size = packbits(bytes, sizeof(bytes), packed);
+        write_le(recorder->video, size, 2);
+        fwrite(packed, 1, size, recorder->video);
+        recorder->video_frames++;
+
+        uint32_t left = available < share ? available : share;
+        while (left > 0) {
+            const uint32_t start = sample_tail % RECORD_SAMPLES;
+            const uint32_t n = left < RECORD_SAMPLES - start ? left : RECORD_SAMPLES - start;
+            fwrite(&recorder->samples[start], sizeof(int16_t), n, recorder->audio);
+            sample_tail += n;
+            left -= n;
+        }
+        atomic_store_explicit(&recorder->sample_tail, sample_tail, memory_order_release);
+
+        static const int16_t silence[4096];
+        for (left = share - (available < share ? available : share); left > 0; ) {
+            const uint32_t chunk = left < 4096 ? left : 4096;
+            fwrite(silence, sizeof(int16_t), chunk, recorder->audio);
+            left -= chunk;
+        }
+        recorder->audio_bytes += share * sizeof(int16_t);
+    }
+}
+
+// Background writer, keeps encoding and file I/O off the emulation and audio threads
+int recorder_thread(void *data) {
+    recorder_t *recorder = data;
+    while (!atomic_load(&recorder->quit)) {
+        recorder_drain(recorder, false);
+        SDL_Delay(10);
+    }
+    recorder_drain(recorder, true);
+    return 0;
+}
+
+bool init_recorder(recorder_t *recorder, const config_t config, const uint32_t sample_rate, const uint32_t buffer) {
+    const size_t len = strlen(config.record_path) + 5;
+    char *path = malloc(len);
+    if (!path) return false;
+
+    snprintf(path, len, "%s.c8v", config.record_path);
+    recorder->video = fopen(path, "wb");
+    if (!recorder->video) SDL_Log("Could not create %s: %s\n", path, strerror(errno));
+    snprintf(path, len, "%s.wav", config.record_path);
+    recorder->audio = recorder->video ? fopen(path, "wb") : NULL;
+    if (recorder->video && !recorder->audio) SDL_Log("Could not create %s: %s\n", path, strerror(errno));
+    free(path);
+    if (!recorder->audio) {
+        if (recorder->video) fclose(recorder->video);
+        recorder->video = NULL;
+        return false;
+    }
+
+    recorder->sample_rate = sample_rate;
+    recorder->slack = 2 * buffer;   // The callback delivers a whole device buffer at a time
+    write_c8v_header(recorder->video, 0);
+    write_wav_header(recorder->audio, sample_rate, 0);
+
+    recorder->thread = SDL_CreateThread(recorder_thread, "chip8 recorder", recorder);
+    if (!recorder->thread) {
+        SDL_Log("Could not create recorder thread: %s\n", SDL_GetError());
+        fclose(recorder->video);
+        fclose(recorder->audio);
+        recorder->video = recorder->audio = NULL;
+        return false;
+    }
+    printf("Recording to %s.c8v and %s.wav\n", config.record_path, config.record_path);
+    return true;
+}
+
+// Detach from the audio callback, flush the queues and patch the final sizes into both headers
+void recorder_cleanup(const sdl_t sdl, recorder_t *recorder) {
+    if (!recorder || !recorder->thread) return;
+
+    SDL_LockAudioDevice(sdl.dev);
+    sdl.audio->recorder = NULL;
+    SDL_UnlockAudioDevice(sdl.dev);
+
+    atomic_store(&recorder->quit, true);
+    SDL_WaitThread(recorder->thread, NULL);
+    recorder->thread = NULL;
+
+    const long video_bytes = ftell(recorder->video);
+    fseek(recorder->video, 0, SEEK_SET);
+    write_c8v_header(recorder->video, recorder->video_frames);
+    fseek(recorder->audio, 0, SEEK_SET);
+    write_wav_header(recorder->audio, recorder->sample_rate, (uint32_t)recorder->audio_bytes);
+    fclose(recorder->video);
+    fclose(recorder->audio);
+
+    printf("Recorded %u frames: %ld bytes of video, %llu bytes of audio\n", recorder->video_frames,
+           video_bytes, (unsigned long long)recorder->audio_bytes);
+    const uint64_t dropped_frames = atomic_load(&recorder->dropped_frames);
+    const uint64_t dropped_samples = atomic_load(&recorder->dropped_samples);
+    if (dropped_frames || dropped_samples) {
+        SDL_Log("Recorder fell behind: dropped %llu frames and %llu samples\n",
+                (unsigned long long)dropped_frames, (unsigned long long)dropped_samples);
+    }
+}
+
+// Offline converter from .c8v to Y4M, upscaled by the scale factor in the foreground and
+// background colors. Y4M is uncompressed, e.g. ffmpeg -i rec.y4m -i rec.wav rec.mp4 encodes it.
+bool convert_av(const config_t config, const char in_path[]) {
+    FILE *in = fopen(in_path, "rb");
+    if (!in) {
+        SDL_Log("Could not open %s: %s\n", in_path, strerror(errno));
+        return false;
+    }
+
+    uint8_t header[16];
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, C8V_MAGIC, 4) != 0 ||
+        read_le(&header[4], 2) != 64 || read_le(&header[6], 2) != 32) {
+        SDL_Log("%s is not a 64x32 .c8v recording\n", in_path);
+        fclose(in);
+        return false;
+    }
+
+    const uint32_t scale = config.scale_factor;
+    const uint32_t width = 64 * scale, height = 32 * scale;
+    uint8_t *planes = malloc((size_t)width * height * 3);
+    FILE *out = planes ? fopen(config.convert_path, "wb") : NULL;
+    if (!out) {
+        SDL_Log("Could not create %s: %s\n", config.convert_path, strerror(errno));
+        free(planes);
+        fclose(in);
+        return false;
+    }
+    fprintf(out, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", width, height, read_le(&header[8], 2));
+
+    // BT.601 studio range Y'CbCr of the two colors (RGBA)
+    uint8_t yuv[2][3];
+    for (uint32_t on = 0; on < 2; on++) {
+        const uint32_t color = on ? config.fg_color : config.bg_color;
+        const int32_t r = (color >> 24) & 0xFF, g = (color >> 16) & 0xFF, b = (color >> 8) & 0xFF;
+        yuv[on][0] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        yuv[on][1] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        yuv[on][2] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+
+    uint8_t frame[256] = {0}, delta[256], packed[256 + 256 / 128 + 1], size[2];
+    uint32_t frames = 0;
+    bool ok = true;
+    while (fread(size, 1, 2, in) == 2) {
+        const uint32_t len = read_le(size, 2);
+        if (len > sizeof(packed) || fread(packed, 1, len, in) != len || !unpackbits(packed, len, delta, sizeof(delta))) {
+            SDL_Log("%s is truncated or corrupt after frame %u\n", in_path, frames);
+            ok = false;
+            break;
+        }
+        for (uint32_t i = 0; i < sizeof(frame); i++) frame[i] ^= delta[i];
+
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = &frame[(y / scale) * 8];
+            for (uint32_t x = 0; x < width; x++) {
+                const uint32_t px = x / scale;
+                const uint8_t *color = yuv[(row[px / 8] >> (7 - px % 8)) & 1];
+                for (uint32_t p = 0; p < 3; p++) planes[(size_t)p * width * height + (size_t)y * width + x] = color[p];
+            }
+        }
+        fputs("FRAME\n", out);
+        fwrite(planes, 1, (size_t)width * height * 3, out);
+        frames++;
+    }
+
+    if (fclose(out) != 0) ok = false;
+    fclose(in);
+    free(planes);
+    printf("Converted %u frames to %s (%ux%u)\n", frames, config.convert_path, width, height);
+    return ok;
+}
+
+// Create and map the shared-memory export segment
+bool init_shm(shm_t *shm, const config_t config) {
+    *shm = (shm_t){.name = config.shm_name};
+
+    const int fd = shm_open(shm->name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        SDL_Log("Could not open shared memory %s\n", shm->name);
+        return false;
+    }
+    if (ftruncate(fd, sizeof(shm_frame_t)) != 0) {
+        SDL_Log("Could not size shared memory %s\n", shm->name);
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, sizeof(shm_frame_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping keeps the segment alive
+    if (map == MAP_FAILED) {
+        SDL_Log("Could not map shared memory %s\n", shm->name);
+        return false;
+    }
+
+    shm->frame = (shm_frame_t *)map;
+    memset(shm->frame, 0, sizeof(shm_frame_t));
+    shm->frame->magic = SHM_MAGIC;
+    shm->frame->version = SHM_VERSION;
+    return true;
+}
+
+// Unmap and remove the shared-memory export segment
+void shm_cleanup(shm_t *shm) {
+    if (!shm->frame) return;
+    munmap(shm->frame, sizeof(shm_frame_t));
+    shm_unlink(shm->name);
+    shm->frame = NULL;
+}
+
+// Apply key changes made by external writers since the last frame
+void shm_read_keypad(shm_t *shm, chip8_t *chip8) {
+    const uint16_t keypad = atomic_load_explicit(&shm->frame->keypad, memory_order_acquire);
+    const uint16_t changed = keypad ^ shm->keypad;
+
+    chip8->keypad = (chip8->keypad & ~changed) | (keypad & changed);
+    shm->keypad = keypad;
+}
+
+// Publish the current frame, bracketed by the seqlock so readers never block the emulator
+void shm_publish(shm_t *shm, const chip8_t *chip8) {
+    shm_frame_t *frame = shm->frame;
+    const uint32_t seq = atomic_load_explicit(&frame->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&frame->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    frame->frame++;
+    for (uint32_t i = 0; i < sizeof(frame->display); i++) {
+        frame->display[i] = pixel_on(chip8, i % 64, i / 64);
+    }
+    memcpy(frame->pixel_color, chip8->pixel_color, sizeof(frame->pixel_color));
+    memcpy(frame->V, chip8->V, sizeof(frame->V));
+    frame->I = chip8->I;
+    frame->PC = chip8->PC;
+    frame->delay_timer = get_delay_timer(chip8);
+    frame->sound_timer = get_sound_timer(chip8);
+
+    atomic_store_explicit(&frame->seq, seq + 2, memory_order_release);
+}
+
+// The guest is stuck on FX0A with no key down: nothing changes until a key arrives
+bool waiting_for_key(const chip8_t *chip8) {
+    return (chip8->inst.opcode & 0xF0FF) == 0xF00A && chip8->keypad == 0;
+}
+
+// Copy the emulation state out of a machine
+void save_state(chip8_state_t *state, const chip8_t *chip8) {
+    state->private_pages = chip8->private_pages;
+    for (uint8_t p = 0; p < RAM_PAGES; p++) {
+        if (chip8->private_pages & (1 << p)) memcpy(state->pages[p], chip8->page[p], RAM_PAGE_SIZE);
+    }
+    memcpy(state->display, chip8->display, sizeof(state->display));
+    memcpy(state->stack, chip8->stack, sizeof(state->stack));
+    state->stack_depth = chip8->stack_ptr - chip8->stack;
+    memcpy(state->V, chip8->V, sizeof(state->V));
+    state->I = chip8->I;
+    state->PC = chip8->PC;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->delay_set = chip8->delay_set;
+    state->sound_set = chip8->sound_set;
+    state->keypad = chip8->keypad;
+    state->rng = chip8->rng;
+    memcpy(state->audio_pattern, chip8->audio_pattern, sizeof(state->audio_pattern));
+    state->pitch = chip8->pitch;
+    state->audio_pattern_loaded = chip8->audio_pattern_loaded;
+    state->cycles = chip8->cycles;
+}
+
+// Rewind a machine to a state saved from it, pages the state never wrote go back to the ROM image
+void load_state(chip8_t *chip8, const chip8_state_t *state) {
+    for (uint8_t p = 0; p < RAM_PAGES; p++) {
+        const bool was_private = chip8->private_pages & (1 << p);
+
+        if (state->private_pages & (1 << p)) {
+            if (!was_private) {
+                uint8_t *copy = malloc(RAM_PAGE_SIZE);
+                if (!copy) {
+                    SDL_Log("Could not allocate a RAM page, page %u not restored\n", p);
+                    continue;
+                }
+                chip8->page[p] = copy;
+                chip8->private_pages |= 1 << p;
+            }
+            memcpy(chip8->page[p], state->pages[p], RAM_PAGE_SIZE);
+        } else if (was_private) {
+            free(chip8->page[p]);
+            chip8->page[p] = &chip8->rom->ram[p * RAM_PAGE_SIZE];
+            chip8->private_pages &= ~(1 << p);
+        }
+    }
+    memcpy(chip8->display, state->display, sizeof(chip8->display));
+    memcpy(chip8->stack, state->stack, sizeof(chip8->stack));
+    chip8->stack_ptr = &chip8->stack[state->stack_depth];
+    memcpy(chip8->V, state->V, sizeof(chip8->V));
+    chip8->I = state->I;
+    chip8->PC = state->PC;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    chip8->delay_set = state->delay_set;
+    chip8->sound_set = state->sound_set;
+    chip8->keypad = state->keypad;
+    chip8->rng = state->rng;
+    memcpy(chip8->audio_pattern, state->audio_pattern, sizeof(chip8->audio_pattern));
+    chip8->pitch = state->pitch;
+    chip8->audio_pattern_loaded = state->audio_pattern_loaded;
+    chip8->cycles = state->cycles;
+    chip8->audio_dirty = true;
+    chip8->dirty_rows = UINT64_MAX;
+    chip8->draw = true;
+}
+
+// Bind the local UDP port and resolve the peer
+bool init_netplay(netplay_t *np, chip8_t *chip8, const config_t config) {
+    *np = (netplay_t){
+        .sock = -1,
+        .own_keys = config.netplay_player == 2 ? (uint16_t)~NETPLAY_P1_KEYS : NETPLAY_P1_KEYS,
+        .rollback = config.rollback_frames,
+        .remote_confirmed = -1,
+    };
+
+    np->snapshots = calloc(NETPLAY_RING, sizeof(chip8_state_t));
+    if (!np->snapshots) {
+        SDL_Log("Could not allocate netplay snapshots\n");
+        return false;
+    }
+
+    // Split host:port
+    char host[256];
+    const char *colon = strrchr(config.netplay_peer, ':');
+    if (!colon || (size_t)(colon - config.netplay_peer) >= sizeof(host)) {
+        SDL_Log("Netplay peer %s is not host:port\n", config.netplay_peer);
+        return false;
+    }
+    memcpy(host, config.netplay_peer, colon - config.netplay_peer);
+    host[colon - config.netplay_peer] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *peer = NULL;
+    if (getaddrinfo(host, colon + 1, &hints, &peer) != 0) {
+        SDL_Log("Could not resolve netplay peer %s\n", config.netplay_peer);
+        return false;
+    }
+    memcpy(&np->peer, peer->ai_addr, peer->ai_addrlen);
+    np->peer_len = peer->ai_addrlen;
+    freeaddrinfo(peer);
+
+    np->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    const struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_port = htons(config.netplay_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (np->sock < 0 || bind(np->sock, (const struct sockaddr *)&local, sizeof(local)) != 0) {
+        SDL_Log("Could not bind netplay UDP port %u: %s\n", config.netplay_port, strerror(errno));
+        return false;
+    }
+    fcntl(np->sock, F_SETFL, fcntl(np->sock, F_GETFL, 0) | O_NONBLOCK);
+
+    // Both peers must produce identical random numbers
+    chip8->rng = 0x2545F491;
+    return true;
+}
+
+void netplay_cleanup(netplay_t *np) {
+    if (np->sock >= 0) close(np->sock);
+    free(np->snapshots);
+    if (np->frame > 0) {
+        printf("Netplay: %u frames, %llu rollbacks, %llu frames resimulated\n", np->frame,
+               (long long unsigned)np->rollbacks, (long long unsigned)np->resimulated);
+    }
+}
+
+// Send our most recent inputs, older ones are repeated to cover lost packets
+void netplay_send(netplay_t *np) {
+    if (np->frame == 0) return;
+
+    netplay_packet_t packet = {0};
+    const uint32_t count = np->frame < NETPLAY_RING / 2 ? np->frame : NETPLAY_RING / 2;
+    const uint32_t newest = np->frame - 1;
+
+    packet.magic = htonl(NETPLAY_MAGIC);
+    packet.frame = htonl(newest);
+    packet.count = htons(count);
+    for (uint32_t i = 0; i < count; i++) {
+        packet.inputs[i] = htons(np->local_input[(newest - count + 1 + i) % NETPLAY_RING]);
+    }
+    sendto(np->sock, &packet, sizeof(packet), 0, (const struct sockaddr *)&np->peer, np->peer_len);
+}
+
+// Drain received packets, returns the oldest frame whose prediction turned out wrong
+uint32_t netplay_receive(netplay_t *np) {
+    uint32_t mispredicted = np->frame;
+    netplay_packet_t packet;
+
+    while (recv(np->sock, &packet, sizeof(packet), 0) == sizeof(packet)) {
+        if (ntohl(packet.magic) != NETPLAY_MAGIC) continue;
+
+        const int64_t newest = ntohl(packet.frame);
+        const uint32_t count = ntohs(packet.count);
+        if (count > NETPLAY_RING / 2) continue;
+
+        for (uint32_t i = 0; i < count; i++) {
+            const int64_t frame = newest - count + 1 + i;
+            if (frame != np->remote_confirmed + 1) continue;    // Inputs are confirmed strictly in order
+
+            const uint16_t input = ntohs(packet.inputs[i]);
+            np->remote_input[frame % NETPLAY_RING] = input;
+            np->remote_confirmed = frame;
+
+            if (frame < np->frame && 
+                frame < mispredicted && 
+                input != np->predicted[frame % NETPLAY_RING]) {
+                mispredicted = frame;
+            }
+        }
+    }
+    return mispredicted;
+}
+
+// Simulate one netplay frame from its inputs, snapshotting the state it started from
+void netplay_simulate(netplay_t *np, chip8_t *chip8, const config_t config, const uint32_t frame) {
+    uint16_t remote = 0;
+
+    // Use confirmed remote input when we have it, otherwise predict the last known input repeats
+    if ((int64_t)frame <= np->remote_confirmed) {
+        remote = np->remote_input[frame % NETPLAY_RING];
+    } else if (np->remote_confirmed >= 0) {
+        remote = np->remote_input[np->remote_confirmed % NETPLAY_RING];
+    }
+    np->predicted[frame % NETPLAY_RING] = remote;
+
+    save_state(&np->snapshots[frame % NETPLAY_RING], chip8);
+    chip8->keypad = (np->local_input[frame % NETPLAY_RING] & np->own_keys) | (remote & ~np->own_keys);
+    emulate_frame(chip8, config);
+    np->beeping = frame_beeped(chip8);
+}
+
+// Advance netplay by one frame, rolling back and resimulating first if remote input disagreed
+// with our prediction. Returns false while stalled waiting on a peer that fell too far behind.
+bool netplay_frame(netplay_t *np, chip8_t *chip8, const config_t config) {
+    const uint16_t local = chip8->keypad & np->own_keys;
+    const uint32_t mispredicted = netplay_receive(np);
+
+    if (mispredicted < np->frame) {
+        load_state(chip8, &np->snapshots[mispredicted % NETPLAY_RING]);
+        for (uint32_t frame = mispredicted; frame < np->frame; frame++) {
+            netplay_simulate(np, chip8, config, frame);
+        }
+        np->rollbacks++;
+        np->resimulated += np->frame - mispredicted;
+    }
+
+    if ((int64_t)np->frame - np->remote_confirmed > np->rollback) {
+        netplay_send(np);
+        return false;
+    }
+
+    np->local_input[np->frame % NETPLAY_RING] = local;
+    netplay_simulate(np, chip8, config, np->frame);
+    np->frame++;
+    netplay_send(np);
+    return true;
+}
+
+batch_t *batch_create_from_image(const uint32_t lanes, const rom_image_t *image, const int extension,
+                                 const uint32_t instr_per_sec) {
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    if (!batch || lanes == 0) {
+        free(batch);
+        return NULL;
+    }
 
-        case 0x01:
-            // 0x1NNN: Jumps to address NNN
-            printf("Jumps to address NNN: 0x%04x\n", chip8->inst.nnn); // Jump to subroutine address
-            break;
+    set_config_from_args(&batch->config, 0, NULL);
+    batch->config.current_extension = (extension_t)extension;
+    batch->config.instr_per_sec = instr_per_sec;
+    batch->lanes = lanes;
+
+    batch->V = calloc(16 * lanes, sizeof(uint8_t));
+    batch->PC = calloc(lanes, sizeof(uint16_t));
+    batch->I = calloc(lanes, sizeof(uint16_t));
+    batch->delay_timer = calloc(lanes, sizeof(uint8_t));
+    batch->sound_timer = calloc(lanes, sizeof(uint8_t));
+    batch->stack = calloc(16 * lanes, sizeof(uint16_t));
+    batch->stack_depth = calloc(lanes, sizeof(uint8_t));
+    batch->keypad = calloc(lanes, sizeof(uint16_t));
+    batch->rng = calloc(lanes, sizeof(uint32_t));
+    batch->ram = calloc(lanes, 4096);
+    batch->rom = calloc(1, 4096);
+    batch->frames = calloc(lanes, 64*32);
+    batch->active = calloc(lanes, sizeof(uint8_t));
+    batch->opcode = calloc(lanes, sizeof(uint16_t));
+    batch->reward_prev = calloc(lanes, sizeof(uint8_t));
+
+    if (!batch->V || !batch->PC || !batch->I || !batch->delay_timer || !batch->sound_timer ||
+        !batch->stack || !batch->stack_depth || !batch->keypad || !batch->rng || !batch->ram ||
+        !batch->rom || !batch->frames || !batch->active || !batch->opcode || !batch->reward_prev) {
+        batch_destroy(batch);
+        return NULL;
+    }
+    memcpy(batch->rom, image->ram, sizeof(image->ram));
 
-        case 0X02:
-            printf("calls a subroutine at address: 0X%04x\n", chip8->inst.nnn);
-            //0X2NNN calls a subroutine AT address NNN 
-            //*chip8->stack_ptr++ = chip8->PC; //store current address in PC
-            //chip8->PC = chip8->inst.nnn;
-        break;
+    batch_reset(batch);
+    return batch;
+}
 
-        case 0x03:
-            // 0x3XNN: Check if VX == NN, if so, skip the next instruction
-            printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",
-                   chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.nn);
-            break;
+batch_t *batch_create(uint32_t lanes, const char rom_name[], int extension, uint32_t instr_per_sec) {
+    // Load the ROM and font once into a power-on image, every lane starts from it
+    rom_image_t *image = load_rom_image(rom_name);
+    if (!image) return NULL;
 
-        case 0x04:
-            // 0x4XNN: Check if VX != NN, if so, skip the next instruction
-            printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",
-                   chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.nn);
-            break;
+    batch_t *batch = batch_create_from_image(lanes, image, extension, instr_per_sec);
+    free(image);
+    return batch;
+}
 
-        case 0x05:
-            // 0x5XY0: Check if VX == VY, if so, skip the next instruction
-            printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
-                   chip8->inst.x, chip8->V[chip8->inst.x], 
-                   chip8->inst.y, chip8->V[chip8->inst.y]);
-            break;
+void batch_destroy(batch_t *batch) {
+    if (!batch) return;
+    free(batch->V);
+    free(batch->PC);
+    free(batch->I);
+    free(batch->delay_timer);
+    free(batch->sound_timer);
+    free(batch->stack);
+    free(batch->stack_depth);
+    free(batch->keypad);
+    free(batch->rng);
+    free(batch->ram);
+    free(batch->rom);
+    free(batch->frames);
+    free(batch->active);
+    free(batch->opcode);
+    free(batch->reward_prev);
+    free(batch);
+}
 
-        case 0x06:
-            ///0x6XNN sets the register Vx to nn
-            printf("Set register V%x to NN 0x%02x\n",
-            chip8->inst.x, chip8->inst.nn);
-            //chip8->V[chip8->inst.x] = chip8->inst.nn;
-            break;
-        
-         case 0x07:
-            //0x7XNN sets the register Vx+= nn
-            printf("Set register V%X (0x%02X) += NN (0x%02X). Result: 0x%02X\n",
-                   chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.nn,
-                   chip8->V[chip8->inst.x] + chip8->inst.nn);
-            break;
-        
-        case 0x08:
-            switch(chip8->inst.n) {
-                case 0:
-                    // 0x8XY0: Set register VX = VY
-                    printf("Set register V%X = V%X (0x%02X)\n",
-                           chip8->inst.x, chip8->inst.y, chip8->V[chip8->inst.y]);
-                    break;
+void batch_reset(batch_t *batch) {
+    const uint32_t lanes = batch->lanes;
+
+    memset(batch->V, 0, 16 * lanes);
+    memset(batch->I, 0, lanes * sizeof(uint16_t));
+    memset(batch->delay_timer, 0, lanes);
+    memset(batch->sound_timer, 0, lanes);
+    memset(batch->stack_depth, 0, lanes);
+    memset(batch->keypad, 0, lanes * sizeof(uint16_t));
+    memset(batch->frames, 0, lanes * 64*32);
+    for (uint32_t lane = 0; lane < lanes; lane++) {
+        memcpy(&batch->ram[lane * 4096], batch->rom, 4096);
+        batch->PC[lane] = 0x200;
+        batch->rng[lane] = 0x2545F491 + lane * 0x9E3779B9;
+        batch->reward_prev[lane] = batch->ram[lane * 4096 + batch->reward_addr];
+    }
+}
 
-                case 1:
-                    // 0x8XY1: Set register VX |= VY
-                    printf("Set register V%X (0x%02X) |= V%X (0x%02X); Result: 0x%02X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->inst.y, chip8->V[chip8->inst.y],
-                           chip8->V[chip8->inst.x] | chip8->V[chip8->inst.y]);
-                    break;
+void batch_set_reward_addr(batch_t *batch, uint16_t addr) {
+    batch->reward_addr = addr & 0x0FFF;
+    for (uint32_t lane = 0; lane < batch->lanes; lane++) {
+        batch->reward_prev[lane] = batch->ram[lane * 4096 + batch->reward_addr];
+    }
+}
 
-                case 2:
-                    // 0x8XY2: Set register VX &= VY
-                    printf("Set register V%X (0x%02X) &= V%X (0x%02X); Result: 0x%02X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->inst.y, chip8->V[chip8->inst.y],
-                           chip8->V[chip8->inst.x] & chip8->V[chip8->inst.y]);
-                    break;
+const uint8_t *batch_frames(const batch_t *batch) {
+    return batch->frames;
+}
 
-                case 3:
-                    // 0x8XY3: Set register VX ^= VY
-                    printf("Set register V%X (0x%02X) ^= V%X (0x%02X); Result: 0x%02X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->inst.y, chip8->V[chip8->inst.y],
-                           chip8->V[chip8->inst.x] ^ chip8->V[chip8->inst.y]);
-                    break;
+void ram_search_reset(ram_search_t *search, const batch_t *batch, const uint32_t lane) {
+    ram_search_begin(search, &batch->ram[lane * 4096]);
+}
+
+uint32_t ram_search_step(ram_search_t *search, const batch_t *batch, const uint32_t lane, const int filter,
+                         const uint8_t value) {
+    return ram_search_filter(search, &batch->ram[lane * 4096], filter, value);
+}
+
+const uint64_t *ram_search_candidates(const ram_search_t *search) {
+    return search->candidates;
+}
 
+// Per-lane fallback interpreter, used for opcodes that touch lane memory or when lanes diverge.
+// Mirrors emu_instr on the structure-of-arrays layout; PC has already been advanced.
+void batch_exec_lane(batch_t *batch, const uint32_t lane, const uint16_t opcode) {
+    const uint32_t lanes = batch->lanes;
+    const config_t *config = &batch->config;
+    const uint16_t nnn = opcode & 0x0FFF;
+    const uint8_t nn = opcode & 0x00FF;
+    const uint8_t n = opcode & 0x000F;
+    const uint8_t x = (opcode >> 8) & 0x000F;
+    const uint8_t y = (opcode >> 4) & 0x000F;
+    uint8_t *V = batch->V + lane;   // Register r of this lane is V[r * lanes]
+    uint8_t *ram = &batch->ram[lane * 4096];
+    uint8_t carry;
+
+    #define VR(r) V[(r) * lanes]
+
+    switch (opcode >> 12) {
+        case 0x00:
+            if (opcode == 0x00E0) {
+                memset(&batch->frames[lane * 64*32], 0, 64*32);
+            } else if (opcode == 0x00EE) {
+                if (batch->stack_depth[lane] == 0) batch->stack_depth[lane] = 16;  // Ring of 16, as emu_instr
+                batch->PC[lane] = batch->stack[--batch->stack_depth[lane] * lanes + lane];
+            }
+            break;
+        case 0x01: batch->PC[lane] = nnn; break;
+        case 0x02:
+            if (batch->stack_depth[lane] == 16) batch->stack_depth[lane] = 0;
+            batch->stack[batch->stack_depth[lane]++ * lanes + lane] = batch->PC[lane];
+            batch->PC[lane] = nnn;
+            break;
+        case 0x03: if (VR(x) == nn) batch->PC[lane] += 2; break;
+        case 0x04: if (VR(x) != nn) batch->PC[lane] += 2; break;
+        case 0x05: if (n == 0 && VR(x) == VR(y)) batch->PC[lane] += 2; break;
+        case 0x06: VR(x) = nn; break;
+        case 0x07: VR(x) += nn; break;
+        case 0x08:
+            switch (n) {
+                case 0: VR(x) = VR(y); break;
+                case 1: VR(x) |= VR(y); VR(0xF) = 0; break;
+                case 2: VR(x) &= VR(y); VR(0xF) = 0; break;
+                case 3: VR(x) ^= VR(y); VR(0xF) = 0; break;
                 case 4:
-                    // 0x8XY4: Set register VX += VY, set VF to 1 if carry
-                    printf("Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry; Result: 0x%02X, VF = %X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->inst.y, chip8->V[chip8->inst.y],
-                           chip8->V[chip8->inst.x] + chip8->V[chip8->inst.y],
-                           ((uint16_t)(chip8->V[chip8->inst.x] + chip8->V[chip8->inst.y]) > 255));
+                    carry = ((uint16_t)(VR(x) + VR(y)) > 255);
+                    VR(x) += VR(y);
+                    VR(0xF) = carry;
                     break;
-
                 case 5:
-                    // 0x8XY5: Set register VX -= VY, set VF to 1 if there is not a borrow (result is positive/0)
-                    printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->inst.y, chip8->V[chip8->inst.y],
-                           chip8->V[chip8->inst.x] - chip8->V[chip8->inst.y],
-                           (chip8->V[chip8->inst.y] <= chip8->V[chip8->inst.x]));
+                    carry = (VR(x) >= VR(y));
+                    VR(x) -= VR(y);
+                    VR(0xF) = carry;
                     break;
-
                 case 6:
-                    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-                    printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->V[chip8->inst.x] & 1,
-                           chip8->V[chip8->inst.x] >> 1);
+                    if (config->current_extension == CHIP8) {
+                        carry = VR(y) & 1;
+                        VR(x) = VR(y) >> 1;
+                    } else {
+                        carry = VR(x) & 1;
+                        VR(x) >>= 1;
+                    }
+                    VR(0xF) = carry;
                     break;
-
                 case 7:
-                    // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive/0)
-                    printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
-                           chip8->inst.x, chip8->inst.y, chip8->V[chip8->inst.y],
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->V[chip8->inst.y] - chip8->V[chip8->inst.x],
-                           (chip8->V[chip8->inst.x] <= chip8->V[chip8->inst.y]));
+                    carry = (VR(y) >= VR(x));
+                    VR(x) = VR(y) - VR(x);
+                    VR(0xF) = carry;
                     break;
-                // note, Vx is V%, chip8->int.x
-                //value in vx is chip8->V[chip8->int.x]
                 case 0xE:
-                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-                    printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x],
-                           (chip8->V[chip8->inst.x] & 0X80) >> 7,
-                           chip8->V[chip8->inst.x] << 1);
-                    break;
-
-                default:
-                    // Wrong/unimplemented opcode
+                    if (config->current_extension == CHIP8) {
+                        carry = (VR(y) & 0x80) >> 7;
+                        VR(x) = VR(y) << 1;
+                    } else {
+                        carry = (VR(x) & 0x80) >> 7;
+                        VR(x) <<= 1;
+                    }
+                    VR(0xF) = carry;
                     break;
+                default: break;
             }
             break;
-        
-        case 0x09:
-            // 0x9XY0: Check if VX != VY; Skip next instruction if so
-            printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n",
-                   chip8->inst.x, chip8->V[chip8->inst.x], 
-                   chip8->inst.y, chip8->V[chip8->inst.y]);
-            break;
-
-        case 0x0A:
-            //0xANN sets index register to address NNN
-            printf("Sets the I register to NNN (0x%04X)\n",
-            chip8->inst.nnn);
-            //chip8->I = chip8->inst.nnn;
-            break;
-        
-        case 0x0B:
-            // 0xBNNN: Jump to V0 + NNN
-            printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
-                   chip8->V[0], chip8->inst.nnn, chip8->V[0] + chip8->inst.nnn);
+        case 0x09: if (n == 0 && VR(x) != VR(y)) batch->PC[lane] += 2; break;
+        case 0x0A: batch->I[lane] = nnn; break;
+        case 0x0B: batch->PC[lane] = VR(0) + nnn; break;
+        case 0x0C: {
+            uint32_t rng = batch->rng[lane];
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            batch->rng[lane] = rng;
+            VR(x) = (rng % 256) & nn;
             break;
-        
-        case 0x0C:
-            // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
-            printf("Set V%X = rand() %% 256 & NN (0x%02X)\n",
-                   chip8->inst.x, chip8->inst.nn);
+        }
+        case 0x0D: {
+            uint8_t *display = &batch->frames[lane * 64*32];
+            const uint8_t x_start = VR(x);
+            const uint8_t y_start = VR(y);
+
+            VR(0xF) = 0;
+            for (uint8_t row = 0; row < n; row++) {
+                const uint8_t y_pos = (y_start + row) % config->window_height;
+                const uint8_t sprite_byte = ram[(batch->I[lane] + row) & 0x0FFF];
+
+                for (uint8_t col = 0; col < 8; col++) {
+                    if (!(sprite_byte & (0x80 >> col))) continue;
+
+                    const uint16_t display_idx = y_pos * config->window_width + 
+                                                 (x_start + col) % config->window_width;
+                    if (display[display_idx]) VR(0xF) = 1;
+                    display[display_idx] ^= 1;
+                }
+            }
+            if (config->current_extension == CHIP8) batch->active[lane] = 0;
             break;
-
-        case 0x0D:
-            printf("Draw N(%u)height sprite t coords V%0X (0x%02X) and V%X (0x%02x) from memory location I (%04x)\n",
-            chip8->inst.n, chip8->inst.x, chip8->V[chip8->inst.x], chip8->inst.y, chip8->V[chip8->inst.y], chip8->I);
-
-        //default: printf("Unimplemented Opcode\n");
-        break;
-        
+        }
         case 0x0E:
-            if (chip8->inst.nn == 0x9E) {
-                // 0xEX9E: Skip next instruction if key in VX is pressed
-                printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n",
-                       chip8->inst.x, chip8->V[chip8->inst.x], chip8->keypad[chip8->V[chip8->inst.x]]);
-
-            } else if (chip8->inst.nn == 0xA1) {
-                // 0xEX9E: Skip next instruction if key in VX is not pressed
-                printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n",
-                       chip8->inst.x, chip8->V[chip8->inst.x], chip8->keypad[chip8->V[chip8->inst.x]]);
+            if (nn == 0x9E) {
+                if ((batch->keypad[lane] >> (VR(x) & 0xF)) & 1) batch->PC[lane] += 2;
+            } else if (nn == 0xA1) {
+                if (!((batch->keypad[lane] >> (VR(x) & 0xF)) & 1)) batch->PC[lane] += 2;
             }
             break;
-        
         case 0x0F:
-            switch (chip8->inst.nn) {
-                case 0x0A:
-                    // 0xFX0A: VX = get_key(); Await until a keypress, and store in VX
-                    printf("Await until a key is pressed; Store key in V%X\n",
-                           chip8->inst.x);
-                    break;
-
-                case 0x1E:
-                    // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does not affect VF
-                    printf("I (0x%04X) += V%X (0x%02X); Result (I): 0x%04X\n",
-                           chip8->I, chip8->inst.x, chip8->V[chip8->inst.x],
-                           chip8->I + chip8->V[chip8->inst.x]);
-                    break;
-                
-                case 0x07:
-                    // 0xFX07: VX = delay timer
-                    printf("Set V%X = delay timer value (0x%02X)\n",
-                           chip8->inst.x, chip8->delay_timer);
-                    break;
-
-                case 0x15:
-                    // 0xFX15: delay timer = VX 
-                    printf("Set delay timer value = V%X (0x%02X)\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x]);
-                    break;
-
-                case 0x18:
-                    // 0xFX18: sound timer = VX 
-                    printf("Set sound timer value = V%X (0x%02X)\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x]);
-                    break;
-                
-                case 0x29:
-                    // 0xFX29: Set register I to sprite location in memory for character in VX (0x0-0xF)
-                    printf("Set I to sprite location in memory for character in V%X (0x%02X). Result(VX*5) = (0x%02X)\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->V[chip8->inst.x] * 10);
+            switch (nn) {
+                case 0x0A: {
+                    const uint16_t keys = batch->keypad[lane];
+                    if (keys) {
+                        uint8_t key = 0;
+                        while (!((keys >> key) & 1)) key++;
+                        VR(x) = key;
+                    } else {
+                        batch->PC[lane] -= 2;
+                    }
                     break;
-                
-                case 0x33:
-                    // 0xFX33: Store BCD representation of VX at memory offset from I;
-                    //   I = hundred's place, I+1 = ten's place, I+2 = one's place
-                    printf("Store BCD representation of V%X (0x%02X) at memory from I (0x%04X)\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->I);
+                }
+                case 0x1E: batch->I[lane] += VR(x); break;
+                case 0x07: VR(x) = batch->delay_timer[lane]; break;
+                case 0x15: batch->delay_timer[lane] = VR(x); break;
+                case 0x18: batch->sound_timer[lane] = VR(x); break;
+                case 0x29: batch->I[lane] = VR(x) * 5; break;
+                case 0x33: {
+                    uint8_t bcd = VR(x);
+                    ram[(batch->I[lane] + 2) & 0x0FFF] = bcd % 10;
+                    bcd /= 10;
+                    ram[(batch->I[lane] + 1) & 0x0FFF] = bcd % 10;
+                    ram[batch->I[lane] & 0x0FFF] = bcd / 10;
                     break;
-                
+                }
                 case 0x55:
-                    // 0xFX55: Register dump V0-VX inclusive to memory offset from I;
-                    //   SCHIP does not inrement I, CHIP8 does increment I
-                    printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->I);
+                    for (uint8_t i = 0; i <= x; i++) {
+                        if (config->current_extension == CHIP8)
+                            ram[batch->I[lane]++ & 0x0FFF] = VR(i);
+                        else
+                            ram[(batch->I[lane] + i) & 0x0FFF] = VR(i);
+                    }
                     break;
-
                 case 0x65:
-                    // 0xFX65: Register load V0-VX inclusive from memory offset from I;
-                    //   SCHIP does not inrement I, CHIP8 does increment I
-                    printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
-                           chip8->inst.x, chip8->V[chip8->inst.x], chip8->I);
+                    for (uint8_t i = 0; i <= x; i++) {
+                        if (config->current_extension == CHIP8)
+                            VR(i) = ram[batch->I[lane]++ & 0x0FFF];
+                        else
+                            VR(i) = ram[(batch->I[lane] + i) & 0x0FFF];
+                    }
                     break;
+                default: break;
+            }
+            break;
+        default: break;
+    }
+    #undef VR
+}
 
+// Execute one opcode on every active lane at once. Every active lane fetched the same opcode,
+// so x/y/nn are shared and each register is a contiguous row across lanes. Inactive lanes are
+// masked out with selects so the loops stay branch free. Returns false for opcode classes that
+// need per-lane memory access, which the caller runs through batch_exec_lane instead.
+bool batch_exec_uniform(batch_t *batch, const uint16_t opcode) {
+    const uint32_t lanes = batch->lanes;
+    const uint16_t nnn = opcode & 0x0FFF;
+    const uint8_t nn = opcode & 0x00FF;
+    const uint8_t n = opcode & 0x000F;
+    const bool shift_vy = batch->config.current_extension == CHIP8;
+    const uint8_t *active = batch->active;
+    uint8_t *vx = &batch->V[((opcode >> 8) & 0x000F) * lanes];
+    uint8_t *vy = &batch->V[((opcode >> 4) & 0x000F) * lanes];
+    uint8_t *vf = &batch->V[0xF * lanes];
+    uint16_t *PC = batch->PC;
+    uint16_t *I = batch->I;
+
+    switch (opcode >> 12) {
+        case 0x01:
+            for (uint32_t l = 0; l < lanes; l++) PC[l] = active[l] ? nnn : PC[l];
+            return true;
+        case 0x03:
+            for (uint32_t l = 0; l < lanes; l++) PC[l] += (active[l] & (vx[l] == nn)) << 1;
+            return true;
+        case 0x04:
+            for (uint32_t l = 0; l < lanes; l++) PC[l] += (active[l] & (vx[l] != nn)) << 1;
+            return true;
+        case 0x05:
+            if (n != 0) return true;
+            for (uint32_t l = 0; l < lanes; l++) PC[l] += (active[l] & (vx[l] == vy[l])) << 1;
+            return true;
+        case 0x06:
+            for (uint32_t l = 0; l < lanes; l++) vx[l] = active[l] ? nn : vx[l];
+            return true;
+        case 0x07:
+            for (uint32_t l = 0; l < lanes; l++) vx[l] += active[l] ? nn : 0;
+            return true;
+        case 0x08:
+            // Results are computed into the VX row first and VF written last, as emu_instr does,
+            // so X or Y being F behaves the same
+            for (uint32_t l = 0; l < lanes; l++) {
+                if (!active[l]) continue;
+                uint8_t result, carry;
+                switch (n) {
+                    case 0: vx[l] = vy[l]; continue;    // Leaves VF alone, even when X is F
+                    case 1: result = vx[l] | vy[l]; carry = 0; break;
+                    case 2: result = vx[l] & vy[l]; carry = 0; break;
+                    case 3: result = vx[l] ^ vy[l]; carry = 0; break;
+                    case 4: carry = (vx[l] + vy[l]) > 255; result = vx[l] + vy[l]; break;
+                    case 5: carry = vx[l] >= vy[l]; result = vx[l] - vy[l]; break;
+                    case 6: {
+                        const uint8_t src = shift_vy ? vy[l] : vx[l];
+                        carry = src & 1;
+                        result = src >> 1;
+                        break;
+                    }
+                    case 7: carry = vy[l] >= vx[l]; result = vy[l] - vx[l]; break;
+                    case 0xE: {
+                        const uint8_t src = shift_vy ? vy[l] : vx[l];
+                        carry = src >> 7;
+                        result = src << 1;
+                        break;
+                    }
+                    default: continue;
+                }
+                vx[l] = result;
+                vf[l] = carry;
+            }
+            return true;
+        case 0x09:
+            if (n != 0) return true;
+            for (uint32_t l = 0; l < lanes; l++) PC[l] += (active[l] & (vx[l] != vy[l])) << 1;
+            return true;
+        case 0x0A:
+            for (uint32_t l = 0; l < lanes; l++) I[l] = active[l] ? nnn : I[l];
+            return true;
+        case 0x0E: {
+            const uint16_t *keypad = batch->keypad;
+            if (nn == 0x9E) {
+                for (uint32_t l = 0; l < lanes; l++) 
+                    PC[l] += (active[l] & (keypad[l] >> (vx[l] & 0xF))) << 1;
+            } else if (nn == 0xA1) {
+                for (uint32_t l = 0; l < lanes; l++) 
+                    PC[l] += (active[l] & ~(keypad[l] >> (vx[l] & 0xF))) << 1;
+            }
+            return true;
+        }
+        case 0x0F:
+            switch (nn) {
+                case 0x07:
+                    for (uint32_t l = 0; l < lanes; l++) vx[l] = active[l] ? batch->delay_timer[l] : vx[l];
+                    return true;
+                case 0x15:
+                    for (uint32_t l = 0; l < lanes; l++) 
+                        batch->delay_timer[l] = active[l] ? vx[l] : batch->delay_timer[l];
+                    return true;
+                case 0x18:
+                    for (uint32_t l = 0; l < lanes; l++) 
+                        batch->sound_timer[l] = active[l] ? vx[l] : batch->sound_timer[l];
+                    return true;
+                case 0x1E:
+                    for (uint32_t l = 0; l < lanes; l++) I[l] += active[l] ? vx[l] : 0;
+                    return true;
+                case 0x29:
+                    for (uint32_t l = 0; l < lanes; l++) I[l] = active[l] ? vx[l] * 5 : I[l];
+                    return true;
                 default:
-                    break; //unimplemented codes
-
+                    return false;
+            }
+        default:
+            return false;
     }
-    
- }
 }
-#endif
 
-//emulate chip8 instructions
-    void emu_instr(chip8_t *chip8, const config_t config) {
-        bool carry; //carry flag for arithmetic operations
-
-        // Get next opcode (Big Endian)
-        chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
-        chip8->PC += 2; // Increment PC
-
-        // Fill current instruction format
-        chip8->inst.nnn = chip8->inst.opcode & 0x0FFF; // 12-bit address
-        chip8->inst.nn  = chip8->inst.opcode & 0x00FF; // 8-bit constant
-        chip8->inst.n   = chip8->inst.opcode & 0x000F; // 4-bit constant
-        chip8->inst.x   = (chip8->inst.opcode >> 8) & 0x000F; // X register
-        chip8->inst.y   = (chip8->inst.opcode >> 4) & 0x000F; // Y register
-
-    #ifdef DEBUG
-        print_debug_info(chip8); // Debug output
-    #endif
-
-    switch ((chip8->inst.opcode >> 12) & 0x0F) {
-        case 0x00: 
-            if (chip8->inst.nn == 0xE0) {
-                // 0x00E0: Clear screen
-                memset(chip8->display, 0, sizeof(chip8->display));
-                chip8->draw = true;
-            } else if (chip8->inst.nn == 0xEE) {
-                // 0x00EE: Return from subroutine
-                chip8->PC = *--chip8->stack_ptr; // Pop address from stack
-            }
-            break;
+void batch_step(batch_t *batch, const uint16_t actions[], float rewards[]) {
+    const uint32_t lanes = batch->lanes;
+    const uint32_t budget = batch->config.instr_per_sec / 60;
+
+    if (actions) memcpy(batch->keypad, actions, lanes * sizeof(uint16_t));
+    memset(batch->active, 1, lanes);
+
+    for (uint32_t i = 0; i < budget; i++) {
+        // Fetch for every lane, and check whether all running lanes agree on the opcode
+        uint32_t running = 0, first = lanes;
+        bool uniform = true;
+        for (uint32_t l = 0; l < lanes; l++) {
+            if (!batch->active[l]) continue;
+            const uint8_t *ram = &batch->ram[l * 4096];
+            batch->opcode[l] = (ram[batch->PC[l] & 0x0FFF] << 8) | ram[(batch->PC[l] + 1) & 0x0FFF];
+            batch->PC[l] += 2;
+            if (first == lanes) first = l;
+            uniform &= batch->opcode[l] == batch->opcode[first];
+            running++;
+        }
+        if (running == 0) break;
+        batch->executed += running;
 
-        case 0x01:
-            // 0x1NNN: Jumps to address NNN
-            chip8->PC = chip8->inst.nnn; // Jump to subroutine address
-            break;
+        if (uniform && batch_exec_uniform(batch, batch->opcode[first])) continue;
 
-        case 0x02:
-            // 0x2NNN: Call subroutine at address NNN
-            *chip8->stack_ptr++ = chip8->PC; // Push current address to stack
-            chip8->PC = chip8->inst.nnn; // Jump to subroutine address
-            break;
+        for (uint32_t l = 0; l < lanes; l++) {
+            if (batch->active[l]) batch_exec_lane(batch, l, batch->opcode[l]);
+        }
+    }
 
-        case 0x03:
-            //0x3xnn Skip next instruction if Vx == kk. 
-            //The interpreter compares register Vx to kk, and if they are equal, increments the program counter by 2.
-            if(chip8->V[chip8->inst.x] == chip8->inst.nn)
-            {
-                chip8->PC += 2;
-            }
-            break;
+    // Tick the timers once per frame
+    for (uint32_t l = 0; l < lanes; l++) {
+        batch->delay_timer[l] -= batch->delay_timer[l] > 0;
+        batch->sound_timer[l] -= batch->sound_timer[l] > 0;
+    }
 
-        case 0x04:
-            //Skip next instruction if Vx != kk.
-            //The interpreter compares register Vx to kk, and if they are not equal, increments the program counter by 2.
-            if(chip8->V[chip8->inst.x] != chip8->inst.nn)
-            {
-                chip8->PC += 2;
-            }
-            break;        
+    if (!rewards) return;
+    for (uint32_t l = 0; l < lanes; l++) {
+        const uint8_t value = batch->ram[l * 4096 + batch->reward_addr];
+        rewards[l] = batch->reward_addr ? (float)value - batch->reward_prev[l] : 0.0f;
+        batch->reward_prev[l] = value;
+    }
+}
 
-        case 0x05:
-            //0x5XY0
-            //Skip next instruction if Vx == Vy.
-            if(chip8->inst.n != 0) break; //wrong opcode format if n!=0
-            if(chip8->V[chip8->inst.x] == chip8->V[chip8->inst.y]){
-                chip8->PC += 2;
-            }
-            break;
+// Headless benchmark of the batched engine
+void run_batch_benchmark(const config_t config, const char rom_name[]) {
+    rom_image_t *image = load_rom(config, rom_name);
+    if (!image) return;
+    batch_t *batch = batch_create_from_image(config.batch_lanes, image, config.current_extension, config.instr_per_sec);
+    free(image);
+    if (!batch) {
+        SDL_Log("Could not create a batch of %u lanes\n", config.batch_lanes);
+        return;
+    }
 
-        case 0x06:
-            // 0x6XNN: Set register Vx to NN
-            chip8->V[chip8->inst.x] = chip8->inst.nn;
-            break;
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint32_t frame = 0; frame < config.batch_frames; frame++) {
+        batch_step(batch, NULL, NULL);
+    }
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    const double frames = (double)config.batch_frames * config.batch_lanes;
 
-        case 0x07:
-            // 0x7XNN: Add NN to register Vx
-            chip8->V[chip8->inst.x] += chip8->inst.nn;
-            break;
+    printf("Batch: %u lanes x %u frames in %.3fs, %.0f frames/s, %.0f instructions/s\n",
+           config.batch_lanes, config.batch_frames, seconds, frames / seconds,
+           batch->executed / seconds);
+    batch_destroy(batch);
+}
 
-        case 0x08:
-            switch (chip8->inst.n)
-            {
-                case 0:
-                    // 0x8XY0: Set register VX = VY
-                    chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y];
-                    break;
+// First part of the emulation state where two machines disagree, NULL when they match
+const char *diff_machines(const chip8_t *a, const chip8_t *b) {
+    if (a->PC != b->PC) return "PC";
+    if (a->I != b->I) return "I";
+    if (memcmp(a->V, b->V, sizeof(a->V)) != 0) return "V";
+    if (a->stack_ptr - a->stack != b->stack_ptr - b->stack) return "stack depth";
+    if (memcmp(a->stack, b->stack, sizeof(a->stack)) != 0) return "stack";
+    if (get_delay_timer(a) != get_delay_timer(b)) return "delay timer";
+    if (get_sound_timer(a) != get_sound_timer(b)) return "sound timer";
+    if (a->rng != b->rng) return "rng";
+    if (memcmp(a->display, b->display, sizeof(a->display)) != 0) return "display";
+    if (memcmp(a->audio_pattern, b->audio_pattern, sizeof(a->audio_pattern)) != 0 ||
+        a->pitch != b->pitch || a->audio_pattern_loaded != b->audio_pattern_loaded) return "audio";
+    for (uint8_t p = 0; p < RAM_PAGES; p++) {
+        if (a->page[p] != b->page[p] && memcmp(a->page[p], b->page[p], RAM_PAGE_SIZE) != 0) return "ram";
+    }
+    return NULL;
+}
 
-                case 1:
-                    //0x8XY1,  bitwise OR, Vx |= VY
-                    chip8->V[chip8->inst.x] |= chip8->V[chip8->inst.y];
-                    //Chip8 ONLY quirk --> VF is changed, set to zero
-                    chip8->V[0XF] = 0;
-                    break;
+// Same for a batch lane, which has no XO-CHIP audio state
+const char *diff_batch_lane(const chip8_t *a, const batch_t *batch, const uint32_t lane) {
+    const uint32_t lanes = batch->lanes;
 
-                case 2:
-                    //0x8XY2, bitwise and, vx &= vy
-                    chip8->V[chip8->inst.x] &= chip8->V[chip8->inst.y];
-                    //chip8 only quirk --> VF is changed, set to zero
-                    chip8->V[0XF] = 0;
-                    break;
+    if (a->PC != batch->PC[lane]) return "PC";
+    if (a->I != batch->I[lane]) return "I";
+    for (uint8_t r = 0; r < 16; r++) {
+        if (a->V[r] != batch->V[r * lanes + lane]) return "V";
+    }
+    if (a->stack_ptr - a->stack != batch->stack_depth[lane]) return "stack depth";
+    for (uint8_t d = 0; d < 16; d++) {
+        if (a->stack[d] != batch->stack[d * lanes + lane]) return "stack";
+    }
+    if (get_delay_timer(a) != batch->delay_timer[lane]) return "delay timer";
+    if (get_sound_timer(a) != batch->sound_timer[lane]) return "sound timer";
+    if (a->rng != batch->rng[lane]) return "rng";
+    for (uint32_t i = 0; i < 64*32; i++) {
+        if (pixel_on(a, i % 64, i / 64) != batch->frames[lane * 64*32 + i]) return "display";
+    }
+    for (uint32_t addr = 0; addr < 4096; addr++) {
+        if (read_ram(a, addr) != batch->ram[lane * 4096 + addr]) return "ram";
+    }
+    return NULL;
+}
 
-                case 3:
-                    //0x8XY3, bitwise xor, vx ^= vy
-                    chip8->V[chip8->inst.x] ^= chip8->V[chip8->inst.y];
-                    //chip8 only quirk --> VF is changed, set to zero
-                    chip8->V[0XF] = 0;
-                    break;
+void print_registers(const char *label, const uint16_t pc, const uint16_t i, const uint8_t v[16],
+                     const uint32_t depth, const uint8_t delay_timer, const uint8_t sound_timer) {
+    printf("  %-9s PC=%04X I=%04X SP=%u DT=%u ST=%u V=", label, pc, i, depth, delay_timer, sound_timer);
+    for (uint8_t r = 0; r < 16; r++) printf("%02X%c", v[r], r == 15 ? '\n' : ' ');
+}
 
-                case 4: // 0x8XY4: ADD Vx, Vy
-                    {
-                        carry = ((uint16_t)(chip8->V[chip8->inst.x] + chip8->V[chip8->inst.y]) > 255);
-                        chip8->V[chip8->inst.x] += chip8->V[chip8->inst.y];
-                        chip8->V[0XF] = carry ? 1 : 0;
-                    }
-                    break;
+// Report a divergence: where, both machines' registers and the reference's last instructions
+void print_divergence(const char *field, const uint32_t frame, const chip8_t *ref, const chip8_t *fast,
+                      const batch_t *batch, const trace_t *trace) {
+    printf("==== DIVERGENCE in %s after frame %u ====\n", field, frame);
+    print_registers("reference", ref->PC, ref->I, ref->V, ref->stack_ptr - ref->stack,
+                    get_delay_timer(ref), get_sound_timer(ref));
+    if (batch) {
+        uint8_t v[16];
+        for (uint8_t r = 0; r < 16; r++) v[r] = batch->V[r * batch->lanes];
+        print_registers("batch", batch->PC[0], batch->I[0], v, batch->stack_depth[0],
+                        batch->delay_timer[0], batch->sound_timer[0]);
+    } else {
+        print_registers("fused", fast->PC, fast->I, fast->V, fast->stack_ptr - fast->stack,
+                        get_delay_timer(fast), get_sound_timer(fast));
+    }
 
-                case 5: // 0x8XY5: SUB Vx, Vy, Vx = Vx - Vy
-                //VF is set to 0 when there's a borrow, and 1 when there isn't
-                    {
-                        carry = (chip8->V[chip8->inst.x] >= chip8->V[chip8->inst.y]);
-                        chip8->V[chip8->inst.x] -= chip8->V[chip8->inst.y];
-                        chip8->V[0xF] = carry ? 1 : 0;
-                    }
-                    break;
+    printf("  last reference instructions:\n");
+    const uint32_t first = trace->count > TRACE_LENGTH ? trace->count - TRACE_LENGTH : 0;
+    for (uint32_t n = first; n < trace->count; n++) {
+        const trace_entry_t *entry = &trace->entries[n % TRACE_LENGTH];
+        printf("    frame %6u  %03X: %04X  %s\n", entry->frame, entry->addr, entry->opcode,
+               opcode_classes[opcode_class(entry->opcode)].name);
+    }
+}
 
-                case 6: {
-                    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-                    if (config.current_extension == CHIP8) {
-                        carry = chip8->V[chip8->inst.y] & 1;    // Use VY
-                        chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y] >> 1; // Set VX = VY result
-                    } else {
-                        carry = chip8->V[chip8->inst.x] & 1;    // Use VX
-                        chip8->V[chip8->inst.x] >>= 1;          // Use VX
-                    }
-                    chip8->V[0xF] = carry; }
-                    break;
+// Lockstep run of the reference interpreter and the engine under test, both starting from image
+// and getting the same pseudo-random keys. The full state is compared after every frame.
+// Returns false at the first divergence, after reporting it.
+bool diff_run(const config_t config, rom_image_t *image, const uint32_t seed) {
+    static uint32_t ref_colors[64*32], fast_colors[64*32];
+    chip8_t ref = {.pixel_color = ref_colors}, fast = {.pixel_color = fast_colors};
+    trace_t trace = {0};
+    batch_t *batch = NULL;
+
+    config_t ref_config = config;
+    ref_config.fusion = false;
+    ref_config.trace = &trace;
+    ref_config.profile = NULL;
+    ref_config.metrics = NULL;
+    ref_config.log_traps = false;   // Random ROMs are mostly invalid opcodes
+    config_t fast_config = ref_config;
+    fast_config.fusion = true;
+    fast_config.trace = NULL;
+
+    reset_chip8(&ref, ref_config, image);
+    if (config.diff_engine == DIFF_BATCH) {
+        batch = batch_create_from_image(1, image, config.current_extension, config.instr_per_sec);
+        if (!batch) {
+            SDL_Log("Could not create the batch engine\n");
+            free_chip8(&ref);
+            return false;
+        }
+        ref.rng = batch->rng[0];
+    } else {
+        reset_chip8(&fast, fast_config, image);
+        ref.rng = fast.rng = seed * 0x9E3779B9u | 1;    // Replays with the same seed draw the same numbers
+    }
 
-                case 7:
-                    //0x8XY7 Vx= Vy - Vx
-                    carry = (chip8->V[chip8->inst.y] >= chip8->V[chip8->inst.x]);
-                    chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y] - chip8->V[chip8->inst.x];
-                    chip8->V[0xF] = carry ? 1 : 0;
-                    break;
+    uint32_t keys = seed | 1;
+    bool match = true;
+    for (uint32_t frame = 0; frame < config.diff_frames && match; frame++) {
+        keys ^= keys << 13;
+        keys ^= keys >> 17;
+        keys ^= keys << 5;
+        const uint16_t mask = keys & (keys >> 16);  // A few keys down at a time
+
+        trace.frame = frame;
+        ref.keypad = mask;
+        emulate_frame(&ref, ref_config);
+
+        const char *field;
+        if (batch) {
+            batch_step(batch, &mask, NULL);
+            field = diff_batch_lane(&ref, batch, 0);
+        } else {
+            fast.keypad = mask;
+            emulate_frame(&fast, fast_config);
+            field = diff_machines(&ref, &fast);
+        }
 
-                    case 0xE: {
-                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-                    if (config.current_extension == CHIP8) { 
-                        carry = (chip8->V[chip8->inst.y] & 0x80) >> 7; // Use VY
-                        chip8->V[chip8->inst.x] = chip8->V[chip8->inst.y] << 1; // Set VX = VY result
-                    } else {
-                        carry = (chip8->V[chip8->inst.x] & 0x80) >> 7;  // VX
-                        chip8->V[chip8->inst.x] <<= 1;                  // Use VX
-                    }
-                    chip8->V[0xF] = carry;
-                        }
-                    break;
+        if (field) {
+            print_divergence(field, frame, &ref, &fast, batch, &trace);
+            match = false;
+        }
+    }
 
-                default:
-                    break;
-            }
-            break;
+    free_chip8(&ref);
+    free_chip8(&fast);
+    batch_destroy(batch);
+    return match;
+}
 
-        case 0x09:
-            //0x9XY0, if Vx != Vy, skip next instruction
-            if(chip8->V[chip8->inst.x] != chip8->V[chip8->inst.y]){
-                chip8->PC += 2;
+// Random opcode stream filling the ROM area. Every few opcodes one of the fused sequences is
+// planted with random operands so the superinstructions get exercised too.
+rom_image_t *fuzz_rom_image(const uint32_t seed, const fusion_set_t *set) {
+    rom_image_t *image = new_rom_image("fuzz");
+    if (!image) return NULL;
+
+    uint32_t rng = seed * 2654435761u | 1;
+    for (uint32_t addr = 0x200; addr < 0x1000; addr += 2) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+
+        const uint16_t x = (rng >> 8) & 0x0F00;
+        uint16_t ops[3] = {rng >> 16, 0, 0};
+        uint32_t count = 1;
+        switch ((rng & 0xFF) < 32 ? rng & 3 : 4) {
+            case 0:
+            case 1: {
+                if (!set || !set->count) break;
+                const fusion_sequence_t *sequence = &set->sequences[(rng >> 4) % set->count];
+                for (count = 0; count < sequence->length; count++) {
+                    const opcode_class_t *class = &opcode_classes[sequence->classes[count]];
+                    ops[count] = class->match | ((uint16_t)(rng >> (5 * count + 3)) & ~class->mask);
+                }
+                break;
             }
-            break;
+            case 2: ops[0] = 0xF007 | x; ops[1] = 0x3000 | x; ops[2] = 0x1000 | addr; count = 3; break;
+            case 3: ops[0] = 0x7000 | x | ((rng >> 24) & 3); ops[1] = 0x3000 | x | (rng >> 24); ops[2] = 0x1000 | addr; count = 3; break;
+        }
+        for (uint32_t k = 0; k < count && addr < 0x1000; k++, addr += 2) {
+            image->ram[addr] = ops[k] >> 8;
+            image->ram[addr + 1] = ops[k] & 0xFF;
+        }
+        addr -= 2;
+    }
+    image->rom_size = 0x1000 - 0x200;
+    build_fusion_table(image, set);
+    return image;
+}
 
-        case 0x0A:
-            // 0xANN: Set index register to address NNN
-            chip8->I = chip8->inst.nnn;
-            break;  
+// --diff: check the selected engine against the reference on the ROM, or on --diff-fuzz random ROMs
+bool run_diff(const config_t config, const char rom_name[]) {
+    const char *engine = (config.diff_engine == DIFF_FUSED) ? "fused" : "batch";
+    const uint32_t seed = config.diff_seed ? config.diff_seed : (uint32_t)time(NULL);
 
-        case 0x0B:
-            //Bnnn jump to V[0] + nnn address
-            chip8->PC = chip8->V[0] + chip8->inst.nnn;
-            break;  
+    // VIP timing runs every instruction on its own in either engine, so there is nothing to compare
+    if (config.vip_timing) {
+        SDL_Log("--diff cannot be combined with --vip-timing, VIP timing has no fused or batched engine to check\n");
+        return false;
+    }
 
-        case 0x0C:
-            //BXNN use rand() to generate a random number from 0-255 and bitwise and with inst.nn to store result in Vx
-            chip8->V[chip8->inst.x] = ((rand() % 256) & chip8->inst.nn);
-            break;
+    if (config.diff_fuzz == 0) {
+        rom_image_t *image = load_rom(config, rom_name);
+        if (!image) return false;
+        image->refs++;
+        const bool match = diff_run(config, image, seed);
+        release_rom_image(image);
 
-        case 0x0D: {
-    // Get coordinates from registers
-    uint8_t x_start = chip8->V[chip8->inst.x];
-    uint8_t y_start = chip8->V[chip8->inst.y];
-    //chip8->inst.n = 10;
-    uint8_t height = chip8->inst.n;
-    
-    // Log the instruction details
-    //SDL_Log("Drawing sprite: x=%d, y=%d, height=%d, I=0x%04X", 
-            //x_start, y_start, height, chip8->I);
-    
-    // Reset collision flag
-    chip8->V[0xF] = 0;
-    
-    // Draw each row of the sprite
-    for (uint8_t row = 0; row < height; row++) {
-        // Calculate Y position (with wrapping)
-        uint8_t y_pos = (y_start + row) % config.window_height;
-        
-        // Get the sprite row data from memory
-        uint8_t sprite_byte = chip8->ram[chip8->I + row];
-        
-        // Log the sprite data
-        //SDL_Log("  Row %d: Sprite data = 0x%02X", row, sprite_byte);
-        
-        // Draw each pixel in this row
-        for (uint8_t col = 0; col < 8; col++) {
-            // Calculate X position (with wrapping)
-            uint8_t x_pos = (x_start + col) % config.window_width;
-            
-            // Check if the current bit is set (MSB first)
-            bool sprite_bit = (sprite_byte & (0x80 >> col)) != 0;
-            
-            // Skip if bit is not set (optional optimization)
-            if (!sprite_bit) continue;
-            
-            // Calculate display buffer index
-            uint16_t display_idx = y_pos * config.window_width + x_pos;
-            
-            // Check for collision
-            if (chip8->display[display_idx]) {
-                chip8->V[0xF] = 1;
+        if (match) printf("diff: %s matches the reference over %u frames (seed 0x%08X)\n", engine, config.diff_frames, seed);
+        else printf("diff: replay with %s --diff %s --diff-seed 0x%08X\n", rom_name, engine, seed);
+        return match;
+    }
+
+    for (uint32_t run = 0; run < config.diff_fuzz; run++) {
+        const uint32_t run_seed = seed + run;
+        rom_image_t *image = fuzz_rom_image(run_seed, config.fusion_set);
+        if (!image) return false;
+        image->refs++;
+        const bool match = diff_run(config, image, run_seed);
+
+        if (!match) {
+            // Keep the ROM so the divergence can be replayed and debugged
+            char path[32];
+            snprintf(path, sizeof(path), "diff-%08X.ch8", run_seed);
+            FILE *out = fopen(path, "wb");
+            if (out) {
+                fwrite(&image->ram[0x200], 1, 0x1000 - 0x200, out);
+                fclose(out);
+                printf("diff: replay with %s --diff %s --diff-seed 0x%08X\n", path, engine, run_seed);
             }
-            
-            // XOR the pixel
-            chip8->display[display_idx] ^= true;
+            release_rom_image(image);
+            return false;
         }
+        release_rom_image(image);
     }
-    // Set draw flag when implemented
-    chip8->draw = true;
-    break;
+    printf("diff: %s matches the reference on %u random ROMs x %u frames (seeds 0x%08X-0x%08X)\n",
+           engine, config.diff_fuzz, config.diff_frames, seed, seed + config.diff_fuzz - 1);
+    return true;
 }
 
-        case 0x0E:
-            if(chip8->inst.nn == 0x9E){
-                // 0xEX9E: Skip next instruction if key in VX is pressed
-                if(chip8->keypad[chip8->V[chip8->inst.x]])
-                    chip8->PC += 2;
-            }
-            else if (chip8->inst.nn == 0xA1){
-                // 0xEX9E: Skip next instruction if key in VX is not pressed
-                if(!chip8->keypad[chip8->V[chip8->inst.x]]){
-                    chip8->PC += 2;
-                }
+// Coverage-guided fuzzing. A test case is a keypad mask per frame plus, with --fuzz-rom, a few
+// bytes patched into the ROM. Every execution starts from a saved power-on state, so nothing is
+// reloaded from disk and the RAM pages the last run wrote go back to the shared ROM image.
+#define FUZZ_CORPUS 4096            // Test cases kept for finding new coverage
+#define FUZZ_PATCHES 8              // ROM bytes a test case may patch
+#define FUZZ_FAULTS 256             // Unique faults reported
+
+typedef struct {
+    uint16_t addr[FUZZ_PATCHES];
+    uint8_t value[FUZZ_PATCHES];
+    uint32_t count;
+} fuzz_patch_t;
+
+static const char *const fault_names[FAULTS] = {
+    "none", "invalid-opcode", "memory", "stack-overflow", "stack-underflow",
+};
+
+// AFL-style hit count classes, so an edge running more often is only new at a power of two
+uint8_t coverage_bucket(const uint8_t hits) {
+    if (hits <= 2) return hits;
+    if (hits == 3) return 4;
+    if (hits < 8) return 8;
+    if (hits < 16) return 16;
+    if (hits < 32) return 32;
+    if (hits < 128) return 64;
+    return 128;
+}
+
+// Fold one execution's hit counts into seen, returns how many edge/class bits were new. Most of
+// the map is zero, so it is skipped a word at a time.
+uint32_t coverage_merge(const coverage_t *coverage, uint8_t seen[COVERAGE_SIZE]) {
+    uint32_t fresh = 0;
+    for (uint32_t w = 0; w < COVERAGE_SIZE; w += 8) {
+        uint64_t word;
+        memcpy(&word, &coverage->map[w], sizeof(word));
+        if (!word) continue;
+        for (uint32_t i = w; i < w + 8; i++) {
+            const uint8_t bucket = coverage_bucket(coverage->map[i]);
+            if (bucket & ~seen[i]) {
+                seen[i] |= bucket;
+                fresh++;
             }
-            break;
+        }
+    }
+    return fresh;
+}
 
-        case 0x0F: {
-            switch (chip8->inst.nn) {
-                case 0x0A: {
-                    bool any_key_pressed = false;
-                    for (uint8_t i = 0; i < sizeof(chip8->keypad); i++) {
-                        if (chip8->keypad[i]) {
-                            chip8->V[chip8->inst.x] = i; // Store the pressed key in V[x]
-                            any_key_pressed = true;
-                            break; // Exit the loop as soon as a key is found
-                        }
-                    }
-                    if (! any_key_pressed) {
-                        chip8->PC -= 2; // Decrement PC if no key is pressed
-                    }
-                }
-                    break;
+// Run one test case from the saved state. Returns the frames run, stopping after the frame
+// with the first fault.
+uint32_t fuzz_exec(chip8_t *chip8, const chip8_state_t *start, const config_t config, const uint16_t keys[],
+                   const uint32_t frames, const fuzz_patch_t *patch) {
+    load_state(chip8, start);
+    chip8->state = RUNNING;
+    chip8->fault = FAULT_NONE;
+    chip8->traps = 0;
+    for (uint32_t i = 0; patch && i < patch->count; i++) write_ram(chip8, patch->addr[i], patch->value[i]);
+    if (config.coverage) {
+        memset(config.coverage->map, 0, sizeof(config.coverage->map));
+        config.coverage->prev = 0;
+    }
 
-                case 0x1E: {
-                    //Adds VX to I. VF is not affected.
-                    chip8->I += chip8->V[chip8->inst.x] ;
-                }
-                    break;
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        chip8->keypad = keys[frame];
+        emulate_frame(chip8, config);
+        if (chip8->fault) return frame + 1;
+    }
+    return frames;
+}
 
-                case 07: {
-                    //set Vx = delay timer
-                    chip8->V[chip8->inst.x] = chip8->delay_timer;
-                }
-                    break;
+// Write the ROM with the test case's patches applied and the key presses up to the fault. The
+// .keys file starts with the RNG state the machine powered on with, so CXNN replays the same.
+bool fuzz_save_reproducer(const rom_image_t *image, const fuzz_patch_t *patch, const chip8_state_t *start,
+                          const uint16_t keys[], const uint32_t frames, const char path[], const char keys_path[]) {
+    uint8_t ram[4096];
+    uint32_t end = 0x200 + image->rom_size;
+    memcpy(ram, image->ram, sizeof(ram));
+    for (uint32_t i = 0; i < patch->count; i++) {
+        ram[patch->addr[i]] = patch->value[i];
+        if (patch->addr[i] >= end) end = patch->addr[i] + 1u;
+    }
 
-                case 0x15:{
-                    //Set delaytimer = Vx
-                    chip8->delay_timer = chip8->V[chip8->inst.x];
-                }
-                    break;
+    FILE *rom = fopen(path, "wb");
+    FILE *input = fopen(keys_path, "wb");
+    if (!rom || !input) {
+        SDL_Log("Could not write reproducer %s: %s\n", rom ? keys_path : path, strerror(errno));
+        if (rom) fclose(rom);
+        if (input) fclose(input);
+        return false;
+    }
+    fwrite(&ram[0x200], 1, end - 0x200, rom);
+    write_le(input, start->rng, 4);
+    for (uint32_t f = 0; f < frames; f++) write_le(input, keys[f], 2);
+    fclose(rom);
+    fclose(input);
+    return true;
+}
 
-                case 0x18:{
-                    //set the sound timer to Vx
-                    chip8->sound_timer = chip8->V[chip8->inst.x];
-                }
-                    break;
+uint32_t fuzz_next(uint32_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return *rng;
+}
 
-                case 0x29:{
-                    //Set I = location of sprite for digit Vx.
-                    chip8->I = chip8->V[chip8->inst.x] * 5;
-                }
+// Derive a new test case from a corpus entry: flip keys, hold a key over a stretch of frames,
+// splice in frames of another entry, or patch a ROM byte
+void fuzz_mutate(uint16_t keys[], fuzz_patch_t *patch, const uint16_t corpus_keys[], const uint32_t corpus_size,
+                 const uint32_t frames, const rom_image_t *image, const bool mutate_rom, uint32_t *rng) {
+    const uint32_t count = 1 + fuzz_next(rng) % 4;
+    for (uint32_t m = 0; m < count; m++) {
+        const uint32_t r = fuzz_next(rng);
+        const uint32_t frame = fuzz_next(rng) % frames;
+        switch (r % (mutate_rom ? 5 : 4)) {
+            case 0:
+                keys[frame] ^= 1u << ((r >> 8) % 16);
                 break;
-
-                case 0x33:{
-                    //The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at 
-                    //location I+1, and the ones digit at location I+2.
-                    uint8_t bcd = chip8->V[chip8->inst.x];
-                    chip8->ram[chip8->I+2] = bcd % 10;
-                    bcd = bcd/10;
-                    chip8->ram[chip8->I+1] = bcd % 10;
-                    bcd = bcd/10;
-                    chip8->ram[chip8->I] = bcd;
-                    } break;
-                
-                case 0x55: {
-                    //0xFx55 --> The interpreter copies the values of registers V0 through Vx into memory, starting at the address in I.
-                    //I itself is incremented in chip8 and chip48, but not in SCHIP
-                    for (uint8_t i = 0; i <= chip8->inst.x; i++) {
-                        if (config.current_extension == CHIP8) 
-                            chip8->ram[chip8->I++] = chip8->V[i]; // Increment I each time
-                        else
-                            chip8->ram[chip8->I + i] = chip8->V[i]; // I doesn't change
-                    }
-                }
+            case 1:
+                keys[frame] = (uint16_t)(r >> 16) & (uint16_t)(r >> 8);
+                break;
+            case 2: {
+                const uint16_t bit = 1u << ((r >> 8) % 16);
+                const uint32_t end = frame + 1 + (r >> 16) % 30;
+                for (uint32_t f = frame; f < end && f < frames; f++) keys[f] = (r & 0x80) ? keys[f] | bit : keys[f] & ~bit;
+                break;
+            }
+            case 3: {
+                const uint16_t *other = &corpus_keys[(size_t)((r >> 8) % corpus_size) * frames];
+                const uint32_t length = 1 + (r >> 20) % frames;
+                for (uint32_t f = frame; f < frame + length && f < frames; f++) keys[f] = other[f];
+                break;
+            }
+            case 4: {
+                const uint32_t size = image->rom_size ? image->rom_size : 2;
+                const uint16_t addr = 0x200 + (r >> 8) % size;
+                const uint32_t slot = patch->count < FUZZ_PATCHES ? patch->count++ : (r >> 4) % FUZZ_PATCHES;
+                patch->addr[slot] = addr;
+                patch->value[slot] = (r & 0x10) ? (uint8_t)(r >> 24) : image->ram[addr] ^ (1u << ((r >> 24) % 8));
                 break;
+            }
+        }
+    }
+}
 
-                case 0x65: {
-                                    // 0xFX65: Register load V0-VX inclusive from memory offset from I
-                    for (uint8_t i = 0; i <= chip8->inst.x; i++) {
-                        if (config.current_extension == CHIP8) 
-                            chip8->V[i] = chip8->ram[chip8->I++]; // Increment I each time
-                        else
-                            chip8->V[i] = chip8->ram[chip8->I + i]; // I doesn't change
-                        } 
-                    }
-                     break;
+// --fuzz: mutate test cases from a corpus, keep the ones that reach new PC edges, and save a
+// reproducer for every fault not seen before (same kind at the same address)
+bool run_fuzz(config_t config, const char rom_name[]) {
+    rom_image_t *image = load_rom(config, rom_name);
+    if (!image) return false;
+    image->refs++;
+
+    const uint32_t frames = config.fuzz_frames;
+    static uint32_t colors[64*32];
+    static coverage_t coverage;
+    static uint8_t seen[COVERAGE_SIZE];
+    chip8_t chip8 = {.pixel_color = colors};
+    chip8_state_t *start = calloc(1, sizeof(chip8_state_t));
+    uint16_t *corpus_keys = calloc((size_t)FUZZ_CORPUS * frames, sizeof(uint16_t));
+    fuzz_patch_t *corpus_patches = calloc(FUZZ_CORPUS, sizeof(fuzz_patch_t));
+    uint16_t *keys = calloc(frames, sizeof(uint16_t));
+    if (!start || !corpus_keys || !corpus_patches || !keys) {
+        SDL_Log("Could not allocate the fuzzing corpus\n");
+        free(start); free(corpus_keys); free(corpus_patches); free(keys);
+        release_rom_image(image);
+        return false;
+    }
 
-                default:
-                    // Handle unimplemented opcodes
-                    break;
+    config.fusion = false;          // Every instruction runs on its own so every edge is counted
+    config.log_traps = false;
+    config.profile = NULL;
+    config.trace = NULL;
+    config.metrics = NULL;
+    config.input = NULL;
+    config.sound = NULL;
+    config.coverage = &coverage;
+
+    // The seed drives both the mutator and the machine's RNG, so a campaign can be rerun exactly
+    const uint32_t seed = config.fuzz_seed ? config.fuzz_seed : (uint32_t)time(NULL);
+    uint32_t rng = seed | 1;
+    reset_chip8(&chip8, config, image);
+    chip8.rng = fuzz_next(&rng);
+    save_state(start, &chip8);
+    printf("fuzz: seed 0x%08X\n", seed);
+
+    uint32_t corpus_size = 1;       // Entry 0: no keys, no patches
+    uint32_t faults[FUZZ_FAULTS], fault_count = 0;
+    const uint64_t t0 = SDL_GetPerformanceCounter();
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t last_report = t0;
+
+    for (uint64_t exec = 0; exec < config.fuzz_execs; exec++) {
+        const uint32_t parent = fuzz_next(&rng) % corpus_size;
+        fuzz_patch_t patch = corpus_patches[parent];
+        memcpy(keys, &corpus_keys[(size_t)parent * frames], frames * sizeof(uint16_t));
+        if (exec) fuzz_mutate(keys, &patch, corpus_keys, corpus_size, frames, image, config.fuzz_rom, &rng);
+
+        const uint32_t ran = fuzz_exec(&chip8, start, config, keys, frames, &patch);
+
+        if (coverage_merge(&coverage, seen) && corpus_size < FUZZ_CORPUS) {
+            memcpy(&corpus_keys[(size_t)corpus_size * frames], keys, frames * sizeof(uint16_t));
+            corpus_patches[corpus_size++] = patch;
+        }
+
+        if (chip8.fault) {
+            const uint32_t id = (uint32_t)chip8.fault << 16 | chip8.fault_pc;
+            bool known = false;
+            for (uint32_t f = 0; f < fault_count; f++) known |= faults[f] == id;
+            if (!known && fault_count < FUZZ_FAULTS) {
+                faults[fault_count++] = id;
+                char path[64], keys_path[64];
+                snprintf(path, sizeof(path), "fuzz-%s-%03X.ch8", fault_names[chip8.fault], chip8.fault_pc);
+                snprintf(keys_path, sizeof(keys_path), "fuzz-%s-%03X.keys", fault_names[chip8.fault], chip8.fault_pc);
+                printf("fuzz: %s at 0x%03X after %u frames (exec %llu)\n", fault_names[chip8.fault],
+                       chip8.fault_pc, ran, (unsigned long long)exec);
+                if (fuzz_save_reproducer(image, &patch, start, keys, ran, path, keys_path)) {
+                    printf("fuzz: replay with %s --fuzz-replay %s\n", path, keys_path);
+                }
             }
-            break;
         }
-        default:
-            // Handle unimplemented opcodes
-            break;
-    } 
+
+        if ((exec & 0xFFF) == 0 && SDL_GetPerformanceCounter() - last_report > freq * 2) {
+            last_report = SDL_GetPerformanceCounter();
+            const double secs = (double)(last_report - t0) / (double)freq;
+            printf("fuzz: %llu execs (%.0f/s), corpus %u, faults %u\n", (unsigned long long)exec,
+                   exec / secs, corpus_size, fault_count);
+        }
+    }
+
+    uint32_t edges = 0;
+    for (uint32_t i = 0; i < COVERAGE_SIZE; i++) edges += seen[i] != 0;
+    const double secs = (double)(SDL_GetPerformanceCounter() - t0) / (double)freq;
+    printf("fuzz: %llu execs in %.1fs (%.0f/s), %u edges, corpus %u, %u unique faults (seed 0x%08X)\n",
+           (unsigned long long)config.fuzz_execs, secs, config.fuzz_execs / secs, edges, corpus_size, fault_count, seed);
+
+    free_chip8(&chip8);
+    free(start);
+    free(corpus_keys);
+    free(corpus_patches);
+    free(keys);
+    release_rom_image(image);
+    return fault_count == 0;
 }
 
-//update the timers every 60hz
-void update_timers(const sdl_t sdl, chip8_t *chip8){
-    if(chip8->delay_timer > 0)
-        chip8->delay_timer --;
-    
-    if(chip8->sound_timer > 0) {
-        chip8->sound_timer --;
-        SDL_PauseAudioDevice(sdl.dev, 0); // Unpause audio device
+// --fuzz-replay: run a reproducer's key presses on its ROM and report the fault it hits
+bool run_fuzz_replay(config_t config, const char rom_name[]) {
+    FILE *in = fopen(config.fuzz_replay, "rb");
+    if (!in) {
+        SDL_Log("Could not open %s: %s\n", config.fuzz_replay, strerror(errno));
+        return false;
+    }
+    uint8_t bytes[4];
+    uint16_t *keys = NULL;
+    uint32_t frames = 0;
+    const bool has_rng = fread(bytes, 1, 4, in) == 4;
+    const uint32_t rng = (uint32_t)read_le(bytes, 4);
+    while (fread(bytes, 1, 2, in) == 2) {
+        uint16_t *grown = realloc(keys, (frames + 1) * sizeof(uint16_t));
+        if (!grown) break;
+        keys = grown;
+        keys[frames++] = (uint16_t)read_le(bytes, 2);
     }
-    else {
-        SDL_PauseAudioDevice(sdl.dev, 1); // Pause audio device
+    fclose(in);
+
+    rom_image_t *image = load_rom(config, rom_name);
+    if (!image) {
+        free(keys);
+        return false;
+    }
+    image->refs++;
+    if (!has_rng || !rng || !frames) {
+        SDL_Log("%s holds no key presses\n", config.fuzz_replay);
+        release_rom_image(image);
+        free(keys);
+        return false;
     }
+
+    static uint32_t colors[64*32];
+    chip8_t chip8 = {.pixel_color = colors};
+    chip8_state_t *start = calloc(1, sizeof(chip8_state_t));
+    config.log_traps = false;
+    config.input = NULL;
+    config.sound = NULL;
+    reset_chip8(&chip8, config, image);
+    chip8.rng = rng;
+    if (start) save_state(start, &chip8);
+
+    const uint32_t ran = start ? fuzz_exec(&chip8, start, config, keys, frames, NULL) : 0;
+    if (chip8.fault) {
+        printf("fuzz: %s at 0x%03X after %u frames, I=0x%04X SP=%u\n", fault_names[chip8.fault], chip8.fault_pc,
+               ran, chip8.I, (uint32_t)(chip8.stack_ptr - chip8.stack));
+    } else {
+        printf("fuzz: no fault in %u frames\n", ran);
+    }
+
+    const bool faulted = chip8.fault != FAULT_NONE;
+    free_chip8(&chip8);
+    free(start);
+    free(keys);
+    release_rom_image(image);
+    return !faulted;
 }
 
+#ifndef CHIP8_NO_MAIN
 // MAIN function block
 int main(int argc, char **argv) 
 {
@@ -1153,65 +5742,263 @@ int main(int argc, char **argv)
     config_t config = {0};
     if (!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
 
+    // Superinstructions come from an opcode profile, or the built-in sequences without one
+    fusion_set_t fusion_set;
+    if (!load_fusion_set(&fusion_set, config.fusion_profile)) exit(EXIT_FAILURE);
+    config.fusion_set = &fusion_set;
+
+    //Seed random number generator so that each instance's rng starts from a different sequence
+    srand(time(NULL));
+
+    // Pack a ROM directory, argv[1] is the directory
+    if (config.pack_out) {
+        exit(run_pack(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // ROMs come from a mapped pack instead of files, the ROM's entry sets its mode, speed and colors
+    rom_pack_t pack = {0};
+    if (config.pack_path) {
+        pack_entry_t entry;
+        if (!open_rom_pack(&pack, config.pack_path)) exit(EXIT_FAILURE);
+        if (!rom_pack_lookup(&pack, argv[1], &entry)) {
+            SDL_Log("Rom %s is not in %s\n", argv[1], config.pack_path);
+            exit(EXIT_FAILURE);
+        }
+        apply_pack_entry(&config, &entry);
+        config.pack = &pack;
+    }
+
+    // Headless differential check of a fast engine against the reference
+    if (config.diff_engine != DIFF_OFF) {
+        exit(run_diff(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Headless coverage-guided fuzzing of the ROM, or replay of a reproducer it saved
+    if (config.fuzz_replay) {
+        exit(run_fuzz_replay(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (config.fuzz_execs) {
+        exit(run_fuzz(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Offline conversion of a recording, argv[1] is the .c8v file
+    if (config.convert_path) {
+        exit(convert_av(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Headless batched benchmark, needs no window
+    if (config.batch_lanes > 0) {
+        run_batch_benchmark(config, argv[1]);
+        exit(EXIT_SUCCESS);
+    }
+
     // Initialize chip8 machine
-    chip8_t chip8 = {0};
+    static uint32_t pixel_color[64*32];
+    chip8_t chip8 = {.pixel_color = pixel_color};
     const char *rom_name = argv[1];
     if (!init_chip8(&chip8, config, rom_name)) {
         exit(EXIT_FAILURE);
     }
 
+    // Optional ROM library, preloaded so ROMs can be switched at runtime. A pack is a library
+    // of its own, its ROMs are loaded when switched to.
+    rom_library_t library = {0};
+    if (config.rom_dir) {
+        if (!init_rom_library(&library, config.rom_dir, rom_name, config.fusion_set)) exit(EXIT_FAILURE);
+        config.library = &library;
+    } else if (config.pack) {
+        if (!init_rom_library_from_pack(&library, config.pack, rom_name)) exit(EXIT_FAILURE);
+        config.library = &library;
+    }
+
     // Initialize SDL
     sdl_t sdl = {0};
-    if (!init_sdl(&sdl, &config)) {
+    audio_t audio = {0};
+    if (!init_sdl(&sdl, &config, &audio)) {
         exit(EXIT_FAILURE);
     }
 
     // Initial screen clear
     clear_screen(sdl, config);
 
-    //Seed random number generator so that it generates different sequence of numbers
-    srand(time(NULL));
+    // Optional metrics export, written out by a background thread
+    metrics_t metrics = {0};
+    if (config.metrics_path) {
+        if (!init_metrics(&metrics, config)) {
+            final_cleanup(sdl);
+            exit(EXIT_FAILURE);
+        }
+        config.metrics = &metrics;
+        audio.metrics = &metrics;
+    }
+
+    // Grid mode hosts many instances in this window instead of the single machine below
+    if (config.grid_count > 0) {
+        if (config.record_path) SDL_Log("--record-av only records a single machine, grid mode is not recorded\n");
+        run_grid(sdl, &config, rom_name);
+        metrics_cleanup(&metrics);
+        rom_library_cleanup(&library);
+        final_cleanup(sdl);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Optional opcode sequence profile, printed at exit
+    if (config.profile_opcodes) {
+        config.profile = calloc(1, sizeof(profile_t));
+        if (!config.profile) {
+            SDL_Log("Could not allocate the opcode profile\n");
+            final_cleanup(sdl);
+            exit(EXIT_FAILURE);
+        }
+        config.profile->prev_addr[0] = config.profile->prev_addr[1] = 0x10000;  // No predecessor yet
+    }
+
+    // Optional zero-copy export of frames and keypad to other processes
+    shm_t shm = {0};
+    if (config.shm_name && !init_shm(&shm, config)) {
+        final_cleanup(sdl);
+        exit(EXIT_FAILURE);
+    }
+
+    // Optional rollback netplay with a second emulator over UDP
+    netplay_t netplay = {.sock = -1};
+    if (config.netplay_port && !init_netplay(&netplay, &chip8, config)) {
+        netplay_cleanup(&netplay);
+        final_cleanup(sdl);
+        exit(EXIT_FAILURE);
+    }
+
+    // Optional A/V recording, encoded and written by a background thread
+    recorder_t *recorder = NULL;
+    if (config.record_path) {
+        recorder = calloc(1, sizeof(recorder_t));
+        if (!recorder || !init_recorder(recorder, config, sdl.have.freq, sdl.have.samples)) {
+            SDL_Log("Could not start recording to %s\n", config.record_path);
+            free(recorder);
+            netplay_cleanup(&netplay);
+            final_cleanup(sdl);
+            exit(EXIT_FAILURE);
+        }
+        audio.recorder = recorder;
+    }
 
     // Main emulator loop
+    // Blocking for input is only safe when nothing else can change the machine in the meantime
+    const bool can_idle = !config.netplay_port && !shm.frame && !recorder;
+    frame_timer_t timer;
+    init_frame_timer(&timer);
+    uint64_t last_frame = 0;
+
+    // Key changes are queued with their timestamps and replayed inside the next frame. Netplay
+    // keeps frame-granular input, both peers have to agree on the keypad at each frame.
+    input_queue_t input = { .probe = config.latency_probe, .window_start = SDL_GetTicks() };
+    if (!config.netplay_port) config.input = &input;
+
+    // RAM search on F1-F7, starting out with every address a candidate
+    ram_search_t search;
+    uint8_t ram[4096];
+    copy_ram(&chip8, ram);
+    ram_search_begin(&search, ram);
+    config.search = &search;
+
+    // Performance HUD, hidden until H is pressed
+    hud_t hud = {0};
+    config.hud = &hud;
+
+    // Sound is gated by timestamped events and the device keeps running. Netplay re-simulates
+    // frames on rollback, so it keeps pausing the device from the confirmed beeper state.
+    if (!config.netplay_port) {
+        config.sound = &audio.sound;
+        audio.gate = false;         // The device is still paused, the callback is not running yet
+        pause_audio(sdl, false);
+    }
+
     while (chip8.state != QUIT) {
-        // Handle input
+        // Wait for the 60hz frame deadline, then read input as late as possible before emulating
+        wait_frame(&timer);
         handle_input(&chip8, &config);
 
-        if(chip8.state == PAUSED) continue;
+        if(chip8.state == PAUSED) {
+            // Sleep until the next event instead of spinning a core
+            if (config.sound) sound_gate(config.sound, 0, false, true);
+            else pause_audio(sdl, true);
+            if (recorder) atomic_store_explicit(&recorder->paused, true, memory_order_relaxed);
+            wait_for_input(&chip8, &config);
+            timer.deadline = 0;
+            last_frame = 0;             // Time spent paused is not a frame
+            continue;
+        }
+
+        if (shm.frame) shm_read_keypad(&shm, &chip8);
+        if (recorder) atomic_store_explicit(&recorder->paused, false, memory_order_relaxed);
 
-        //Get_time();
-        const uint64_t start_frame_time = SDL_GetPerformanceCounter();
         //emulate chip8 instructions
-        // Emulate CHIP8 Instructions for this emulator "frame" (60hz)
-        for (uint32_t i = 0; i < config.instr_per_sec / 60; i++) {
-            emu_instr(&chip8, config);
-
-            // If drawing on CHIP8, only draw 1 sprite this frame (display wait)
-            // This matches original CHIP8's behavior where sprite drawing takes time
-            if ((config.current_extension == CHIP8) && 
-                ((chip8.inst.opcode >> 12) == 0xD)) 
-                break;
+        const uint64_t emulate_start = SDL_GetPerformanceCounter();
+        if (config.netplay_port) {
+            netplay_frame(&netplay, &chip8, config);
+        } else {
+            input_schedule(&input, chip8.tick_slots);
+            // Catches a beep resumed after a pause, or cut short by a reset
+            sound_gate(config.sound, sound_time(&chip8, &config), get_sound_timer(&chip8) > 0, false);
+            emulate_frame(&chip8, config);
+        }
+
+        //update screen window with changes, and keep going while colors are still fading
+        const uint64_t render_start = SDL_GetPerformanceCounter();
+        if(chip8.draw || chip8.fade_rows || hud.visible || sdl.hud_drawn){
+            update_screen(&sdl, config, &chip8);
         }
-        // Clear the screen to the background color on every frame
-        const uint64_t end_frame_time = SDL_GetPerformanceCounter();
+        const uint64_t render_end = SDL_GetPerformanceCounter();
+        if (input.probe) input_probe(&input, &chip8);
 
-        const double time_lapsed = (double)((end_frame_time - start_frame_time) * 1000)/SDL_GetPerformanceFrequency();
+        if (config.netplay_port) {
+            // Timers already ticked with each simulated netplay frame
+            pause_audio(sdl, !netplay.beeping);
+        } else {
+            update_sound(sdl, &config, &chip8);
+        }
+        sync_audio(sdl, &chip8);
 
-        //clear_screen(sdl, config);
+        if (shm.frame) shm_publish(&shm, &chip8);
 
-        // Delay for approximately 60Hz/60FPS
-        SDL_Delay(16.67f > time_lapsed ? 16.67 - time_lapsed : 0);
+        if (recorder) record_frame(recorder, &chip8, SDL_GetAudioDeviceStatus(sdl.dev) == SDL_AUDIO_PLAYING);
 
-        //update screen window with changes
-        if(chip8.draw){
-            update_screen(sdl, config, &chip8);
-            chip8.draw = false;
+        const uint64_t now = SDL_GetPerformanceCounter();
+        if (last_frame) {
+            if (config.metrics) metrics_record_frame(config.metrics, now - last_frame);
+            hud_record_frame(&hud, now - last_frame, render_start - emulate_start, render_end - render_start);
+        }
+        last_frame = now;
+
+        // A guest waiting on FX0A with its timers run down and the screen settled only changes
+        // on a key press, so block for it
+        if (can_idle && waiting_for_key(&chip8) && !get_delay_timer(&chip8) && !get_sound_timer(&chip8) &&
+            !chip8.draw && !chip8.fade_rows) {
+            wait_for_input(&chip8, &config);
+            timer.deadline = 0;
+            last_frame = 0;
         }
+    }
 
-        update_timers(sdl, &chip8);
+    if (input.probe_count) {
+        printf("Input latency over %u presses: min %u ms, mean %.1f ms, max %u ms\n", input.probe_count,
+               input.probe_min, (double)input.probe_sum / input.probe_count, input.probe_max);
     }
 
     // Final cleanup
+    recorder_cleanup(sdl, recorder);
+    free(recorder);
+    netplay_cleanup(&netplay);
+    shm_cleanup(&shm);
+    metrics_cleanup(&metrics);
+    if (config.profile) print_profile(config.profile);
+    if (config.profile_out) save_profile(config.profile, config.profile_out);
+    free(config.profile);
+    if (chip8.traps > 1) SDL_Log("%u invalid opcodes skipped since the last reset\n", chip8.traps);
+    free_chip8(&chip8);
+    rom_library_cleanup(&library);
+    close_rom_pack(&pack);
     final_cleanup(sdl);
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
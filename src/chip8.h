@@ -0,0 +1,77 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Headless batched engine: many machines stepped in lockstep, registers stored structure-of-arrays.
+// Build as a library with `make lib`.
+typedef struct batch batch_t;
+
+// extension: 0 = CHIP-8, 1 = SUPERCHIP, 2 = XO-CHIP. Returns NULL on failure.
+batch_t *batch_create(uint32_t lanes, const char rom_name[], int extension, uint32_t instr_per_sec);
+void batch_destroy(batch_t *batch);
+
+// Put every lane back to its power-on state
+void batch_reset(batch_t *batch);
+
+// Rewards are the per-frame change of the byte at addr (0 = rewards off)
+void batch_set_reward_addr(batch_t *batch, uint16_t addr);
+
+// Run one 60hz frame on every lane. actions[lane] is that lane's keypad mask (bit n = key n),
+// rewards[lane] receives that lane's reward, and may be NULL.
+void batch_step(batch_t *batch, const uint16_t actions[], float rewards[]);
+
+// Observation buffer, 64*32 bytes (0 or 1) per lane, lane after lane. Stays valid until
+// batch_destroy and is updated in place by batch_step.
+const uint8_t *batch_frames(const batch_t *batch);
+
+// RAM search: find the addresses holding a value such as score, lives or position by filtering
+// successive snapshots of a lane's 4 KB of RAM. Candidates are kept as a 4096-bit set.
+typedef struct ram_search ram_search_t;
+
+// Filters compare each remaining address against its value in the previous snapshot
+enum {
+    RAM_SEARCH_UNCHANGED,
+    RAM_SEARCH_CHANGED,
+    RAM_SEARCH_INCREASED,
+    RAM_SEARCH_DECREASED,
+    RAM_SEARCH_EQUALS,              // Equal to the given value, the previous snapshot is not used
+};
+
+ram_search_t *ram_search_create(void);
+void ram_search_destroy(ram_search_t *search);
+
+// Snapshot the lane's RAM and make every address a candidate again
+void ram_search_reset(ram_search_t *search, const batch_t *batch, uint32_t lane);
+
+// Snapshot the lane's RAM again and keep only the candidates that pass filter. value is only
+// used by RAM_SEARCH_EQUALS. Returns how many candidates are left.
+uint32_t ram_search_step(ram_search_t *search, const batch_t *batch, uint32_t lane, int filter, uint8_t value);
+
+// Candidate set, 64 words: address a is bit a % 64 of word a / 64. Valid until ram_search_destroy.
+const uint64_t *ram_search_candidates(const ram_search_t *search);
+
+// Shared-memory frame export (--shm): the layout of the segment the emulator publishes every
+// frame into. Check magic and version before reading, version is bumped on any layout change.
+// Readers retry while seq is odd or changes during their copy.
+#define SHM_MAGIC 0x4D533843    // "C8SM"
+#define SHM_VERSION 1
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint32_t seq;           // Seqlock sequence, odd while a frame is being written
+    _Atomic uint16_t keypad;        // Written by external processes, bit n holds key n down
+    uint16_t reserved;
+    uint64_t frame;                 // Frame sequence number
+    bool display[64*32];
+    uint32_t pixel_color[64*32];
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+} shm_frame_t;
+
+#endif